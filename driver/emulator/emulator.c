@@ -0,0 +1,1042 @@
+/* Ether Dream DAC emulator
+ *
+ * Copyright 2011-2012 Jacob Potter
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or 3, or the GNU Lesser General Public License version 3, as published
+ * by the Free Software Foundation, at your option.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This speaks the same protocol on port 7765 as the firmware does (see
+ * firmware/net/point-stream.c and firmware/lib/dac.c), and sends the same
+ * broadcasts on port 7654, so that host software can be tested and
+ * benchmarked without a DAC. Points are played out of the buffer in real
+ * time at the requested rate, rate changes are taken from the rate queue
+ * when a point carrying DAC_CTRL_RATE_CHANGE is played, and running out of
+ * points stops playback with the underflow flag set, just as on hardware.
+ *
+ * Playback is computed lazily: rather than waking up for every point, each
+ * DAC is brought up to date whenever something asks about it, so timing is
+ * exact no matter how late poll() wakes up.
+ *
+ * With -L, the u1 and u2 channels of each played point are read as the high
+ * and low halves of a CLOCK_MONOTONIC timestamp in microseconds, and the
+ * time from then until the point is played is recorded; points with both
+ * zero are ignored. This is how bench.c measures write-to-emit latency.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <protocol.h>
+
+#define MAX_DACS		64
+#define MAX_CONNS		4
+#define DEFAULT_BUFFER_POINTS	1800
+#define RATE_BUFFER_SIZE	200
+#define DEFAULT_MAX_POINT_RATE	100000
+#define BROADCAST_PORT		7654
+#define BROADCAST_INTERVAL	1000000
+#define READ_BUF_SIZE		65536
+#define WRITE_BUF_SIZE		65536
+#define LATENCY_BUCKET_US	10
+#define LATENCY_BUCKETS		100000
+
+/* From firmware/inc/dac.h and firmware/inc/lightengine.h */
+enum dac_state {
+	DAC_IDLE = 0,
+	DAC_PREPARED = 1,
+	DAC_PLAYING = 2
+};
+
+#define DAC_FLAG_SHUTTER	(1 << 0)
+#define DAC_FLAG_STOP_UNDERFLOW	(1 << 1)
+#define DAC_FLAG_STOP_ESTOP	(1 << 2)
+#define DAC_FLAG_STOP_ALL	0x0E
+
+enum le_state {
+	LIGHTENGINE_READY = 0,
+	LIGHTENGINE_ESTOP = 3
+};
+
+#define ESTOP_PACKET		(1 << 0)
+#define ESTOP_CLEAR_ALL		0x2B
+
+struct emu_conn {
+	int fd;
+	double drop_at;
+	enum {
+		MAIN, DATA, DATA_ABORTING, INSTALL
+	} state;
+	int pointsleft;
+
+	uint8_t in[READ_BUF_SIZE];
+	int in_len;
+	uint8_t out[WRITE_BUF_SIZE];
+	int out_len;
+};
+
+struct emu_stats {
+	unsigned long long points_received;
+	unsigned long long points_played;
+	unsigned long packets;
+	unsigned long rate_queued;
+	unsigned long rate_changes;
+	unsigned long rate_rejected;
+	unsigned long naks;
+	unsigned long underflows;
+	unsigned long overflows;
+	unsigned long drops;
+
+	/* With -L, a histogram of stamp-to-emit latency */
+	uint32_t *latency;
+	unsigned long latency_samples;
+};
+
+struct emu_dac {
+	struct in_addr addr;
+	uint8_t mac_address[6];
+	int listen_fd;
+	int udp_fd;
+	struct emu_conn *conns[MAX_CONNS];
+
+	/* Playback state, as in dac_control */
+	enum dac_state state;
+	int flags;
+	int pps;
+	uint32_t count;
+	double next_point;
+	struct dac_point *buffer;
+	int produce;
+	int consume;
+
+	uint32_t rate_buffer[RATE_BUFFER_SIZE];
+	int rate_produce;
+	int rate_consume;
+
+	enum le_state le_state;
+	int le_flags;
+
+	struct emu_stats stats;
+};
+
+static struct emu_dac dacs[MAX_DACS];
+static int ndacs = 1;
+static int buffer_points = DEFAULT_BUFFER_POINTS;
+static int max_point_rate = DEFAULT_MAX_POINT_RATE;
+static int verbose;
+static int latency_probe;
+static int drop_interval;
+static struct sockaddr_in broadcast_addr;
+static volatile sig_atomic_t done;
+
+/* microseconds()
+ *
+ * Return the time, in microseconds, on a monotonic clock.
+ */
+static double microseconds(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000.0 + t.tv_nsec / 1000.0;
+}
+
+/* outputf(d, fmt, ...)
+ *
+ * Log a message about d, if running verbosely.
+ */
+static void outputf(struct emu_dac *d, const char *fmt, ...) {
+	va_list args;
+
+	if (!verbose)
+		return;
+
+	fprintf(stderr, "[%.6f] %02x%02x%02x ", microseconds() / 1000000,
+	        d->mac_address[3], d->mac_address[4], d->mac_address[5]);
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fputc('\n', stderr);
+}
+
+/* dac_fullness(d)
+ *
+ * Return the number of points in d's buffer.
+ */
+static int dac_fullness(struct emu_dac *d) {
+	int fullness = d->produce - d->consume;
+	if (fullness < 0)
+		fullness += buffer_points;
+	return fullness;
+}
+
+/* dac_stop(d, flags)
+ *
+ * Stop playback and return to idle, setting flags to say why.
+ */
+static void dac_stop(struct emu_dac *d, int flags) {
+	if (flags)
+		outputf(d, "stop: flags %x, count %u", flags, d->count);
+	d->state = DAC_IDLE;
+	d->count = 0;
+	d->flags &= ~DAC_FLAG_SHUTTER;
+	d->flags |= flags;
+}
+
+/* dac_pop_rate_change(d)
+ *
+ * Take the next rate off d's rate queue, if there is one.
+ */
+static void dac_pop_rate_change(struct emu_dac *d) {
+	if (d->rate_consume == d->rate_produce)
+		return;
+
+	d->pps = d->rate_buffer[d->rate_consume];
+	d->rate_consume = (d->rate_consume + 1) % RATE_BUFFER_SIZE;
+	d->stats.rate_changes++;
+}
+
+/* record_latency(d, p)
+ *
+ * Note the latency of a timestamped point that is being played now.
+ */
+static void record_latency(struct emu_dac *d, const struct dac_point *p) {
+	uint32_t stamp = ((uint32_t)p->u1 << 16) | p->u2;
+	uint32_t latency = (uint32_t)(long long)d->next_point - stamp;
+	uint32_t bucket = latency / LATENCY_BUCKET_US;
+
+	if (bucket >= LATENCY_BUCKETS)
+		bucket = LATENCY_BUCKETS - 1;
+	d->stats.latency[bucket]++;
+	d->stats.latency_samples++;
+}
+
+/* latency_percentile(s, pct)
+ *
+ * Return the latency, in microseconds, below which pct percent of the
+ * samples in s fall.
+ */
+static long latency_percentile(const struct emu_stats *s, int pct) {
+	unsigned long want = (s->latency_samples * pct + 99) / 100, seen = 0;
+	long i;
+
+	if (!s->latency_samples)
+		return 0;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += s->latency[i];
+		if (seen >= want)
+			break;
+	}
+
+	return (i + 1) * LATENCY_BUCKET_US;
+}
+
+/* dac_run(d, now)
+ *
+ * Play every point that d would have played by time now.
+ */
+static void dac_run(struct emu_dac *d, double now) {
+	while (d->state == DAC_PLAYING && d->next_point <= now) {
+		if (d->produce == d->consume) {
+			d->stats.underflows++;
+			dac_stop(d, DAC_FLAG_STOP_UNDERFLOW);
+			break;
+		}
+
+		/* As on hardware, a rate change takes effect from the point
+		 * after the one that carries the flag. */
+		const struct dac_point *p = &d->buffer[d->consume];
+		d->consume = (d->consume + 1) % buffer_points;
+		d->count++;
+		d->stats.points_played++;
+		if (latency_probe && (p->u1 || p->u2))
+			record_latency(d, p);
+		if (p->control & DAC_CTRL_RATE_CHANGE)
+			dac_pop_rate_change(d);
+
+		d->next_point += 1000000.0 / d->pps;
+	}
+}
+
+/* dac_deadline(d)
+ *
+ * Return the time at which d will underflow if no more data arrives, or 0
+ * if it is not playing.
+ */
+static double dac_deadline(struct emu_dac *d) {
+	if (d->state != DAC_PLAYING)
+		return 0;
+	return d->next_point + dac_fullness(d) * 1000000.0 / d->pps;
+}
+
+/* fill_status(d, status)
+ *
+ * Fill in a struct dac_status with d's current state.
+ */
+static void fill_status(struct emu_dac *d, struct dac_status *status) {
+	status->protocol = 0;
+	status->light_engine_state = d->le_state;
+	status->playback_state = d->state;
+	status->playback_flags = d->flags;
+	status->light_engine_flags = d->le_state;
+	status->buffer_fullness = dac_fullness(d);
+
+	/* Only report a point rate if currently playing */
+	if (d->state == DAC_PLAYING)
+		status->point_rate = d->pps;
+	else
+		status->point_rate = 0;
+
+	status->point_count = d->count;
+	status->source = 0;
+	status->source_flags = 0;
+}
+
+/* queue_output(c, data, len)
+ *
+ * Append data to c's output buffer. Returns 0 on success, -1 if the client
+ * has stopped reading.
+ */
+static int queue_output(struct emu_conn *c, const void *data, int len) {
+	if (c->out_len + len > WRITE_BUF_SIZE)
+		return -1;
+	memcpy(c->out + c->out_len, data, len);
+	c->out_len += len;
+	return 0;
+}
+
+/* send_resp(d, c, resp, cmd, len)
+ *
+ * Queue a response to c. Returns len on success, or -1 if the connection
+ * should be closed; like the firmware's send_resp(), this lets the parser
+ * tail-call it with the number of bytes consumed.
+ */
+static int send_resp(struct emu_dac *d, struct emu_conn *c, char resp,
+                     char cmd, int len) {
+	struct dac_response response;
+	response.response = resp;
+	response.command = cmd;
+	fill_status(d, &response.dac_status);
+
+	if (resp != RESP_ACK)
+		d->stats.naks++;
+
+	if (queue_output(c, &response, sizeof response) < 0) {
+		outputf(d, "client not reading; dropping connection");
+		return -1;
+	}
+
+	return len;
+}
+
+/* dac_prepare(d), dac_start(d), dac_rate_queue(d, pps)
+ *
+ * As in firmware/lib/dac.c.
+ */
+static int dac_prepare(struct emu_dac *d) {
+	if (d->state != DAC_IDLE || d->le_state != LIGHTENGINE_READY)
+		return -1;
+
+	d->produce = d->consume = 0;
+	d->rate_produce = d->rate_consume = 0;
+	d->flags &= ~DAC_FLAG_STOP_ALL;
+	d->state = DAC_PREPARED;
+	return 0;
+}
+
+static int dac_start(struct emu_dac *d, double now) {
+	if (d->state != DAC_PREPARED || !d->pps)
+		return -1;
+
+	outputf(d, "start: %d pps, %d points buffered", d->pps,
+	        dac_fullness(d));
+	d->state = DAC_PLAYING;
+	d->flags |= DAC_FLAG_SHUTTER;
+	d->next_point = now + 1000000.0 / d->pps;
+	return 0;
+}
+
+static int dac_rate_queue(struct emu_dac *d, int pps) {
+	int fullness = d->rate_produce - d->rate_consume;
+	if (fullness < 0)
+		fullness += RATE_BUFFER_SIZE;
+
+	if (d->state == DAC_IDLE || fullness >= RATE_BUFFER_SIZE - 1) {
+		d->stats.rate_rejected++;
+		return -1;
+	}
+
+	d->rate_buffer[d->rate_produce] = pps;
+	d->rate_produce = (d->rate_produce + 1) % RATE_BUFFER_SIZE;
+	d->stats.rate_queued++;
+	return 0;
+}
+
+/* dac_space(d)
+ *
+ * Return how many points can be written contiguously at d->produce, or -1
+ * if d is idle. As with dac_request() in the firmware, the buffer only ever
+ * fills to one point short of full.
+ */
+static int dac_space(struct emu_dac *d) {
+	if (d->state == DAC_IDLE)
+		return -1;
+
+	if (d->produce >= d->consume) {
+		if (d->consume == 0)
+			return buffer_points - d->produce - 1;
+		return buffer_points - d->produce;
+	}
+
+	return d->consume - d->produce - 1;
+}
+
+/* recv_fsm(d, c, data, len, now)
+ *
+ * Handle one command (or one run of points) from the start of data. Returns
+ * the number of bytes consumed, 0 if more data is needed first, or -1 if the
+ * connection should be closed. This follows recv_fsm() in
+ * firmware/net/point-stream.c; where the firmware NAKs a bad begin, update
+ * or queue command after consuming only its first byte, we skip the whole
+ * command, since the firmware would go on to parse the rest as garbage.
+ */
+static int recv_fsm(struct emu_dac *d, struct emu_conn *c, uint8_t *data,
+                    int len, double now) {
+	uint8_t cmd = *data;
+	int npoints;
+
+	switch (c->state) {
+	case MAIN:
+		switch (cmd) {
+		case 'p':
+			if (dac_prepare(d) < 0)
+				return send_resp(d, c, RESP_NAK_INVL, cmd, 1);
+			return send_resp(d, c, RESP_ACK, cmd, 1);
+
+		case 'b':
+		case 'u': {
+			/* Update and Begin use the same packet format */
+			if (len < (int)sizeof(struct begin_command))
+				return 0;
+
+			struct begin_command bc;
+			memcpy(&bc, data, sizeof bc);
+
+			if (bc.point_rate > (uint32_t)max_point_rate
+			    || !bc.point_rate)
+				return send_resp(d, c, RESP_NAK_INVL, cmd,
+				                 sizeof bc);
+
+			d->pps = bc.point_rate;
+			if (cmd == 'b')
+				dac_start(d, now);
+
+			return send_resp(d, c, RESP_ACK, cmd, sizeof bc);
+		}
+
+		case 'q': {
+			if (len < (int)sizeof(struct queue_command))
+				return 0;
+
+			struct queue_command qc;
+			memcpy(&qc, data, sizeof qc);
+
+			if (qc.point_rate > (uint32_t)max_point_rate
+			    || !qc.point_rate)
+				return send_resp(d, c, RESP_NAK_INVL, cmd,
+				                 sizeof qc);
+
+			dac_rate_queue(d, qc.point_rate);
+			return send_resp(d, c, RESP_ACK, cmd, sizeof qc);
+		}
+
+		case 'd':
+		case 'D': {
+			if (len < (int)sizeof(struct data_command_header))
+				return 0;
+
+			struct data_command_header h;
+			memcpy(&h, data, sizeof h);
+			d->stats.packets++;
+
+			if (!h.npoints)
+				return send_resp(d, c, RESP_ACK, cmd, sizeof h);
+
+			/* There's no way to run a plugin here, so plugin
+			 * data is always discarded and NAKed, as it is on a
+			 * DAC without a plugin installed. */
+			c->state = (cmd == 'd') ? DATA : DATA_ABORTING;
+			c->pointsleft = h.npoints;
+			return sizeof h;
+		}
+
+		case 's':
+			if (d->state == DAC_IDLE)
+				return send_resp(d, c, RESP_NAK_INVL, cmd, 1);
+			dac_stop(d, 0);
+			return send_resp(d, c, RESP_ACK, cmd, 1);
+
+		case 0:
+		case 0xFF:
+			/* Emergency-stop. */
+			outputf(d, "e-stop");
+			d->le_flags |= ESTOP_PACKET;
+			d->le_state = LIGHTENGINE_ESTOP;
+			dac_stop(d, DAC_FLAG_STOP_ESTOP);
+			return send_resp(d, c, RESP_ACK, cmd, 1);
+
+		case 'c':
+			/* Clear e-stop. */
+			d->le_flags &= ~ESTOP_CLEAR_ALL;
+			if (!d->le_flags)
+				d->le_state = LIGHTENGINE_READY;
+			if (d->le_state == LIGHTENGINE_READY)
+				return send_resp(d, c, RESP_ACK, cmd, 1);
+			return send_resp(d, c, RESP_NAK_ESTOP, cmd, 1);
+
+		case '?':
+			/* Ping */
+			return send_resp(d, c, RESP_ACK, cmd, 1);
+
+		case 'I':
+			/* Install plugin: swallow it and NAK at the end. */
+			c->state = INSTALL;
+			c->pointsleft = PLUGIN_SIZE;
+			return 1;
+
+		case 'P':
+			if (len < 17)
+				return 0;
+			return send_resp(d, c, RESP_NAK_INVL, cmd, 17);
+
+		case 'v': {
+			char version[32];
+			memset(version, 0, sizeof version);
+			strncpy(version, "emulator", sizeof version - 1);
+			if (queue_output(c, version, sizeof version) < 0)
+				return -1;
+			return 1;
+		}
+
+		default:
+			outputf(d, "unknown cmd 0x%02x", cmd);
+			return -1;
+		}
+
+	case INSTALL:
+		npoints = len;
+		if (npoints > c->pointsleft)
+			npoints = c->pointsleft;
+		c->pointsleft -= npoints;
+		if (c->pointsleft)
+			return npoints;
+
+		c->state = MAIN;
+		return send_resp(d, c, RESP_NAK_INVL, 'I', npoints);
+
+	case DATA: {
+		/* We can only write a complete point at a time. */
+		if (len < (int)sizeof(struct dac_point))
+			return 0;
+
+		npoints = len / sizeof(struct dac_point);
+		if (npoints > c->pointsleft)
+			npoints = c->pointsleft;
+
+		/* If there's no room at all, discard the rest of this
+		 * command and NAK it once it's over. */
+		int nready = dac_space(d);
+		if (nready <= 0) {
+			outputf(d, "%s: wanted to write %d",
+			        nready ? "idle" : "overflow", npoints);
+			d->stats.overflows++;
+			c->state = DATA_ABORTING;
+			goto handle_aborted_data;
+		}
+
+		if (npoints > nready)
+			npoints = nready;
+
+		memcpy(&d->buffer[d->produce], data,
+		       npoints * sizeof(struct dac_point));
+		d->produce = (d->produce + npoints) % buffer_points;
+		d->stats.points_received += npoints;
+
+		c->pointsleft -= npoints;
+		if (!c->pointsleft) {
+			c->state = MAIN;
+			return send_resp(d, c, RESP_ACK, 'd',
+			                 npoints * sizeof(struct dac_point));
+		}
+		return npoints * sizeof(struct dac_point);
+	}
+
+	case DATA_ABORTING:
+		if (len < (int)sizeof(struct dac_point))
+			return 0;
+
+		npoints = len / sizeof(struct dac_point);
+		if (npoints > c->pointsleft)
+			npoints = c->pointsleft;
+
+handle_aborted_data:
+		c->pointsleft -= npoints;
+		if (!c->pointsleft) {
+			c->state = MAIN;
+			return send_resp(d, c, RESP_NAK_INVL, 'd',
+			                 npoints * sizeof(struct dac_point));
+		}
+		return npoints * sizeof(struct dac_point);
+	}
+
+	return -1;
+}
+
+/* conn_flush(c)
+ *
+ * Send as much of c's output buffer as the socket will take. Returns 0 on
+ * success, -1 on error.
+ */
+static int conn_flush(struct emu_conn *c) {
+	if (!c->out_len)
+		return 0;
+
+	int res = send(c->fd, c->out, c->out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (res < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+	c->out_len -= res;
+	memmove(c->out, c->out + res, c->out_len);
+	return 0;
+}
+
+/* conn_close(d, i)
+ *
+ * Close d's i'th connection.
+ */
+static void conn_close(struct emu_dac *d, int i) {
+	outputf(d, "connection closed");
+	close(d->conns[i]->fd);
+	free(d->conns[i]);
+	d->conns[i] = NULL;
+}
+
+/* conn_read(d, c)
+ *
+ * Read whatever has arrived on c and handle it. Returns 0 on success, -1 if
+ * the connection should be closed.
+ */
+static int conn_read(struct emu_dac *d, struct emu_conn *c) {
+	int res = recv(c->fd, c->in + c->in_len, READ_BUF_SIZE - c->in_len,
+	               MSG_DONTWAIT);
+	if (res < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+	if (res == 0)
+		return -1;
+
+	c->in_len += res;
+
+	/* Everything that just arrived is handled at the same instant, so
+	 * bring playback up to date first. */
+	double now = microseconds();
+	dac_run(d, now);
+
+	int pos = 0;
+	while (pos < c->in_len) {
+		int fsar = recv_fsm(d, c, c->in + pos, c->in_len - pos, now);
+		if (fsar < 0)
+			return -1;
+		if (fsar == 0)
+			break;
+		pos += fsar;
+	}
+
+	c->in_len -= pos;
+	memmove(c->in, c->in + pos, c->in_len);
+
+	return conn_flush(c);
+}
+
+/* dac_accept(d)
+ *
+ * Accept a new connection to d, and send it the initial status.
+ */
+static void dac_accept(struct emu_dac *d) {
+	int fd = accept(d->listen_fd, NULL, NULL);
+	if (fd < 0) {
+		perror("accept");
+		return;
+	}
+
+	int i;
+	for (i = 0; i < MAX_CONNS; i++)
+		if (!d->conns[i])
+			break;
+
+	struct emu_conn *c = NULL;
+	if (i < MAX_CONNS)
+		c = calloc(1, sizeof *c);
+	if (!c) {
+		outputf(d, "too many connections");
+		close(fd);
+		return;
+	}
+
+	int ndelay = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &ndelay, sizeof ndelay);
+
+	c->fd = fd;
+	c->state = MAIN;
+	if (drop_interval)
+		c->drop_at = microseconds() + drop_interval * 1000.0;
+	d->conns[i] = c;
+	outputf(d, "connection accepted");
+
+	dac_run(d, microseconds());
+	if (send_resp(d, c, RESP_ACK, '?', 0) < 0 || conn_flush(c) < 0)
+		conn_close(d, i);
+}
+
+/* dac_broadcast(d)
+ *
+ * Send a broadcast packet with information about d.
+ */
+static void dac_broadcast(struct emu_dac *d) {
+	struct dac_broadcast pkt;
+
+	memset(&pkt, 0, sizeof pkt);
+	memcpy(pkt.mac_address, d->mac_address, sizeof pkt.mac_address);
+	fill_status(d, &pkt.status);
+	pkt.buffer_capacity = buffer_points - 1;
+	pkt.max_point_rate = max_point_rate;
+	pkt.hw_revision = 0;
+	pkt.sw_revision = 2;
+
+	if (sendto(d->udp_fd, &pkt, sizeof pkt, 0,
+	           (struct sockaddr *)&broadcast_addr,
+	           sizeof broadcast_addr) < 0)
+		outputf(d, "broadcast: %s", strerror(errno));
+}
+
+/* dac_open(d, port)
+ *
+ * Set up d's listening and broadcast sockets. Returns 0 on success, -1 on
+ * failure.
+ */
+static int dac_open(struct emu_dac *d, int port) {
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET, .sin_addr = d->addr,
+		.sin_port = htons(port)
+	};
+	int opt = 1;
+
+	d->buffer = calloc(buffer_points, sizeof *d->buffer);
+	if (latency_probe)
+		d->stats.latency = calloc(LATENCY_BUCKETS, sizeof(uint32_t));
+	if (!d->buffer || (latency_probe && !d->stats.latency)) {
+		perror("calloc");
+		return -1;
+	}
+
+	d->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (d->listen_fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	setsockopt(d->listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt);
+	if (bind(d->listen_fd, (struct sockaddr *)&addr, sizeof addr) < 0
+	    || listen(d->listen_fd, MAX_CONNS) < 0) {
+		fprintf(stderr, "bind %s:%d: %s\n", inet_ntoa(d->addr), port,
+		        strerror(errno));
+		return -1;
+	}
+
+	/* Broadcasts go out from an ephemeral port, so that the emulator can
+	 * share a host with something listening on 7654. */
+	d->udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (d->udp_fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	setsockopt(d->udp_fd, SOL_SOCKET, SO_BROADCAST, &opt, sizeof opt);
+	addr.sin_port = 0;
+	if (bind(d->udp_fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+		perror("bind");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* dac_print_stats(d)
+ *
+ * Print d's counters, one line of key=value pairs.
+ */
+static void dac_print_stats(struct emu_dac *d) {
+	struct emu_stats *s = &d->stats;
+	printf("dac=%02x%02x%02x addr=%s received=%llu played=%llu "
+	       "packets=%lu rate_queued=%lu rate_changes=%lu "
+	       "rate_rejected=%lu naks=%lu underflows=%lu overflows=%lu "
+	       "drops=%lu\n",
+	       d->mac_address[3], d->mac_address[4], d->mac_address[5],
+	       inet_ntoa(d->addr), s->points_received, s->points_played,
+	       s->packets, s->rate_queued, s->rate_changes, s->rate_rejected,
+	       s->naks, s->underflows, s->overflows, s->drops);
+	if (latency_probe)
+		printf("dac=%02x%02x%02x latency_samples=%lu latency_p50=%ld "
+		       "latency_p99=%ld\n", d->mac_address[3],
+		       d->mac_address[4], d->mac_address[5],
+		       s->latency_samples, latency_percentile(s, 50),
+		       latency_percentile(s, 99));
+	fflush(stdout);
+}
+
+static void handle_signal(int sig) {
+	(void)sig;
+	done = 1;
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"Options:\n"
+		"\t-a addr     Address to listen on (default: any)\n"
+		"\t-n count    Emulate count DACs, on consecutive addresses\n"
+		"\t            starting at -a; e.g. -a 127.0.0.2 -n 8\n"
+		"\t-p port     TCP port (default: 7765)\n"
+		"\t-B addr     Where to send broadcasts (default:\n"
+		"\t            255.255.255.255; use 127.0.0.1 for loopback)\n"
+		"\t-i id       ID of the first DAC, in hex (default: 0e0001)\n"
+		"\t-c points   Buffer capacity (default: %d)\n"
+		"\t-r pps      Maximum point rate (default: %d)\n"
+		"\t-s secs     Print stats every secs seconds\n"
+		"\t-L          Measure latency from timestamps in u1/u2\n"
+		"\t-D msecs    Drop each connection after msecs, as if the\n"
+		"\t            network had failed\n"
+		"\t-v          Log commands and state changes\n",
+		argv0, DEFAULT_BUFFER_POINTS, DEFAULT_MAX_POINT_RATE);
+}
+
+int main(int argc, char **argv) {
+	struct in_addr base_addr = { .s_addr = htonl(INADDR_ANY) };
+	unsigned long base_id = 0x0e0001;
+	int port = 7765, stats_interval = 0;
+	int opt, i, j;
+
+	broadcast_addr.sin_family = AF_INET;
+	broadcast_addr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+	broadcast_addr.sin_port = htons(BROADCAST_PORT);
+
+	while ((opt = getopt(argc, argv, "a:n:p:B:i:c:r:s:LD:vh")) != -1) {
+		switch (opt) {
+		case 'a':
+			if (!inet_aton(optarg, &base_addr)) {
+				fprintf(stderr, "bad address: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			ndacs = atoi(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'B':
+			if (!inet_aton(optarg, &broadcast_addr.sin_addr)) {
+				fprintf(stderr, "bad address: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'i':
+			base_id = strtoul(optarg, NULL, 16);
+			break;
+		case 'c':
+			buffer_points = atoi(optarg);
+			break;
+		case 'r':
+			max_point_rate = atoi(optarg);
+			break;
+		case 's':
+			stats_interval = atoi(optarg);
+			break;
+		case 'L':
+			latency_probe = 1;
+			break;
+		case 'D':
+			drop_interval = atoi(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (ndacs < 1 || ndacs > MAX_DACS || buffer_points < 2
+	    || buffer_points > 65535 || max_point_rate < 1
+	    || drop_interval < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (ndacs > 1 && base_addr.s_addr == htonl(INADDR_ANY)) {
+		fprintf(stderr, "-n needs a starting address (-a)\n");
+		return 1;
+	}
+
+	for (i = 0; i < ndacs; i++) {
+		struct emu_dac *d = &dacs[i];
+		unsigned long id = base_id + i;
+
+		d->addr.s_addr = htonl(ntohl(base_addr.s_addr) + i);
+		d->mac_address[0] = 0x02;
+		d->mac_address[1] = 'E';
+		d->mac_address[2] = 'D';
+		d->mac_address[3] = id >> 16;
+		d->mac_address[4] = id >> 8;
+		d->mac_address[5] = id;
+		if (dac_open(d, port) < 0)
+			return 1;
+	}
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	fprintf(stderr, "emulating %d DAC%s on %s:%d\n", ndacs,
+	        ndacs > 1 ? "s" : "", inet_ntoa(base_addr), port);
+
+	double next_broadcast = 0, next_stats = 0;
+	if (stats_interval > 0)
+		next_stats = microseconds() + stats_interval * 1000000.0;
+
+	while (!done) {
+		struct pollfd fds[MAX_DACS * (MAX_CONNS + 1)];
+		struct emu_conn *fd_conn[MAX_DACS * (MAX_CONNS + 1)];
+		struct emu_dac *fd_dac[MAX_DACS * (MAX_CONNS + 1)];
+		int fd_slot[MAX_DACS * (MAX_CONNS + 1)];
+		int nfds = 0;
+		double now = microseconds(), wake;
+
+		if (now >= next_broadcast) {
+			for (i = 0; i < ndacs; i++) {
+				dac_run(&dacs[i], now);
+				dac_broadcast(&dacs[i]);
+			}
+			next_broadcast = now + BROADCAST_INTERVAL;
+		}
+
+		if (next_stats && now >= next_stats) {
+			for (i = 0; i < ndacs; i++)
+				dac_print_stats(&dacs[i]);
+			next_stats += stats_interval * 1000000.0;
+		}
+
+		/* Sleep until the next broadcast, or until some DAC would
+		 * underflow, so that the underflow shows up in its status
+		 * without waiting for a command. */
+		wake = next_broadcast;
+		if (next_stats && next_stats < wake)
+			wake = next_stats;
+
+		for (i = 0; i < ndacs; i++) {
+			struct emu_dac *d = &dacs[i];
+			double deadline = dac_deadline(d);
+			if (deadline && deadline < wake)
+				wake = deadline;
+
+			fds[nfds].fd = d->listen_fd;
+			fds[nfds].events = POLLIN;
+			fd_conn[nfds] = NULL;
+			fd_dac[nfds] = d;
+			nfds++;
+
+			for (j = 0; j < MAX_CONNS; j++) {
+				struct emu_conn *c = d->conns[j];
+				if (!c)
+					continue;
+				if (c->drop_at && c->drop_at <= now) {
+					/* Playback carries on, as on
+					 * hardware. */
+					d->stats.drops++;
+					conn_close(d, j);
+					continue;
+				}
+				if (c->drop_at && c->drop_at < wake)
+					wake = c->drop_at;
+				fds[nfds].fd = c->fd;
+				fds[nfds].events = POLLIN
+				                 | (c->out_len ? POLLOUT : 0);
+				fd_conn[nfds] = c;
+				fd_dac[nfds] = d;
+				fd_slot[nfds] = j;
+				nfds++;
+			}
+		}
+
+		int timeout = (int)((wake - now) / 1000) + 1;
+		if (timeout < 0)
+			timeout = 0;
+
+		int res = poll(fds, nfds, timeout);
+		if (res < 0 && errno != EINTR) {
+			perror("poll");
+			return 1;
+		}
+
+		now = microseconds();
+		for (i = 0; i < ndacs; i++)
+			dac_run(&dacs[i], now);
+
+		for (i = 0; res > 0 && i < nfds; i++) {
+			struct emu_dac *d = fd_dac[i];
+			struct emu_conn *c = fd_conn[i];
+
+			if (!fds[i].revents)
+				continue;
+
+			if (!c) {
+				dac_accept(d);
+				continue;
+			}
+
+			if ((fds[i].revents & POLLOUT) && conn_flush(c) < 0) {
+				conn_close(d, fd_slot[i]);
+				continue;
+			}
+
+			if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+			    && conn_read(d, c) < 0)
+				conn_close(d, fd_slot[i]);
+		}
+	}
+
+	for (i = 0; i < ndacs; i++)
+		dac_print_stats(&dacs[i]);
+
+	return 0;
+}
@@ -0,0 +1,215 @@
+/* etherdreamd client library
+ *
+ * Copyright 2011-2012 Jacob Potter
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or 3, or the GNU Lesser General Public License version 3, as published
+ * by the Free Software Foundation, at your option.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "etherdreamd.h"
+
+struct etherdreamd {
+	int fd;
+	struct etherdreamd_ring *ring;
+	size_t map_size;
+	uint32_t mask;
+	uint32_t reserved;
+};
+
+/* read_line(fd, buf, len)
+ *
+ * Read one line of the daemon's reply into buf, without the newline.
+ * Returns 0 on success, -1 on error.
+ */
+static int read_line(int fd, char *buf, int len) {
+	int n = 0;
+	while (n < len - 1) {
+		int res = read(fd, buf + n, 1);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return -1;
+		if (buf[n] == '\n')
+			break;
+		n++;
+	}
+	buf[n] = '\0';
+	return 0;
+}
+
+/* etherdreamd_open(id, priority, points)
+ *
+ * Documented in etherdreamd.h.
+ */
+struct etherdreamd *etherdreamd_open(unsigned long id, int priority,
+                                     int points) {
+	const char *path = getenv("ETHERDREAMD_SOCKET");
+	if (!path)
+		path = ETHERDREAMD_SOCKET;
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof addr.sun_path) {
+		fprintf(stderr, "etherdreamd: socket path too long\n");
+		return NULL;
+	}
+	strcpy(addr.sun_path, path);
+
+	struct etherdreamd *c = calloc(1, sizeof *c);
+	if (!c) {
+		perror("etherdreamd: calloc");
+		return NULL;
+	}
+	c->ring = MAP_FAILED;
+
+	c->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (c->fd < 0) {
+		perror("etherdreamd: socket");
+		goto fail;
+	}
+
+	if (connect(c->fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+		fprintf(stderr, "etherdreamd: connect %s: %s\n", path,
+		        strerror(errno));
+		goto fail;
+	}
+
+	char line[256];
+	int len = snprintf(line, sizeof line, "open %lx %d %d\n", id, priority,
+	                   points);
+	if (write(c->fd, line, len) != len) {
+		perror("etherdreamd: write");
+		goto fail;
+	}
+
+	if (read_line(c->fd, line, sizeof line) < 0) {
+		fprintf(stderr, "etherdreamd: no reply from daemon\n");
+		goto fail;
+	}
+
+	if (strncmp(line, "ok ", 3)) {
+		fprintf(stderr, "etherdreamd: %s\n", line);
+		goto fail;
+	}
+
+	int shm = shm_open(line + 3, O_RDWR, 0);
+	if (shm < 0) {
+		fprintf(stderr, "etherdreamd: shm_open %s: %s\n", line + 3,
+		        strerror(errno));
+		goto fail;
+	}
+
+	struct stat sb;
+	if (fstat(shm, &sb) < 0) {
+		perror("etherdreamd: fstat");
+		close(shm);
+		goto fail;
+	}
+
+	c->map_size = sb.st_size;
+	c->ring = mmap(NULL, c->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	               shm, 0);
+	close(shm);
+	if (c->ring == MAP_FAILED) {
+		perror("etherdreamd: mmap");
+		goto fail;
+	}
+
+	if (c->ring->magic != ETHERDREAMD_MAGIC
+	    || c->ring->version != ETHERDREAMD_VERSION
+	    || c->map_size < sizeof *c->ring
+	                     + c->ring->size * sizeof(struct dac_point)) {
+		fprintf(stderr, "etherdreamd: bad ring %s\n", line + 3);
+		goto fail;
+	}
+
+	c->mask = c->ring->size - 1;
+	return c;
+
+fail:
+	etherdreamd_close(c);
+	return NULL;
+}
+
+/* etherdreamd_get_ring(c)
+ *
+ * Documented in etherdreamd.h.
+ */
+const struct etherdreamd_ring *etherdreamd_get_ring(struct etherdreamd *c) {
+	return c->ring;
+}
+
+/* etherdreamd_ring_free(c)
+ *
+ * Documented in etherdreamd.h.
+ */
+int etherdreamd_ring_free(struct etherdreamd *c) {
+	uint32_t tail = __atomic_load_n(&c->ring->tail, __ATOMIC_ACQUIRE);
+	return c->ring->size - (c->ring->head + c->reserved - tail);
+}
+
+/* etherdreamd_ring_reserve(c, max, pts)
+ *
+ * Documented in etherdreamd.h.
+ */
+int etherdreamd_ring_reserve(struct etherdreamd *c, int max,
+                             struct dac_point **pts) {
+	uint32_t pos = c->ring->head + c->reserved;
+	int n = etherdreamd_ring_free(c);
+	int contig = c->ring->size - (pos & c->mask);
+
+	if (n > contig)
+		n = contig;
+	if (n > max)
+		n = max;
+	if (n <= 0)
+		return 0;
+
+	*pts = &c->ring->points[pos & c->mask];
+	c->reserved += n;
+	return n;
+}
+
+/* etherdreamd_ring_commit(c)
+ *
+ * Documented in etherdreamd.h.
+ */
+void etherdreamd_ring_commit(struct etherdreamd *c) {
+	__atomic_store_n(&c->ring->head, c->ring->head + c->reserved,
+	                 __ATOMIC_RELEASE);
+	c->reserved = 0;
+}
+
+/* etherdreamd_close(c)
+ *
+ * Documented in etherdreamd.h.
+ */
+void etherdreamd_close(struct etherdreamd *c) {
+	if (c->ring != MAP_FAILED)
+		munmap(c->ring, c->map_size);
+	if (c->fd >= 0)
+		close(c->fd);
+	free(c);
+}
@@ -0,0 +1,786 @@
+/* etherdreamd: share Ether Dream DACs between several programs
+ *
+ * Copyright 2011-2012 Jacob Potter
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or 3, or the GNU Lesser General Public License version 3, as published
+ * by the Free Software Foundation, at your option.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* See etherdreamd.h for what clients see. The main thread runs the control
+ * socket: it creates and destroys rings, and has DACs connected as they
+ * are asked for. Connecting can take a while, so each connection is made
+ * on a thread of its own, which tells the main thread over connect_pipe
+ * when it is done; the open requests waiting on it are answered then, and
+ * the main thread carries on serving everyone else meanwhile. Everything
+ * else happens on libetherdream's single reactor
+ * thread, which calls dac_source() whenever a DAC has room for more points;
+ * that picks which client drives the DAC and hands back a pointer into the
+ * client's ring, which the library sends from directly. The points stay
+ * owned by the ring until the next call, when the ring's tail is advanced
+ * past them.
+ *
+ * Each DAC's lock is only ever held briefly, by the main thread adding or
+ * removing a client, or by dac_source(). A ring whose client goes away
+ * while the library is sending from it is unmapped by dac_source() once
+ * the send is done.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "etherdream.h"
+#include "etherdreamd.h"
+
+#define MAX_DACS		64
+#define MAX_CLIENTS		64
+#define MIN_RING_POINTS		256
+#define DEFAULT_PPS		30000
+#define HOLD_TIME		100000
+#define HEALTH_INTERVAL		1000
+
+struct dac_slot;
+
+struct client {
+	int fd;
+	char in[256];
+	int in_len;
+
+	struct dac_slot *slot;
+	struct etherdreamd_ring *ring;
+	size_t map_size;
+	char shm_name[64];
+	int priority;
+
+	/* The daemon's side of the ring. The ring's own size, tail and
+	 * dropped are only ever written from these, never read back, since
+	 * the client can write to them too. */
+	uint32_t size;
+	uint32_t tail;
+	uint32_t dropped;
+
+	/* Set when the client has gone but its ring is still being sent
+	 * from; dac_source() frees it. */
+	int closing;
+
+	/* An open request waiting for pending's DAC to connect. */
+	struct dac_slot *pending;
+	int pending_priority;
+	int pending_points;
+};
+
+struct dac_slot {
+	struct etherdream *d;
+	unsigned long id;
+	int connected;
+
+	/* Set while connect_thread is connecting to the DAC, which it
+	 * reports back by writing the slot's index to connect_pipe. */
+	int connecting;
+	int connect_result;
+	pthread_t connect_thread;
+
+	pthread_mutex_t lock;
+
+	/* In the order they were opened. */
+	struct client *clients[MAX_CLIENTS];
+	int nclients;
+
+	/* The client driving the DAC, and when its ring last had points. */
+	struct client *active;
+	long long active_seen;
+
+	/* The ring that the last points handed to the library came from,
+	 * and how many; its tail moves past them on the next call. */
+	struct client *held;
+	uint32_t held_points;
+};
+
+static struct dac_slot slots[MAX_DACS];
+static int nslots;
+static struct client *clients[MAX_CLIENTS];
+static int nclients;
+static unsigned int shm_serial;
+static int pps = DEFAULT_PPS;
+static int latency;
+static int verbose;
+static int connect_pipe[2];
+static volatile sig_atomic_t done;
+
+/* outputf(fmt, ...)
+ *
+ * Print a line to stderr, if -v was given.
+ */
+static void outputf(const char *fmt, ...) {
+	va_list args;
+
+	if (!verbose)
+		return;
+
+	fprintf(stderr, "[%.6f] ", etherdream_time_us() / 1000000.0);
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fputc('\n', stderr);
+}
+
+/* ring_queued(c)
+ *
+ * Return how many points c has written to its ring and the daemon has not
+ * yet taken.
+ */
+static uint32_t ring_queued(struct client *c) {
+	return __atomic_load_n(&c->ring->head, __ATOMIC_ACQUIRE) - c->tail;
+}
+
+/* ring_advance(c, n)
+ *
+ * Move c's tail past n points, and let the client know.
+ */
+static void ring_advance(struct client *c, uint32_t n) {
+	c->tail += n;
+	__atomic_store_n(&c->ring->tail, c->tail, __ATOMIC_RELEASE);
+}
+
+/* client_free(c)
+ *
+ * Unmap c's ring and free c. Its shared memory name has already been
+ * unlinked.
+ */
+static void client_free(struct client *c) {
+	if (c->ring)
+		munmap(c->ring, c->map_size);
+	free(c);
+}
+
+/* slot_release(s)
+ *
+ * Called with s locked: the library is done with the points last handed
+ * out, so give them back to their ring.
+ */
+static void slot_release(struct dac_slot *s) {
+	struct client *c = s->held;
+	if (!c)
+		return;
+
+	s->held = NULL;
+	if (c->closing) {
+		client_free(c);
+		return;
+	}
+
+	ring_advance(c, s->held_points);
+}
+
+/* slot_pick(s, now)
+ *
+ * Called with s locked: choose which client should drive s's DAC. That is
+ * the highest-priority client with points waiting, earliest opened first;
+ * but the client that is already driving keeps it against anyone not of
+ * strictly higher priority until it has had nothing to send for HOLD_TIME,
+ * so that a client that writes in bursts is not interrupted in between.
+ * Returns the client, which may have no points right now, or NULL.
+ */
+static struct client *slot_pick(struct dac_slot *s, long long now) {
+	struct client *best = NULL, *a = s->active;
+	int i;
+
+	for (i = 0; i < s->nclients; i++) {
+		struct client *c = s->clients[i];
+		if (!ring_queued(c))
+			continue;
+		if (!best || c->priority > best->priority)
+			best = c;
+	}
+
+	if (a && ring_queued(a))
+		s->active_seen = now;
+
+	if (a && now - s->active_seen < HOLD_TIME
+	    && (!best || best->priority <= a->priority))
+		best = a;
+
+	if (best && best != a) {
+		outputf("%06lx: ring %s takes over", s->id, best->shm_name);
+		s->active = best;
+		s->active_seen = now;
+	}
+
+	return best;
+}
+
+/* dac_source(d, req, pts, user)
+ *
+ * The libetherdream source for every DAC: hand the library as many points
+ * as it asks for from the driving client's ring, and throw away whatever
+ * the other clients have written.
+ */
+static int dac_source(struct etherdream *d,
+                      const struct etherdream_request *req,
+                      const struct dac_point **pts, void *user) {
+	struct dac_slot *s = user;
+	int i, n = 0;
+
+	(void)d;
+
+	pthread_mutex_lock(&s->lock);
+	slot_release(s);
+
+	struct client *c = slot_pick(s, etherdream_time_us());
+
+	for (i = 0; c && i < s->nclients; i++) {
+		struct client *o = s->clients[i];
+		if (o == c) {
+			o->ring->state = ETHERDREAMD_ACTIVE;
+			continue;
+		}
+
+		uint32_t stale = ring_queued(o);
+		o->ring->state = ETHERDREAMD_WAITING;
+		if (stale) {
+			o->dropped += stale;
+			o->ring->dropped = o->dropped;
+			ring_advance(o, stale);
+		}
+	}
+
+	if (c) {
+		uint32_t pos = c->tail & (c->size - 1);
+		uint32_t queued = ring_queued(c);
+
+		/* However far ahead the client says its head is, only the
+		 * ring's own points are ever handed out. */
+		n = queued < c->size - pos ? (int)queued : (int)(c->size - pos);
+		if (n > req->npoints)
+			n = req->npoints;
+
+		if (n) {
+			*pts = &c->ring->points[pos];
+			s->held = c;
+			s->held_points = n;
+		}
+	}
+
+	pthread_mutex_unlock(&s->lock);
+	return n;
+}
+
+/* slot_find(id)
+ *
+ * Find or make the slot for the DAC with the given ID (or the first DAC,
+ * for 0). Returns NULL, with *err set, on failure.
+ */
+static struct dac_slot *slot_find(unsigned long id, const char **err) {
+	struct etherdream *d = etherdream_get(id);
+	int i;
+
+	if (!d) {
+		*err = "no such DAC";
+		return NULL;
+	}
+
+	for (i = 0; i < nslots; i++)
+		if (slots[i].d == d)
+			return &slots[i];
+
+	if (nslots == MAX_DACS) {
+		*err = "too many DACs";
+		return NULL;
+	}
+
+	struct dac_slot *s = &slots[nslots++];
+	s->d = d;
+	s->id = etherdream_get_id(d);
+	pthread_mutex_init(&s->lock, NULL);
+	return s;
+}
+
+/* connect_thread(arg)
+ *
+ * Thread function: connect to a slot's DAC, and let the main thread know
+ * how it went.
+ */
+static void *connect_thread(void *arg) {
+	struct dac_slot *s = arg;
+	int index = s - slots;
+
+	s->connect_result = etherdream_connect(s->d);
+	if (write(connect_pipe[1], &index, sizeof index) < 0)
+		perror("write");
+	return NULL;
+}
+
+/* slot_connect(s)
+ *
+ * Start connecting to s's DAC, unless that's already under way. Returns 0
+ * on success, -1 on failure.
+ */
+static int slot_connect(struct dac_slot *s) {
+	if (s->connecting)
+		return 0;
+
+	int res = pthread_create(&s->connect_thread, NULL, connect_thread, s);
+	if (res) {
+		fprintf(stderr, "etherdreamd: pthread_create: %s\n",
+		        strerror(res));
+		return -1;
+	}
+
+	s->connecting = 1;
+	outputf("%06lx: connecting", s->id);
+	return 0;
+}
+
+/* ring_create(c, points)
+ *
+ * Create and map a shared ring of at least points points for c.
+ */
+static int ring_create(struct client *c, int points, const char **err) {
+	uint32_t size = MIN_RING_POINTS;
+	while (size < (uint32_t)points)
+		size *= 2;
+
+	snprintf(c->shm_name, sizeof c->shm_name, "/etherdreamd.%d.%u",
+	         (int)getpid(), shm_serial++);
+
+	int fd = shm_open(c->shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		*err = strerror(errno);
+		return -1;
+	}
+
+	c->map_size = sizeof *c->ring + size * sizeof(struct dac_point);
+	if (ftruncate(fd, c->map_size) < 0) {
+		*err = strerror(errno);
+		goto fail;
+	}
+
+	c->ring = mmap(NULL, c->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	               fd, 0);
+	if (c->ring == MAP_FAILED) {
+		c->ring = NULL;
+		*err = strerror(errno);
+		goto fail;
+	}
+	close(fd);
+
+	c->size = size;
+	c->ring->magic = ETHERDREAMD_MAGIC;
+	c->ring->version = ETHERDREAMD_VERSION;
+	c->ring->size = size;
+	c->ring->pps = pps;
+	c->ring->state = ETHERDREAMD_WAITING;
+	return 0;
+
+fail:
+	close(fd);
+	shm_unlink(c->shm_name);
+	return -1;
+}
+
+/* client_attach(c, s, priority, points)
+ *
+ * Give c a ring on s, whose DAC is connected, and reply to its open
+ * request.
+ */
+static void client_attach(struct client *c, struct dac_slot *s,
+                          int priority, int points) {
+	const char *err = NULL;
+	char reply[128];
+
+	if (ring_create(c, points, &err) < 0) {
+		dprintf(c->fd, "err %s\n", err);
+		return;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	if (s->nclients == MAX_CLIENTS) {
+		pthread_mutex_unlock(&s->lock);
+		shm_unlink(c->shm_name);
+		munmap(c->ring, c->map_size);
+		c->ring = NULL;
+		dprintf(c->fd, "err too many clients\n");
+		return;
+	}
+	c->priority = priority;
+	c->slot = s;
+	s->clients[s->nclients++] = c;
+	pthread_mutex_unlock(&s->lock);
+
+	outputf("%06lx: ring %s opened, priority %d, %u points", s->id,
+	      c->shm_name, priority, c->size);
+
+	snprintf(reply, sizeof reply, "ok %s\n", c->shm_name);
+	if (write(c->fd, reply, strlen(reply)) < 0)
+		outputf("write: %s", strerror(errno));
+}
+
+/* client_open(c, args)
+ *
+ * Handle an "open" request. If the DAC isn't connected yet, the reply
+ * waits until it is; see connect_done().
+ */
+static void client_open(struct client *c, const char *args) {
+	unsigned long id;
+	int priority, points;
+	const char *err = NULL;
+
+	if (c->slot || c->pending) {
+		dprintf(c->fd, "err ring already open\n");
+		return;
+	}
+
+	if (sscanf(args, "%lx %d %d", &id, &priority, &points) != 3
+	    || points < 1 || points > ETHERDREAMD_MAX_RING_POINTS) {
+		dprintf(c->fd, "err bad request\n");
+		return;
+	}
+
+	struct dac_slot *s = slot_find(id, &err);
+	if (!s) {
+		dprintf(c->fd, "err %s\n", err);
+		return;
+	}
+
+	if (s->connected) {
+		client_attach(c, s, priority, points);
+		return;
+	}
+
+	if (slot_connect(s) < 0) {
+		dprintf(c->fd, "err could not connect to DAC\n");
+		return;
+	}
+	c->pending = s;
+	c->pending_priority = priority;
+	c->pending_points = points;
+}
+
+/* connect_done()
+ *
+ * Called when connect_pipe is readable: finish setting up a DAC that a
+ * connect_thread() is done with, and answer the open requests that were
+ * waiting on it.
+ */
+static void connect_done(void) {
+	int index, i;
+
+	if (read(connect_pipe[0], &index, sizeof index) != sizeof index)
+		return;
+
+	struct dac_slot *s = &slots[index];
+	pthread_join(s->connect_thread, NULL);
+	s->connecting = 0;
+
+	if (s->connect_result == 0) {
+		if (latency)
+			etherdream_set_latency(s->d, latency);
+		etherdream_set_source(s->d, pps, dac_source, s);
+		s->connected = 1;
+		outputf("%06lx: connected", s->id);
+	} else {
+		outputf("%06lx: could not connect", s->id);
+	}
+
+	for (i = 0; i < nclients; i++) {
+		struct client *c = clients[i];
+		if (c->pending != s)
+			continue;
+
+		c->pending = NULL;
+		if (s->connected)
+			client_attach(c, s, c->pending_priority,
+			              c->pending_points);
+		else
+			dprintf(c->fd, "err could not connect to DAC\n");
+	}
+}
+
+/* client_list(c)
+ *
+ * Handle a "list" request.
+ */
+static void client_list(struct client *c) {
+	int i, n = etherdream_dac_count();
+
+	for (i = 0; i < n; i++) {
+		struct etherdream *d = etherdream_get(i);
+		if (d)
+			dprintf(c->fd, "dac %06lx %s\n", etherdream_get_id(d),
+			        inet_ntoa(*etherdream_get_in_addr(d)));
+	}
+	dprintf(c->fd, "ok\n");
+}
+
+/* client_close(i)
+ *
+ * Drop the i'th client: unlink its ring, and take it off its DAC.
+ */
+static void client_close(int i) {
+	struct client *c = clients[i];
+	struct dac_slot *s = c->slot;
+	int j, in_use = 0;
+
+	close(c->fd);
+	clients[i] = clients[--nclients];
+
+	if (!s) {
+		free(c);
+		return;
+	}
+
+	outputf("%06lx: ring %s closed", s->id, c->shm_name);
+	shm_unlink(c->shm_name);
+
+	pthread_mutex_lock(&s->lock);
+	for (j = 0; j < s->nclients; j++) {
+		if (s->clients[j] == c) {
+			memmove(&s->clients[j], &s->clients[j + 1],
+			        (s->nclients - j - 1) * sizeof c);
+			s->nclients--;
+			break;
+		}
+	}
+	if (s->active == c)
+		s->active = NULL;
+	if (s->held == c) {
+		c->closing = 1;
+		in_use = 1;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	if (!in_use)
+		client_free(c);
+}
+
+/* client_read(i)
+ *
+ * Read from the i'th client and handle any complete requests. Returns -1
+ * if the client has gone away.
+ */
+static int client_read(int i) {
+	struct client *c = clients[i];
+	int res = read(c->fd, c->in + c->in_len, sizeof c->in - c->in_len - 1);
+	if (res < 0 && errno == EINTR)
+		return 0;
+	if (res <= 0)
+		return -1;
+	c->in_len += res;
+	c->in[c->in_len] = '\0';
+
+	char *line = c->in, *nl;
+	while ((nl = strchr(line, '\n'))) {
+		*nl = '\0';
+		if (!strcmp(line, "list"))
+			client_list(c);
+		else if (!strncmp(line, "open ", 5))
+			client_open(c, line + 5);
+		else
+			dprintf(c->fd, "err unknown request\n");
+		line = nl + 1;
+	}
+
+	c->in_len -= line - c->in;
+	memmove(c->in, line, c->in_len);
+	if (c->in_len == sizeof c->in - 1)
+		return -1;
+	return 0;
+}
+
+/* check_dacs()
+ *
+ * Tell the clients of any DAC whose connection has failed for good, and
+ * get ready to reconnect the next time it is asked for.
+ */
+static void check_dacs(void) {
+	int i, j;
+
+	for (i = 0; i < nslots; i++) {
+		struct dac_slot *s = &slots[i];
+		if (!s->connected || etherdream_is_ready(s->d) >= 0)
+			continue;
+
+		outputf("%06lx: connection failed", s->id);
+		fprintf(stderr, "etherdreamd: lost DAC %06lx\n", s->id);
+		s->connected = 0;
+
+		/* Its sender has already stopped; this only cleans up after
+		 * it, so that it can be connected again. */
+		etherdream_disconnect(s->d);
+
+		pthread_mutex_lock(&s->lock);
+		for (j = 0; j < s->nclients; j++)
+			s->clients[j]->ring->state = ETHERDREAMD_GONE;
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+static void handle_signal(int sig) {
+	(void)sig;
+	done = 1;
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"Options:\n"
+		"\t-s path     Control socket (default: %s)\n"
+		"\t-r pps      Point rate for every DAC (default: %d)\n"
+		"\t-l usec     Latency target for every DAC (-1: automatic)\n"
+		"\t-a addr     Also look for a DAC at addr; may be repeated\n"
+		"\t-v          Log clients and DACs\n",
+		argv0, ETHERDREAMD_SOCKET, DEFAULT_PPS);
+}
+
+int main(int argc, char **argv) {
+	const char *path = ETHERDREAMD_SOCKET;
+	const char *extra[MAX_DACS];
+	int nextra = 0;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "s:r:l:a:vh")) != -1) {
+		switch (opt) {
+		case 's': path = optarg; break;
+		case 'r': pps = atoi(optarg); break;
+		case 'l': latency = atoi(optarg); break;
+		case 'a':
+			if (nextra < MAX_DACS)
+				extra[nextra++] = optarg;
+			break;
+		case 'v': verbose = 1; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind != argc || pps <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof addr.sun_path) {
+		fprintf(stderr, "%s: socket path too long\n", argv[0]);
+		return 1;
+	}
+	strcpy(addr.sun_path, path);
+
+	if (pipe(connect_pipe) < 0) {
+		perror("pipe");
+		return 1;
+	}
+
+	if (etherdream_lib_start() < 0 || etherdream_reactor_start(1) < 0)
+		return 1;
+	for (i = 0; i < nextra; i++)
+		etherdream_add(extra[i]);
+
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	unlink(path);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof addr) < 0
+	    || listen(listen_fd, 16) < 0) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], path, strerror(errno));
+		return 1;
+	}
+
+	struct sigaction sa = { .sa_handler = handle_signal };
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	outputf("listening on %s", path);
+
+	while (!done) {
+		struct pollfd fds[MAX_CLIENTS + 2];
+
+		fds[0].fd = listen_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = connect_pipe[0];
+		fds[1].events = POLLIN;
+		for (i = 0; i < nclients; i++) {
+			fds[i + 2].fd = clients[i]->fd;
+			fds[i + 2].events = POLLIN;
+		}
+
+		int res = poll(fds, nclients + 2, HEALTH_INTERVAL);
+		if (res < 0 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+
+		check_dacs();
+		if (res <= 0)
+			continue;
+
+		/* Back to front, since closing a client moves the last one
+		 * into its place. */
+		for (i = nclients - 1; i >= 0; i--) {
+			if (fds[i + 2].revents && client_read(i) < 0)
+				client_close(i);
+		}
+
+		if (fds[1].revents & POLLIN)
+			connect_done();
+
+		if (fds[0].revents & POLLIN) {
+			int fd = accept(listen_fd, NULL, NULL);
+			if (fd < 0)
+				continue;
+
+			struct client *c;
+			if (nclients == MAX_CLIENTS
+			    || !(c = calloc(1, sizeof *c))) {
+				dprintf(fd, "err too many clients\n");
+				close(fd);
+				continue;
+			}
+			c->fd = fd;
+			clients[nclients++] = c;
+		}
+	}
+
+	for (i = 0; i < nslots; i++) {
+		if (slots[i].connecting) {
+			pthread_join(slots[i].connect_thread, NULL);
+			if (slots[i].connect_result == 0)
+				slots[i].connected = 1;
+		}
+		if (slots[i].connected)
+			etherdream_disconnect(slots[i].d);
+	}
+	while (nclients)
+		client_close(nclients - 1);
+	unlink(path);
+	return 0;
+}
@@ -0,0 +1,143 @@
+/* etherdreamd client interface
+ *
+ * Copyright 2011-2012 Jacob Potter
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or 3, or the GNU Lesser General Public License version 3, as published
+ * by the Free Software Foundation, at your option.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ETHERDREAMD_H
+#define ETHERDREAMD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include <protocol.h>
+
+/* etherdreamd owns every DAC's connection, so that several programs can
+ * share the same DACs. A client asks the daemon, over a Unix socket, for a
+ * ring on a DAC; the daemon creates a shared memory segment under /dev/shm
+ * holding a single-producer, single-consumer ring of points in the DAC's
+ * wire format, which the client maps and fills. The daemon sends points to
+ * the DAC straight out of the ring, pacing every DAC from one thread.
+ *
+ * Each ring has a priority. A DAC is driven by the highest-priority client
+ * that has points waiting; if two have the same priority, whichever is
+ * already driving it keeps it, and otherwise the one that opened its ring
+ * first. Points written to a ring that is not driving its DAC are thrown
+ * away, so that a client picks up where it is, not where it was, when it
+ * gets the DAC back. The ring lasts as long as the client's connection to
+ * the control socket.
+ *
+ * The control protocol is one line of text per request:
+ *
+ *	list                      ->  "dac <id> <addr>" per DAC, then "ok"
+ *	open <id> <prio> <points> ->  "ok <shm name>" or "err <message>"
+ *
+ * with the DAC ID in hex, as etherdream_get_id() has it. A connection may
+ * open one ring. If the daemon isn't connected to the DAC yet, the reply
+ * to open comes once it is, or once it has given up.
+ */
+
+#define ETHERDREAMD_SOCKET		"/tmp/etherdreamd.sock"
+#define ETHERDREAMD_MAGIC		0x45445244
+#define ETHERDREAMD_VERSION		1
+#define ETHERDREAMD_MAX_RING_POINTS	(1 << 20)
+
+/* Values of state in struct etherdreamd_ring. */
+enum etherdreamd_state {
+	ETHERDREAMD_WAITING = 0,	/* another client is driving the DAC */
+	ETHERDREAMD_ACTIVE = 1,		/* this ring is driving the DAC */
+	ETHERDREAMD_GONE = 2,		/* the DAC's connection has failed */
+};
+
+/* struct etherdreamd_ring
+ *
+ * The head of a shared memory segment, followed by its points. head is
+ * only written by the client and tail only by the daemon; each sits on its
+ * own cache line. Both count points from 0, and a point's slot is its
+ * count masked with size - 1. The daemon keeps its own copies of size,
+ * tail and dropped, and only ever writes them here, so a client can't
+ * confuse it by writing to them.
+ */
+struct etherdreamd_ring {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t pps;
+	char pad0[48];
+
+	uint32_t head;
+	char pad1[60];
+
+	uint32_t tail;
+	uint32_t state;
+	uint32_t dropped;
+	char pad2[52];
+
+	struct dac_point points[];
+};
+
+struct etherdreamd;
+
+/* etherdreamd_open(id, priority, points)
+ *
+ * Connect to the daemon (at $ETHERDREAMD_SOCKET, or ETHERDREAMD_SOCKET if
+ * that is not set) and open a ring of at least points points on the DAC
+ * with the given ID, or the first DAC the daemon knows about if id is 0.
+ * Returns NULL on failure, with the reason printed to stderr.
+ */
+struct etherdreamd *etherdreamd_open(unsigned long id, int priority,
+                                     int points);
+
+/* etherdreamd_get_ring(c)
+ *
+ * Return c's shared ring, for its pps and state.
+ */
+const struct etherdreamd_ring *etherdreamd_get_ring(struct etherdreamd *c);
+
+/* etherdreamd_ring_reserve(c, max, pts)
+ *
+ * As etherdream_ring_reserve(): reserve up to max contiguous points in c's
+ * ring, set *pts to point at them, and return how many there are (0 if the
+ * ring is full). Points are written straight into shared memory.
+ */
+int etherdreamd_ring_reserve(struct etherdreamd *c, int max,
+                             struct dac_point **pts);
+
+/* etherdreamd_ring_commit(c)
+ *
+ * Hand every point reserved since the last commit to the daemon.
+ */
+void etherdreamd_ring_commit(struct etherdreamd *c);
+
+/* etherdreamd_ring_free(c)
+ *
+ * Return how many points could be reserved right now.
+ */
+int etherdreamd_ring_free(struct etherdreamd *c);
+
+/* etherdreamd_close(c)
+ *
+ * Release c's ring and close its connection to the daemon.
+ */
+void etherdreamd_close(struct etherdreamd *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,126 @@
+/* etherdreamd test pattern client
+ *
+ * Copyright 2011-2012 Jacob Potter
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or 3, or the GNU Lesser General Public License version 3, as published
+ * by the Free Software Foundation, at your option.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Draw a circle on a DAC through etherdreamd, keeping the ring topped up,
+ * and report whenever the ring gains or loses the DAC. Run several at
+ * different priorities to see the daemon hand the DAC between them.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "etherdreamd.h"
+
+#define CIRCLE_POINTS	600
+#define POLL_INTERVAL	5000
+
+static const char *state_names[] = { "waiting", "active", "gone" };
+
+static double seconds_now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"Options:\n"
+		"\t-d id       DAC ID, in hex (default: the first DAC)\n"
+		"\t-p prio     Priority (default: 0)\n"
+		"\t-n points   Ring size (default: 2048)\n"
+		"\t-s scale    Circle radius, 0 to 1 (default: 0.5)\n"
+		"\t-t secs     Time to run for (default: forever)\n",
+		argv0);
+}
+
+int main(int argc, char **argv) {
+	unsigned long id = 0;
+	int priority = 0, points = 2048, seconds = 0;
+	double scale = 0.5;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:p:n:s:t:h")) != -1) {
+		switch (opt) {
+		case 'd': id = strtoul(optarg, NULL, 16); break;
+		case 'p': priority = atoi(optarg); break;
+		case 'n': points = atoi(optarg); break;
+		case 's': scale = atof(optarg); break;
+		case 't': seconds = atoi(optarg); break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (points < 1 || scale < 0 || scale > 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	struct etherdreamd *c = etherdreamd_open(id, priority, points);
+	if (!c)
+		return 1;
+
+	const struct etherdreamd_ring *ring = etherdreamd_get_ring(c);
+	printf("ring of %u points at %u pps\n", ring->size, ring->pps);
+
+	double end = seconds ? seconds_now() + seconds : 0;
+	unsigned int phase = 0;
+	int state = -1;
+
+	while (!end || seconds_now() < end) {
+		struct dac_point *pts;
+		int i, n;
+
+		while ((n = etherdreamd_ring_reserve(c, 4096, &pts)) > 0) {
+			for (i = 0; i < n; i++, phase++) {
+				double a = 2 * M_PI * (phase % CIRCLE_POINTS)
+				         / CIRCLE_POINTS;
+				pts[i].control = 0;
+				pts[i].x = 32767 * scale * cos(a);
+				pts[i].y = 32767 * scale * sin(a);
+				pts[i].r = pts[i].g = pts[i].b = 65535;
+				pts[i].i = 65535;
+				pts[i].u1 = pts[i].u2 = 0;
+			}
+		}
+		etherdreamd_ring_commit(c);
+
+		int s = __atomic_load_n(&ring->state, __ATOMIC_RELAXED);
+		if (s != state) {
+			printf("%s (dropped %u)\n", state_names[s],
+			       ring->dropped);
+			fflush(stdout);
+			state = s;
+		}
+		if (s == ETHERDREAMD_GONE)
+			break;
+
+		usleep(POLL_INTERVAL);
+	}
+
+	etherdreamd_close(c);
+	return 0;
+}
@@ -0,0 +1,118 @@
+/* Time ilda_decode() with each decoder this CPU supports, for each ILDA
+ * format, and check that every decoder's output matches the scalar one's
+ * exactly, for every count of points up to the one asked for as well as
+ * that one. Results are printed as one line of key=value pairs per decoder
+ * and format; the exit status is nonzero on a mismatch.
+ */
+
+#include "decode.hpp"
+#include "ilda.hpp"
+
+#include <getopt.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+static const struct {
+    ILDADecodeKernel kernel;
+    const char * name;
+} kernels[] = {
+    { ILDA_DECODE_SCALAR, "scalar" },
+    { ILDA_DECODE_SSSE3, "ssse3" },
+    { ILDA_DECODE_AVX2, "avx2" },
+};
+
+static const int formats[] = { 0, 1, 4, 5 };
+
+static long long monotonic_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static void usage(const char * argv0) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "Options:\n"
+        "\t-n points   Points per call (default: 1000)\n"
+        "\t-t msecs    Time to run each case for (default: 500)\n",
+        argv0);
+}
+
+int main(int argc, char **argv) {
+    int npoints = 1000, msecs = 500;
+    int opt, failed = 0;
+
+    while ((opt = getopt(argc, argv, "n:t:h")) != -1) {
+        switch (opt) {
+        case 'n': npoints = atoi(optarg); break;
+        case 't': msecs = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (npoints < 1 || msecs < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* Random records, with about one point in four blanked. */
+    std::vector<uint8_t> in(10 * npoints);
+    srand(1);
+    for (auto & b : in)
+        b = rand();
+    for (size_t i = 0; i < in.size(); i++)
+        if (rand() % 4)
+            in[i] &= ~0x40;
+
+    ILDAColorTable colors;
+    ilda_color_table(ILDAFile::Palette::ilda256.data, colors);
+
+    std::vector<etherdream_point> ref(npoints), out(npoints);
+
+    for (int format : formats) {
+        for (const auto & k : kernels) {
+            if (ilda_set_decode_kernel(k.kernel) < 0)
+                continue;
+
+            for (int n = 0; n <= npoints; n = n < 64 ? n + 1 : npoints) {
+                ilda_set_decode_kernel(ILDA_DECODE_SCALAR);
+                ilda_decode(format, in.data(), n, colors, ref.data());
+                ilda_set_decode_kernel(k.kernel);
+                memset(out.data(), 0xff, n * sizeof out[0]);
+                ilda_decode(format, in.data(), n, colors, out.data());
+                if (memcmp(out.data(), ref.data(), n * sizeof out[0])) {
+                    fprintf(stderr, "%s: format %d, %d points: output "
+                            "differs from scalar\n", k.name, format, n);
+                    failed = 1;
+                    break;
+                }
+                if (n == npoints)
+                    break;
+            }
+
+            long long start = monotonic_ns(), elapsed;
+            long long deadline = start + msecs * 1000000LL;
+            long calls = 0;
+            do {
+                for (int i = 0; i < 64; i++)
+                    ilda_decode(format, in.data(), npoints, colors,
+                                out.data());
+                calls += 64;
+                elapsed = monotonic_ns() - start;
+            } while (start + elapsed < deadline);
+
+            printf("kernel=%s format=%d points=%d mpoints_per_sec=%.1f "
+                   "ns_per_point=%.3f\n",
+                   k.name, format, npoints,
+                   (double)calls * npoints * 1000.0 / elapsed,
+                   (double)elapsed / calls / npoints);
+        }
+    }
+
+    return failed;
+}
@@ -0,0 +1,360 @@
+#include "decode.hpp"
+
+#include <algorithm>
+#include <atomic>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* Record layouts: every format starts with big-endian x and y, then has a
+ * status byte whose 0x40 bit means "blanked", then either a palette index
+ * or blue, green and red bytes. These give the offset of each within a
+ * record. */
+#define F0  8, 6, 7         /* 3D w/ palette */
+#define F1  6, 4, 5         /* 2D w/ palette */
+#define F4  10, 6, 9, 8, 7  /* 3D truecolor */
+#define F5  8, 4, 7, 6, 5   /* 2D truecolor */
+
+size_t ilda_record_size(int format) {
+    switch (format) {
+    case 0: return 8;
+    case 1: return 6;
+    case 2: return 3;   /* palette */
+    case 4: return 10;
+    case 5: return 8;
+    default: return 0;
+    }
+}
+
+void ilda_color_table(const uint8_t * palette, ILDAColorTable & table) {
+    for (int c = 0; c < 256; c++) {
+        uint64_t r = palette[3 * c] << 8;
+        uint64_t g = palette[3 * c + 1] << 8;
+        uint64_t b = palette[3 * c + 2] << 8;
+        uint64_t i = std::max({r, g, b});
+        table.entry[c] = r | g << 16 | b << 32 | i << 48;
+    }
+}
+
+template <int REC, int ST, int C>
+static void palette_scalar(const uint8_t * in, size_t n,
+                           const ILDAColorTable & colors,
+                           etherdream_point * out) {
+    for (size_t i = 0; i < n; i++) {
+        const uint8_t *b = in + REC * i;
+        uint64_t c = (b[ST] & 0x40) ? 0 : colors.entry[b[C]];
+        out[i].x = b[0] << 8 | b[1];
+        out[i].y = b[2] << 8 | b[3];
+        out[i].r = c;
+        out[i].g = c >> 16;
+        out[i].b = c >> 32;
+        out[i].i = c >> 48;
+        out[i].u1 = out[i].u2 = 0;
+    }
+}
+
+template <int REC, int ST, int R, int G, int B>
+static void truecolor_scalar(const uint8_t * in, size_t n,
+                             etherdream_point * out) {
+    for (size_t i = 0; i < n; i++) {
+        const uint8_t *b = in + REC * i;
+        out[i].x = b[0] << 8 | b[1];
+        out[i].y = b[2] << 8 | b[3];
+        if (b[ST] & 0x40) {
+            out[i].r = out[i].g = out[i].b = out[i].i = 0;
+        } else {
+            out[i].r = b[R] << 8;
+            out[i].g = b[G] << 8;
+            out[i].b = b[B] << 8;
+            out[i].i = std::max({out[i].r, out[i].g, out[i].b});
+        }
+        out[i].u1 = out[i].u2 = 0;
+    }
+}
+
+static void decode_scalar(int format, const uint8_t * in, size_t n,
+                          const ILDAColorTable & colors,
+                          etherdream_point * out) {
+    switch (format) {
+    case 0: palette_scalar<F0>(in, n, colors, out); break;
+    case 1: palette_scalar<F1>(in, n, colors, out); break;
+    case 4: truecolor_scalar<F4>(in, n, out); break;
+    case 5: truecolor_scalar<F5>(in, n, out); break;
+    }
+}
+
+#if HAVE_X86_SIMD
+
+/* The vector decoders load 16 bytes at the start of each record and
+ * shuffle them into a whole etherdream_point: x and y byte-swapped into
+ * place, and each colour byte into the high byte of its word. Blanking
+ * works by spreading the status byte over the colour words and zeroing
+ * them where its 0x40 bit is set. Records near the end of the input, where
+ * a 16-byte load would run past it, are left to the scalar decoders.
+ */
+template <int ST>
+struct Masks {
+    static __m128i xy() {
+        return _mm_setr_epi8(1, 0, 3, 2, -1, -1, -1, -1,
+                             -1, -1, -1, -1, -1, -1, -1, -1);
+    }
+    static __m128i status() {
+        return _mm_setr_epi8(-1, -1, -1, -1, ST, ST, ST, ST,
+                             ST, ST, ST, ST, -1, -1, -1, -1);
+    }
+    static __m128i color(int r, int g, int b) {
+        return _mm_setr_epi8(1, 0, 3, 2, -1, r, -1, g,
+                             -1, b, -1, -1, -1, -1, -1, -1);
+    }
+    /* Put one byte where intensity's high byte goes. */
+    static __m128i intensity(int c) {
+        return _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+                             -1, -1, -1, c, -1, -1, -1, -1);
+    }
+};
+
+/* How many records from the one a load starts at it covers. */
+#define SPAN(rec)   ((16 + (rec) - 1) / (rec))
+
+template <int REC, int ST, int C>
+__attribute__((target("ssse3")))
+static size_t palette_ssse3(const uint8_t * in, size_t n,
+                            const ILDAColorTable & colors,
+                            etherdream_point * out) {
+    const __m128i xy = Masks<ST>::xy();
+    const __m128i st = Masks<ST>::status();
+    const __m128i blank = _mm_set1_epi8(0x40);
+    size_t i;
+
+    for (i = 0; i + SPAN(REC) <= n; i++) {
+        const uint8_t *b = in + REC * i;
+        __m128i v = _mm_loadu_si128((const __m128i *)b);
+        __m128i c = _mm_slli_si128(_mm_loadl_epi64(
+            (const __m128i *)&colors.entry[b[C]]), 4);
+        __m128i keep = _mm_cmpeq_epi8(_mm_and_si128(
+            _mm_shuffle_epi8(v, st), blank), _mm_setzero_si128());
+        __m128i p = _mm_or_si128(_mm_shuffle_epi8(v, xy), c);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_and_si128(p, keep));
+    }
+
+    return i;
+}
+
+template <int REC, int ST, int R, int G, int B>
+__attribute__((target("ssse3")))
+static size_t truecolor_ssse3(const uint8_t * in, size_t n,
+                              etherdream_point * out) {
+    const __m128i pos = Masks<ST>::color(R, G, B);
+    const __m128i ri = Masks<ST>::intensity(R);
+    const __m128i gi = Masks<ST>::intensity(G);
+    const __m128i bi = Masks<ST>::intensity(B);
+    const __m128i st = Masks<ST>::status();
+    const __m128i blank = _mm_set1_epi8(0x40);
+    size_t i;
+
+    for (i = 0; i + SPAN(REC) <= n; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + REC * i));
+        __m128i m = _mm_max_epu8(_mm_shuffle_epi8(v, ri), _mm_max_epu8(
+            _mm_shuffle_epi8(v, gi), _mm_shuffle_epi8(v, bi)));
+        __m128i keep = _mm_cmpeq_epi8(_mm_and_si128(
+            _mm_shuffle_epi8(v, st), blank), _mm_setzero_si128());
+        __m128i p = _mm_or_si128(_mm_shuffle_epi8(v, pos), m);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_and_si128(p, keep));
+    }
+
+    return i;
+}
+
+__attribute__((target("ssse3")))
+static void decode_ssse3(int format, const uint8_t * in, size_t n,
+                         const ILDAColorTable & colors,
+                         etherdream_point * out) {
+    size_t i = 0;
+
+    switch (format) {
+    case 0: i = palette_ssse3<F0>(in, n, colors, out); break;
+    case 1: i = palette_ssse3<F1>(in, n, colors, out); break;
+    case 4: i = truecolor_ssse3<F4>(in, n, out); break;
+    case 5: i = truecolor_ssse3<F5>(in, n, out); break;
+    }
+
+    decode_scalar(format, in + i * ilda_record_size(format), n - i, colors,
+                  out + i);
+}
+
+/* What decode_pick() uses without AVX2: the palette decoders above are
+ * no faster than scalar, as the colour lookup is a load per point either way
+ * and the shuffles only add to it, so only the true-colour formats are
+ * worth doing with SSSE3. ILDA_DECODE_SSSE3 still gets all four, so that
+ * decbench can time them. */
+__attribute__((target("ssse3")))
+static void decode_ssse3_auto(int format, const uint8_t * in, size_t n,
+                              const ILDAColorTable & colors,
+                              etherdream_point * out) {
+    if (format == 0 || format == 1)
+        decode_scalar(format, in, n, colors, out);
+    else
+        decode_ssse3(format, in, n, colors, out);
+}
+
+/* AVX2 does the same with two points to a register, one per 128-bit
+ * lane; the palette decoder fetches four colours at once with a gather. */
+__attribute__((target("avx2")))
+static inline __m256i load2(const uint8_t * a, const uint8_t * b) {
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(
+        _mm_loadu_si128((const __m128i *)a)),
+        _mm_loadu_si128((const __m128i *)b), 1);
+}
+
+template <int REC, int ST, int C>
+__attribute__((target("avx2")))
+static size_t palette_avx2(const uint8_t * in, size_t n,
+                           const ILDAColorTable & colors,
+                           etherdream_point * out) {
+    const __m256i xy = _mm256_broadcastsi128_si256(Masks<ST>::xy());
+    const __m256i st = _mm256_broadcastsi128_si256(Masks<ST>::status());
+    const __m256i cmask = _mm256_broadcastsi128_si256(
+        _mm_setr_epi32(0, -1, -1, 0));
+    const __m256i blank = _mm256_set1_epi8(0x40);
+    const long long *table = (const long long *)colors.entry;
+    size_t i;
+
+    for (i = 0; i + 3 + SPAN(REC) <= n; i += 4) {
+        const uint8_t *b = in + REC * i;
+
+        /* Gathered in the order 0, 2, 1, 3 so that shifting each lane
+         * left or right by four bytes puts points 0 and 1's colours, or
+         * 2 and 3's, in place. */
+        __m128i idx = _mm_setr_epi32(b[C], b[2 * REC + C], b[REC + C],
+                                     b[3 * REC + C]);
+        __m256i c = _mm256_i32gather_epi64(table, idx, 8);
+        __m256i c01 = _mm256_and_si256(_mm256_slli_si256(c, 4), cmask);
+        __m256i c23 = _mm256_and_si256(_mm256_srli_si256(c, 4), cmask);
+
+        __m256i v = load2(b, b + REC);
+        __m256i keep = _mm256_cmpeq_epi8(_mm256_and_si256(
+            _mm256_shuffle_epi8(v, st), blank), _mm256_setzero_si256());
+        __m256i p = _mm256_or_si256(_mm256_shuffle_epi8(v, xy), c01);
+        _mm256_storeu_si256((__m256i *)(out + i),
+                            _mm256_and_si256(p, keep));
+
+        v = load2(b + 2 * REC, b + 3 * REC);
+        keep = _mm256_cmpeq_epi8(_mm256_and_si256(
+            _mm256_shuffle_epi8(v, st), blank), _mm256_setzero_si256());
+        p = _mm256_or_si256(_mm256_shuffle_epi8(v, xy), c23);
+        _mm256_storeu_si256((__m256i *)(out + i + 2),
+                            _mm256_and_si256(p, keep));
+    }
+
+    return i;
+}
+
+template <int REC, int ST, int R, int G, int B>
+__attribute__((target("avx2")))
+static size_t truecolor_avx2(const uint8_t * in, size_t n,
+                             etherdream_point * out) {
+    const __m256i pos = _mm256_broadcastsi128_si256(
+        Masks<ST>::color(R, G, B));
+    const __m256i ri = _mm256_broadcastsi128_si256(Masks<ST>::intensity(R));
+    const __m256i gi = _mm256_broadcastsi128_si256(Masks<ST>::intensity(G));
+    const __m256i bi = _mm256_broadcastsi128_si256(Masks<ST>::intensity(B));
+    const __m256i st = _mm256_broadcastsi128_si256(Masks<ST>::status());
+    const __m256i blank = _mm256_set1_epi8(0x40);
+    size_t i;
+
+    for (i = 0; i + 1 + SPAN(REC) <= n; i += 2) {
+        const uint8_t *b = in + REC * i;
+        __m256i v = load2(b, b + REC);
+        __m256i m = _mm256_max_epu8(_mm256_shuffle_epi8(v, ri),
+            _mm256_max_epu8(_mm256_shuffle_epi8(v, gi),
+                            _mm256_shuffle_epi8(v, bi)));
+        __m256i keep = _mm256_cmpeq_epi8(_mm256_and_si256(
+            _mm256_shuffle_epi8(v, st), blank), _mm256_setzero_si256());
+        __m256i p = _mm256_or_si256(_mm256_shuffle_epi8(v, pos), m);
+        _mm256_storeu_si256((__m256i *)(out + i),
+                            _mm256_and_si256(p, keep));
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+static void decode_avx2(int format, const uint8_t * in, size_t n,
+                        const ILDAColorTable & colors,
+                        etherdream_point * out) {
+    size_t i = 0;
+
+    switch (format) {
+    case 0: i = palette_avx2<F0>(in, n, colors, out); break;
+    case 1: i = palette_avx2<F1>(in, n, colors, out); break;
+    case 4: i = truecolor_avx2<F4>(in, n, out); break;
+    case 5: i = truecolor_avx2<F5>(in, n, out); break;
+    }
+
+    decode_scalar(format, in + i * ilda_record_size(format), n - i, colors,
+                  out + i);
+}
+
+#endif
+
+typedef void (*decode_fn)(int format, const uint8_t * in, size_t n,
+                          const ILDAColorTable & colors,
+                          etherdream_point * out);
+
+static std::atomic<decode_fn> decode_kernel;
+
+/* Choose the fastest decoder this CPU can run. */
+static decode_fn decode_pick() {
+#if HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return decode_avx2;
+    if (__builtin_cpu_supports("ssse3"))
+        return decode_ssse3_auto;
+#endif
+    return decode_scalar;
+}
+
+void ilda_decode(int format, const uint8_t * in, size_t n,
+                 const ILDAColorTable & colors, etherdream_point * out) {
+    decode_fn fn = decode_kernel.load(std::memory_order_relaxed);
+    if (!fn) {
+        fn = decode_pick();
+        decode_kernel.store(fn, std::memory_order_relaxed);
+    }
+    fn(format, in, n, colors, out);
+}
+
+int ilda_set_decode_kernel(ILDADecodeKernel kernel) {
+    decode_fn fn = nullptr;
+
+    switch (kernel) {
+    case ILDA_DECODE_AUTO:
+        fn = decode_pick();
+        break;
+    case ILDA_DECODE_SCALAR:
+        fn = decode_scalar;
+        break;
+#if HAVE_X86_SIMD
+    case ILDA_DECODE_SSSE3:
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("ssse3"))
+            fn = decode_ssse3;
+        break;
+    case ILDA_DECODE_AVX2:
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            fn = decode_avx2;
+        break;
+#endif
+    default:
+        break;
+    }
+
+    if (!fn)
+        return -1;
+    decode_kernel.store(fn, std::memory_order_relaxed);
+    return 0;
+}
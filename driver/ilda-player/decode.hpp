@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "etherdream.h"
+
+/* Size of one record in each ILDA format, or 0 for formats we can't read. */
+size_t ilda_record_size(int format);
+
+/* Colours for the palette formats, with intensity worked out ahead of
+ * time: each entry holds r, g, b and i as 16-bit values, in that order from
+ * the low bits up, so that decoding a palette point is a single lookup. */
+struct ILDAColorTable {
+    uint64_t entry[256];
+};
+
+void ilda_color_table(const uint8_t * palette, ILDAColorTable & table);
+
+/* Decode n records of ILDA format 0, 1, 4 or 5 from in into out. colors is
+ * only used by the palette formats. */
+void ilda_decode(int format, const uint8_t * in, size_t n,
+                 const ILDAColorTable & colors, etherdream_point * out);
+
+/* As with etherdream_set_convert_kernel(), the fastest decoder this CPU
+ * supports is used by default; this forces one, for benchmarking and
+ * testing. They all give identical results. Returns 0 on success, -1 if
+ * this CPU or build can't run the one asked for. */
+enum ILDADecodeKernel {
+    ILDA_DECODE_AUTO,
+    ILDA_DECODE_SCALAR,
+    ILDA_DECODE_SSSE3,
+    ILDA_DECODE_AVX2,
+};
+
+int ilda_set_decode_kernel(ILDADecodeKernel kernel);
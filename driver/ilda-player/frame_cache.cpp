@@ -0,0 +1,73 @@
+#include "frame_cache.hpp"
+
+#include <functional>
+#include <protocol.h>
+
+size_t FrameCache::KeyHash::operator()(const Key & k) const {
+    size_t h = std::hash<const void *>()(k.file);
+    h = h * 31 + k.frame;
+    h = h * 31 + k.point;
+    h = h * 31 + k.version;
+    return h;
+}
+
+FrameCache::Entry FrameCache::find(const Key & key) {
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    if (!m_budget) {
+        return nullptr;
+    }
+
+    auto it = m_index.find(key);
+    if (it == m_index.end()) {
+        m_misses++;
+        return nullptr;
+    }
+
+    m_hits++;
+    m_lru.splice(m_lru.begin(), m_lru, it->second);
+    return it->second->entry;
+}
+
+FrameCache::Entry FrameCache::insert(const Key & key,
+                                     const etherdream_point * pts,
+                                     size_t n) {
+    /* What the DAC's copy of the points takes, which is most of it. */
+    size_t bytes = n * sizeof(struct dac_point) + sizeof(Node);
+    if (bytes > m_budget) {
+        return nullptr;
+    }
+
+    /* Convert outside the lock; the reader may be waiting on it. */
+    Entry entry(etherdream_frame_create(pts, n), etherdream_frame_release);
+    if (!entry) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    auto it = m_index.find(key);
+    if (it != m_index.end()) {
+        m_bytes -= it->second->bytes;
+        m_lru.erase(it->second);
+        m_index.erase(it);
+    }
+
+    while (m_bytes + bytes > m_budget) {
+        const Node & old = m_lru.back();
+        m_bytes -= old.bytes;
+        m_index.erase(old.key);
+        m_lru.pop_back();
+        m_evictions++;
+    }
+
+    m_lru.push_front({ key, entry, bytes });
+    m_index[key] = m_lru.begin();
+    m_bytes += bytes;
+    return entry;
+}
+
+FrameCache::Stats FrameCache::stats() const {
+    std::lock_guard<std::mutex> lock(m_lock);
+    return { m_hits, m_misses, m_evictions, m_lru.size(), m_bytes, m_budget };
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "etherdream.h"
+
+/* Points that have already been read, decoded, transformed and converted
+ * for the DAC, so that a file played on repeat only goes through all that
+ * once. Each entry is one chunk as read from the file: the key is the
+ * file, the frame, where in the frame the chunk starts, and the version of
+ * the transform it went through, so a new transform never picks up stale
+ * points. Entries are kept as etherdream_frames, ready to hand straight to
+ * etherdream_write_frame(), and the least recently used are dropped to
+ * stay within the memory budget. A budget of 0 turns the cache off.
+ *
+ * The reader looks entries up and the transformer adds them, so every
+ * method takes a lock; that's once per chunk, not per point.
+ */
+class FrameCache {
+public:
+    struct Key {
+        const void * file;
+        size_t frame;
+        size_t point;
+        unsigned version;
+
+        bool operator==(const Key & o) const {
+            return file == o.file && frame == o.frame && point == o.point
+                && version == o.version;
+        }
+    };
+
+    typedef std::shared_ptr<etherdream_frame> Entry;
+
+    explicit FrameCache(size_t budget) : m_budget(budget) {}
+
+    /* The entry for key, or null. */
+    Entry find(const Key & key);
+
+    /* Convert n points and add them as key's entry, dropping old entries
+     * to make room. Returns the new entry, or null if the cache is off or
+     * the points don't fit in it at all. */
+    Entry insert(const Key & key, const etherdream_point * pts, size_t n);
+
+    struct Stats {
+        uint64_t hits, misses, evictions;
+        size_t entries, bytes, budget;
+    };
+
+    Stats stats() const;
+
+private:
+    struct KeyHash {
+        size_t operator()(const Key & k) const;
+    };
+
+    struct Node {
+        Key key;
+        Entry entry;
+        size_t bytes;
+    };
+
+    typedef std::list<Node> LRU;
+
+    mutable std::mutex m_lock;
+    LRU m_lru;      /* most recently used first */
+    std::unordered_map<Key, LRU::iterator, KeyHash> m_index;
+    size_t m_budget;
+    size_t m_bytes = 0;
+    uint64_t m_hits = 0, m_misses = 0, m_evictions = 0;
+};
@@ -1,226 +1,187 @@
 #include "ilda.hpp"
+#include "decode.hpp"
 #include "etherdream.h"
 
 #include <utility>
 #include <algorithm>
 #include <iostream>
-#include <fstream>
 #include <cassert>
+#include <cstring>
 
-enum State {
-    STATE_BETWEEN_FRAMES = -1,
-    STATE_ILDA_0 = 0,
-    STATE_ILDA_1 = 1,
-    STATE_ILDA_2 = 2,
-    STATE_ILDA_3 = 3,
-    STATE_ILDA_4 = 4,
-    STATE_ILDA_5 = 5,
-};
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ILDA_HEADER_SIZE    32
 
 struct ILDAFile::Impl {
 
+    /* Where each frame's points start in the mapping, and how to decode
+     * them. colors is an index into m_colors: 0 for the palette passed to
+     * the constructor, or one for each palette in the file. */
+    struct Frame {
+        size_t offset;
+        int format;
+        int npoints;
+        int colors;
+    };
+
     Impl(const char * filename, bool do_repeat, const Palette & palette)
-        : m_stream(filename),
-          m_do_repeat(do_repeat),
-          m_palette(palette) {
+        : m_do_repeat(do_repeat),
+          m_colors(1) {
 
-        if (!m_stream) {
+        ilda_color_table(palette.data, m_colors[0]);
+
+        int fd = open(filename, O_RDONLY);
+        struct stat sb;
+        if (fd < 0 || fstat(fd, &sb) < 0) {
             std::cerr << "failed to open " << filename << "\n";
             exit(1);
         }
-    }
 
-    static void calculate_intensity(etherdream_point & p) {
-        p.i = std::max({p.r, p.g, p.b});
-    }
-
-    void ilda_palette_point(etherdream_point & p, uint16_t color) {
-        if (color & 0x4000) {
-            /* "Blanking" flag */
-            p.r = 0;
-            p.g = 0;
-            p.b = 0;
-            p.i = 0;
-        } else {
-            /* Palette index */
-            p.r = m_palette.data[3 * color] << 8;
-            p.g = m_palette.data[3 * color + 1] << 8;
-            p.b = m_palette.data[3 * color + 2] << 8;
-            calculate_intensity(p);
+        m_size = sb.st_size;
+        if (m_size) {
+            void *map = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) {
+                std::cerr << "failed to map " << filename << "\n";
+                exit(1);
+            }
+            m_map = (const uint8_t *)map;
+            madvise(map, m_size, MADV_WILLNEED);
         }
-    }
+        close(fd);
 
-    void ilda_tc_point(etherdream_point & p, int r, int g, int b, int flags) {
-        if (flags & 0x40) {
-            /* "Blanking" flag */
-            p.r = 0;
-            p.g = 0;
-            p.b = 0;
-            p.i = 0;
-        } else {
-            p.r = r << 8;
-            p.g = g << 8;
-            p.b = b << 8;
-            calculate_intensity(p);
-        }
+        build_index();
     }
 
-    void require_read(uint8_t *buf, size_t n) {
-        m_stream.read((char*)buf, n);
-        if (m_stream.gcount() != n) {
-            std::cerr << "unexpected EOF in ILDA file\n";
-            exit(1);
-        }
+    ~Impl() {
+        if (m_map)
+            munmap((void *)m_map, m_size);
     }
 
-    void read_header() {
-        uint8_t buf[8];
-
-        m_stream.read((char*)buf, 8);
-        if (m_stream.gcount() == 0) {
-            if (m_do_repeat) {
-                m_stream.clear();
-                m_stream.seekg(0);
-                m_stream.read((char*)buf, 8);
-            } else {
-                std::cerr << "EOF reached\n";
-                exit(0);
-            }
-        }
+    /* Walk every header in the file once, recording where each frame's
+     * points are and which palette was in effect for it. Frames with no
+     * points, including the end-of-file marker, are left out. */
+    void build_index() {
+        size_t pos = 0;
+        int colors = 0;
 
-        if (m_stream.gcount() != 8) {
-            std::cerr << "unexpected EOF in ILDA file\n";
-            exit(1);
-        }
+        while (pos < m_size) {
+            if (m_size - pos < ILDA_HEADER_SIZE) {
+                std::cerr << "unexpected EOF in ILDA file\n";
+                exit(1);
+            }
 
-        if (memcmp(buf, "ILDA\0\0\0", 7) != 0) {
-            std::cerr << "expected ILDA header\n";
-            exit(1);
-        }
+            const uint8_t *h = m_map + pos;
+            if (memcmp(h, "ILDA\0\0\0", 7) != 0) {
+                std::cerr << "expected ILDA header\n";
+                exit(1);
+            }
 
-        m_state = (State)buf[7];
+            /* After the format come the frame and company names, then
+             * the number of records, frame number, total frames, scanner
+             * head, and "future". We only care about the record count. */
+            int format = h[7];
+            int count = h[24] << 8 | h[25];
+            size_t rec = ilda_record_size(format);
+            pos += ILDA_HEADER_SIZE;
 
-        /* Read the rest of the header of this particular frame. */
-        switch (m_state) {
-        case STATE_ILDA_0:
-        case STATE_ILDA_1:
-        case STATE_ILDA_4:
-        case STATE_ILDA_5:
-            {
-            /* 2D, 3D, and formats 4 and 5 */
+            if (!rec) {
+                std::cerr << "ILDA: bad format " << format << "\n";
+                exit(1);
+            }
 
-            /* Throw away "frame name" and "company name" */
-            require_read(buf, 8);
-            require_read(buf, 8);
+            if ((m_size - pos) / rec < (size_t)count) {
+                std::cerr << "unexpected EOF in ILDA file\n";
+                exit(1);
+            }
 
-            /* Read the rest of the header */
-            require_read(buf, 8);
+            if (format == 2) {
+                uint8_t p[256*3] = {};
+                memcpy(p, m_map + pos, std::min(count, 256) * 3);
+                m_colors.emplace_back();
+                ilda_color_table(p, m_colors.back());
+                colors = m_colors.size() - 1;
+            } else if (count) {
+                m_frames.push_back({ pos, format, count, colors });
+            }
 
-            /* The rest of the header contains total points, frame number,
-             * total frames, scanner head, and "future". We only care about
-             * the first. */
-            int npoints = buf[0] << 8 | buf[1];
+            pos += rec * count;
+        }
+    }
 
-            std::cout << "frame - " << npoints << " points\n";
-            m_points_left = npoints;
+    /* Move on to the next frame to play, forwards or backwards. Returns
+     * false if there isn't one and we aren't repeating. */
+    bool next_frame() {
+        m_point = 0;
 
-            if (!npoints) {
-                m_state = STATE_BETWEEN_FRAMES;
-            }
-            }
-            break;
+        if (!m_reverse) {
+            if (++m_frame < m_frames.size())
+                return true;
+            m_frame = 0;
+        } else {
+            if (m_frame-- > 0)
+                return true;
+            m_frame = m_frames.size() - 1;
+        }
 
-        default:
-            std::cerr << "ILDA: bad format " << m_state << "\n";
-            exit(1);
+        if (!m_do_repeat) {
+            std::cerr << "EOF reached\n";
+            m_done = true;
         }
+        return !m_done;
     }
 
 #define ILDA_MAX_POINTS_PER_LOOP    2000
 
-    int do_read_points(int points, std::vector<etherdream_point> & point_buf) {
-        int i;
+    /* How many of the current frame's points to hand out at once. */
+    int points_to_read(int points) const {
+        int points_left = m_frames[m_frame].npoints - m_point;
 
-        uint8_t ilda_buffer[16 * ILDA_MAX_POINTS_PER_LOOP];
-
-        /* Now that we have some actual data, read from the file. */
-        if (points > m_points_left)
-            points = m_points_left;
+        if (points > points_left)
+            points = points_left;
 
         if (points > ILDA_MAX_POINTS_PER_LOOP)
             points = ILDA_MAX_POINTS_PER_LOOP;
 
-        std::cout << m_points_left << " left, reading up to " << points << "\n";
-
-        point_buf.resize(points);
+        return points;
+    }
 
-        switch (m_state) {
-            case STATE_ILDA_0:
-                /* 3D w/ palette */
-                require_read(ilda_buffer, 8 * points);
-                for (i = 0; i < points; i++) {
-                    uint8_t *b = ilda_buffer + 8*i;
-                    point_buf[i].x = b[0] << 8 | b[1];
-                    point_buf[i].y = b[2] << 8 | b[3];
-                    ilda_palette_point(point_buf[i], b[6] << 8 | b[7]);
-                }
-
-                break;
-
-            case STATE_ILDA_1:
-                /* 2D w/ palette */
-                require_read(ilda_buffer, 6 * points);
-                for (i = 0; i < points; i++) {
-                    uint8_t *b = ilda_buffer + 6*i;
-                    point_buf[i].x = b[0] << 8 | b[1];
-                    point_buf[i].y = b[2] << 8 | b[3];
-                    ilda_palette_point(point_buf[i], b[4] << 8 | b[5]);
-                }
-                break;
-
-            case STATE_ILDA_4:
-                /* 3D truecolor */
-                require_read(ilda_buffer, 10 * points);
-                for (i = 0; i < points; i++) {
-                    uint8_t *b = ilda_buffer + 10*i;
-                    point_buf[i].x = b[0] << 8 | b[1];
-                    point_buf[i].y = b[2] << 8 | b[3];
-                    ilda_tc_point(point_buf[i], b[9], b[8], b[7], b[6]);
-                }
-                break;
-
-            case STATE_ILDA_5:
-                /* 2D truecolor */
-                require_read(ilda_buffer, 8 * points);
-                for (i = 0; i < points; i++) {
-                    uint8_t *b = ilda_buffer + 8*i;
-                    point_buf[i].x = b[0] << 8 | b[1];
-                    point_buf[i].y = b[2] << 8 | b[3];
-                    ilda_tc_point(point_buf[i], b[7], b[6], b[5], b[4]);
-                }
-                break;
-
-            default:
-                std::cerr << "bad m_state\n";
-                exit(1);
+    /* Step past points that have been read, moving on to the next frame
+     * at the end of this one. */
+    void advance(int points) {
+        m_point += points;
+        if (m_point == m_frames[m_frame].npoints) {
+            next_frame();
         }
+    }
 
-        /* Now that we've read points, advance */
-        m_points_left -= points;
+    /* Decode points straight out of the mapping. */
+    int do_read_points(int points, std::vector<etherdream_point> & point_buf) {
+        const Frame & f = m_frames[m_frame];
+        points = points_to_read(points);
+        point_buf.resize(points);
 
-        /* Do we need to move to the next frame, or repeat this one? */
-        if (!m_points_left) {
-            m_state = STATE_BETWEEN_FRAMES;
-        }
+        const uint8_t * ilda_buffer = m_map + f.offset
+                                    + m_point * ilda_record_size(f.format);
+        ilda_decode(f.format, ilda_buffer, points, m_colors[f.colors],
+                    point_buf.data());
 
+        advance(points);
         return points;
-}
+    }
+
+    const uint8_t * m_map = nullptr;
+    size_t m_size;
+    std::vector<Frame> m_frames;
 
-    std::ifstream m_stream;
     bool m_do_repeat;
-    const Palette & m_palette;
-    State m_state = STATE_BETWEEN_FRAMES;
-    int m_points_left;
+    std::vector<ILDAColorTable> m_colors;
+    bool m_reverse = false;
+    bool m_done = false;
+    size_t m_frame = 0;
+    int m_point = 0;
 };
 
 ILDAFile::ILDAFile(const char * filename, bool do_repeat, const Palette & palette)
@@ -231,18 +192,51 @@ ILDAFile::~ILDAFile() = default;
 
 size_t ILDAFile::read(size_t max,
                       std::vector<etherdream_point> & point_buf) {
-
-    std::cout << "read(" << max << ")\n";
-
     point_buf.clear();
 
-    while (m_impl->m_state == STATE_BETWEEN_FRAMES) {
-        m_impl->read_header();
+    if (m_impl->m_done || m_impl->m_frames.empty()) {
+        return 0;
     }
 
     return m_impl->do_read_points(max, point_buf);
 }
 
+size_t ILDAFile::skip(size_t max) {
+    if (m_impl->m_done || m_impl->m_frames.empty()) {
+        return 0;
+    }
+
+    int points = m_impl->points_to_read(max);
+    m_impl->advance(points);
+    return points;
+}
+
+size_t ILDAFile::frame_count() const {
+    return m_impl->m_frames.size();
+}
+
+size_t ILDAFile::tell() const {
+    return m_impl->m_frame;
+}
+
+void ILDAFile::seek(size_t frame) {
+    if (frame >= m_impl->m_frames.size()) {
+        return;
+    }
+
+    m_impl->m_frame = frame;
+    m_impl->m_point = 0;
+    m_impl->m_done = false;
+}
+
+size_t ILDAFile::tell_point() const {
+    return m_impl->m_point;
+}
+
+void ILDAFile::set_reverse(bool reverse) {
+    m_impl->m_reverse = reverse;
+}
+
 const ILDAFile::Palette ILDAFile::Palette::ilda64 = { {
     255,   0,   0, 255,  16,   0, 255,  32,   0, 255,  48,   0,
     255,  64,   0, 255,  80,   0, 255,  96,   0, 255, 112,   0,
@@ -23,6 +23,23 @@ public:
     size_t read(size_t max,
                 std::vector<etherdream_point> & point_buf);
 
+    /* Move past the points read(max) would return, without decoding
+     * them, for when they are already to hand. */
+    size_t skip(size_t max);
+
+    /* The file is indexed when it is opened, so any frame can be jumped to
+     * directly. Frames are numbered from 0, not counting palettes and
+     * empty frames. */
+    size_t frame_count() const;
+    size_t tell() const;
+    void seek(size_t frame);
+
+    /* Where in the current frame the next read() starts. */
+    size_t tell_point() const;
+
+    /* Play frames last to first. */
+    void set_reverse(bool reverse);
+
 private:
     struct Impl;
     const std::unique_ptr<Impl> m_impl;
@@ -14,17 +14,26 @@
  */
 
 #include "ilda.hpp"
+#include "frame_cache.hpp"
+#include "queue.hpp"
+#include "xform.hpp"
 #include "etherdream.h"
 
 #include <getopt.h>
 #include <iostream>
 #include <fstream>
 #include <thread>
+#include <atomic>
+#include <chrono>
 #include <cassert>
 #include <cmath>
 #include <deque>
 
 const double MIN_SIZE = 0.1;
+const size_t CHUNK_POINTS = 1600;
+const auto POLL_INTERVAL = std::chrono::microseconds(200);
+const auto POLL_INTERVAL_MAX = std::chrono::microseconds(5000);
+const auto STATS_INTERVAL = std::chrono::seconds(5);
 
 void usage(const char * argv0) {
     std::cerr << "Usage: " << argv0 << " file.wav [options]\n";
@@ -41,6 +50,15 @@ void usage(const char * argv0) {
     std::cerr << "\t-brightness level     Scale all colors by multiplying by level. 1.0 for full\n";
     std::cerr << "\t                      brightness, 0.5 for half power, etc.\n";
     std::cerr << "\t-repeat               Repeat forever.\n";
+    std::cerr << "\t-start frame          Start playing at this frame.\n";
+    std::cerr << "\t-reverse              Play frames last to first.\n";
+    std::cerr << "\t-queue chunks         Chunks of " << CHUNK_POINTS << " points to buffer between\n";
+    std::cerr << "\t                      reading, transforming and sending. Default: 8\n";
+    std::cerr << "\t-cache MiB            Memory to keep transformed frames in with -repeat, so\n";
+    std::cerr << "\t                      that later loops play from memory. 0 to turn off.\n";
+    std::cerr << "\t                      Default: 64\n";
+    std::cerr << "\t-stats                Print how long each stage spends working and\n";
+    std::cerr << "\t                      waiting every few seconds.\n";
     exit(1);
 }
 
@@ -54,6 +72,11 @@ enum opt : int {
     OFFSET_Y,
     REPEAT,
     BRIGHTNESS,
+    START,
+    REVERSE,
+    QUEUE,
+    CACHE,
+    STATS,
 };
 
 static option opts[] = {
@@ -66,6 +89,11 @@ static option opts[] = {
     { "y-offset", required_argument, nullptr, opt::OFFSET_Y },
     { "repeat", no_argument, nullptr, opt::REPEAT },
     { "brightness", required_argument, nullptr, opt::BRIGHTNESS },
+    { "start", required_argument, nullptr, opt::START },
+    { "reverse", no_argument, nullptr, opt::REVERSE },
+    { "queue", required_argument, nullptr, opt::QUEUE },
+    { "cache", required_argument, nullptr, opt::CACHE },
+    { "stats", no_argument, nullptr, opt::STATS },
     {}
 };
 
@@ -77,12 +105,175 @@ static bool valid_offset(double offset) {
     return (offset <= 1) && (offset >= -1);
 }
 
+/* Playback runs as three stages, each on its own thread: reading points
+ * from the file, transforming them, and sending them to the DAC. Chunks of
+ * points circulate between them through lock-free queues, from the free
+ * queue to the reader, to the transformer, to the sender, and back; when
+ * a stage's output queue is full it waits, so a stage can only get as far
+ * ahead as there are chunks. A chunk with no points marks the end.
+ *
+ * A chunk the frame cache already has skips the work: the reader passes
+ * along the cached entry instead of points, and the transformer leaves it
+ * alone. Otherwise the transformer adds what it made to the cache, and
+ * the sender writes whichever it ends up with.
+ */
+struct Chunk {
+    std::vector<etherdream_point> points;
+    size_t frame, point;
+    FrameCache::Entry cached;
+};
+
+typedef SPSCQueue<Chunk *> ChunkQueue;
+
+/* Where each stage's time goes, in nanoseconds: working, waiting for a
+ * chunk to work on (starved), and waiting to pass one on (blocked), as
+ * well as the longest it spent working on any one chunk. */
+struct StageStats {
+    const char * name;
+    std::atomic<uint64_t> chunks { 0 };
+    std::atomic<uint64_t> busy { 0 };
+    std::atomic<uint64_t> slowest { 0 };
+    std::atomic<uint64_t> starved { 0 };
+    std::atomic<uint64_t> blocked { 0 };
+};
+
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Take a chunk from q, or push c onto it, waiting as long as it takes and
+ * adding the time spent waiting to waited. The longer the wait goes on,
+ * the less often the queue is checked, up to POLL_INTERVAL_MAX; that is
+ * still far less than a chunk's worth of points, and it keeps a stage
+ * that is waiting on the DAC from burning CPU. */
+static Chunk * pop_wait(ChunkQueue & q, std::atomic<uint64_t> & waited) {
+    Chunk * c;
+    if (q.try_pop(c)) {
+        return c;
+    }
+
+    uint64_t start = now_ns();
+    auto interval = POLL_INTERVAL;
+    while (!q.try_pop(c)) {
+        std::this_thread::sleep_for(interval);
+        interval = std::min(interval * 2, POLL_INTERVAL_MAX);
+    }
+    waited += now_ns() - start;
+    return c;
+}
+
+static void push_wait(ChunkQueue & q, Chunk * c,
+                      std::atomic<uint64_t> & waited) {
+    if (q.try_push(c)) {
+        return;
+    }
+
+    uint64_t start = now_ns();
+    auto interval = POLL_INTERVAL;
+    while (!q.try_push(c)) {
+        std::this_thread::sleep_for(interval);
+        interval = std::min(interval * 2, POLL_INTERVAL_MAX);
+    }
+    waited += now_ns() - start;
+}
+
+static void stage_done(StageStats & s, uint64_t start) {
+    uint64_t t = now_ns() - start;
+    s.chunks++;
+    s.busy += t;
+    if (t > s.slowest) {
+        s.slowest = t;
+    }
+}
+
+static FrameCache::Key cache_key(const ILDAFile & f, const Chunk * c,
+                                  const PointTransform & t) {
+    return { &f, c->frame, c->point, t.version() };
+}
+
+static void read_stage(ILDAFile & f, FrameCache & cache,
+                       const PointTransform & t, ChunkQueue & in,
+                       ChunkQueue & out, StageStats & s) {
+    while (1) {
+        /* Waiting for a free chunk means the later stages are behind. */
+        Chunk * c = pop_wait(in, s.blocked);
+
+        uint64_t start = now_ns();
+        c->frame = f.tell();
+        c->point = f.tell_point();
+        c->points.clear();
+        c->cached = cache.find(cache_key(f, c, t));
+        bool eof = false;
+        if (!c->cached || !f.skip(CHUNK_POINTS)) {
+            c->cached = nullptr;
+            eof = !f.read(CHUNK_POINTS, c->points);
+        }
+        stage_done(s, start);
+
+        push_wait(out, c, s.blocked);
+        if (eof) {
+            return;
+        }
+    }
+}
+
+static void transform_stage(const ILDAFile & f, FrameCache & cache,
+                            const PointTransform & t, ChunkQueue & in,
+                            ChunkQueue & out, StageStats & s) {
+    while (1) {
+        Chunk * c = pop_wait(in, s.starved);
+        bool eof = c->points.empty() && !c->cached;
+
+        uint64_t start = now_ns();
+        if (!c->cached && !eof) {
+            t.apply(c->points.data(), c->points.size());
+            c->cached = cache.insert(cache_key(f, c, t), c->points.data(),
+                                     c->points.size());
+        }
+        stage_done(s, start);
+
+        push_wait(out, c, s.blocked);
+        if (eof) {
+            return;
+        }
+    }
+}
+
+static void print_stats(etherdream * ed, const FrameCache & cache,
+                        const StageStats * stages, int n) {
+    etherdream_stats ds;
+    etherdream_get_stats(ed, &ds);
+    FrameCache::Stats cs = cache.stats();
+
+    for (int i = 0; i < n; i++) {
+        const StageStats & s = stages[i];
+        std::cerr << s.name << ": " << s.chunks << " chunks, busy "
+                  << s.busy / 1000000 << " ms (slowest "
+                  << s.slowest / 1000 << " us), starved "
+                  << s.starved / 1000000 << " ms, blocked "
+                  << s.blocked / 1000000 << " ms\n";
+    }
+    if (cs.budget) {
+        std::cerr << "cache: " << cs.hits << " hits, " << cs.misses
+                  << " misses, " << cs.evictions << " evictions, "
+                  << cs.entries << " chunks in " << cs.bytes / 1024
+                  << " of " << cs.budget / 1024 << " KiB\n";
+    }
+    std::cerr << "dac: " << ds.underflows << " underflows\n";
+}
+
 int main(int argc, char **argv) {
 
     bool do_flip_x = false, do_flip_y = false;
     double x_size = 0.5, y_size = 0.5, x_rel_offset = 0, y_rel_offset = 0;
     bool do_repeat = false;
     double brightness = 1;
+    long start_frame = -1;
+    bool do_reverse = false;
+    int queue_chunks = 8;
+    long cache_mib = 64;
+    bool do_stats = false;
     std::string ipaddr;
 
     int flag;
@@ -135,6 +326,33 @@ int main(int argc, char **argv) {
         case opt::REPEAT:
             do_repeat = true;
             break;
+        case opt::START:
+            start_frame = strtol(optarg, nullptr, 10);
+            if (start_frame < 0) {
+                std::cerr << "start frame must not be negative\n";
+                return 1;
+            }
+            break;
+        case opt::REVERSE:
+            do_reverse = true;
+            break;
+        case opt::QUEUE:
+            queue_chunks = atoi(optarg);
+            if (queue_chunks < 2 || queue_chunks > 1024) {
+                std::cerr << "queue must be between 2 and 1024 chunks\n";
+                return 1;
+            }
+            break;
+        case opt::CACHE:
+            cache_mib = atol(optarg);
+            if (cache_mib < 0 || cache_mib > 65536) {
+                std::cerr << "cache must be between 0 and 65536 MiB\n";
+                return 1;
+            }
+            break;
+        case opt::STATS:
+            do_stats = true;
+            break;
         case '?':
             usage(argv[0]);
         default:
@@ -178,7 +396,16 @@ int main(int argc, char **argv) {
 
     ILDAFile f(argv[optind], do_repeat);
 
-    std::vector<etherdream_point> point_buf;
+    if (start_frame >= (long)f.frame_count()) {
+        std::cerr << "file only has " << f.frame_count() << " frames\n";
+        return 1;
+    }
+    f.set_reverse(do_reverse);
+    if (start_frame >= 0) {
+        f.seek(start_frame);
+    } else if (do_reverse && f.frame_count()) {
+        f.seek(f.frame_count() - 1);
+    }
 
     etherdream *ed = etherdream_get(etherdream_id);
     if (etherdream_connect(ed) != 0) {
@@ -186,22 +413,71 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    PointTransform t;
+    t.compile(Calibration::scale_offset(x_size, y_size, x_offset, y_offset,
+                                        brightness));
+
+    /* Without -repeat each chunk is only played once, so there's nothing
+     * to gain from keeping it. */
+    FrameCache cache(do_repeat ? (size_t)cache_mib << 20 : 0);
+
+    std::vector<Chunk> chunks(queue_chunks);
+    ChunkQueue free_chunks(queue_chunks), read_chunks(queue_chunks),
+               ready_chunks(queue_chunks);
+    for (auto & c : chunks) {
+        c.points.reserve(CHUNK_POINTS);
+        free_chunks.try_push(&c);
+    }
+
+    StageStats stages[3];
+    stages[0].name = "read";
+    stages[1].name = "transform";
+    stages[2].name = "send";
+
+    std::thread reader(read_stage, std::ref(f), std::ref(cache), std::cref(t),
+                       std::ref(free_chunks), std::ref(read_chunks),
+                       std::ref(stages[0]));
+    std::thread transformer(transform_stage, std::cref(f), std::ref(cache),
+                            std::cref(t),
+                            std::ref(read_chunks), std::ref(ready_chunks),
+                            std::ref(stages[1]));
+
+    auto next_stats = std::chrono::steady_clock::now() + STATS_INTERVAL;
+
+    /* Send on this thread. Time waiting for the DAC to have room counts as
+     * blocked. */
     while (1) {
-        size_t pts = f.read(1600, point_buf);
-        if (!pts) {
-            return 0;
+        Chunk * c = pop_wait(ready_chunks, stages[2].starved);
+        if (c->points.empty() && !c->cached) {
+            break;
         }
 
-        for (int i = 0; i < point_buf.size(); i++) {
-            point_buf[i].x = point_buf[i].x * x_size + (x_offset * 32767);
-            point_buf[i].y = point_buf[i].y * y_size + (y_offset * 32767);
-            point_buf[i].r *= brightness;
-            point_buf[i].g *= brightness;
-            point_buf[i].b *= brightness;
+        uint64_t start = now_ns();
+        etherdream_wait_for_ready(ed);
+        uint64_t ready = now_ns();
+        stages[2].blocked += ready - start;
+
+        if (c->cached) {
+            etherdream_write_frame(ed, c->cached.get(), f.get_rate(), 1);
+            c->cached = nullptr;
+        } else {
+            etherdream_write(ed, c->points.data(), c->points.size(), f.get_rate(), 1);
         }
+        stage_done(stages[2], ready);
 
-        etherdream_wait_for_ready(ed);
-        etherdream_write(ed, point_buf.data(), point_buf.size(), f.get_rate(), 1);
+        push_wait(free_chunks, c, stages[2].blocked);
+
+        if (do_stats && std::chrono::steady_clock::now() >= next_stats) {
+            print_stats(ed, cache, stages, 3);
+            next_stats += STATS_INTERVAL;
+        }
+    }
+
+    reader.join();
+    transformer.join();
+
+    if (do_stats) {
+        print_stats(ed, cache, stages, 3);
     }
 
     return 0;
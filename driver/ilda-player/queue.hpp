@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/* A bounded single-producer, single-consumer queue. Neither side ever takes
+ * a lock: head is only written by the producer and tail only by the
+ * consumer, each on its own cache line, and both count up forever, with
+ * only the low bits indexing into the slots. try_push() fails when the
+ * queue is full and try_pop() when it is empty; what to do then is up to
+ * the caller. */
+template <typename T>
+class SPSCQueue {
+public:
+    explicit SPSCQueue(size_t capacity) {
+        size_t n = 1;
+        while (n < capacity)
+            n *= 2;
+        m_slots.resize(n);
+        m_mask = n - 1;
+    }
+
+    bool try_push(const T & v) {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head - m_tail.load(std::memory_order_acquire) > m_mask)
+            return false;
+        m_slots[head & m_mask] = v;
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T & v) {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail == m_head.load(std::memory_order_acquire))
+            return false;
+        v = m_slots[tail & m_mask];
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t size() const {
+        return m_head.load(std::memory_order_acquire)
+             - m_tail.load(std::memory_order_acquire);
+    }
+
+private:
+    std::vector<T> m_slots;
+    size_t m_mask;
+
+    char m_pad0[64];
+    std::atomic<size_t> m_head { 0 };
+    char m_pad1[64];
+    std::atomic<size_t> m_tail { 0 };
+    char m_pad2[64];
+};
@@ -0,0 +1,531 @@
+/* Ether Dream interface library benchmark
+ *
+ * Copyright 2011-2012 Jacob Potter
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or 3, or the GNU Lesser General Public License version 3, as published
+ * by the Free Software Foundation, at your option.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Drive a number of DACs through the public API for a while, and report
+ * what it cost. By default this starts ../emulator/emulator with one
+ * emulated DAC per requested DAC on 127.0.0.2 and up, and stamps the first
+ * point of every frame with the time it was written, so that the emulator
+ * can measure write-to-emit latency; with -x, it uses whatever DACs are on
+ * the network instead, and latency is not measured.
+ *
+ * Results are printed as one line of key=value pairs per DAC, then a
+ * summary line starting with "total".
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "etherdream.h"
+
+#define MAX_DACS	64
+#define EMU_BASE_ID	0xbe0001
+#define FIND_TIMEOUT	3000000
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+struct bench_dac {
+	struct etherdream *d;
+	pthread_t thread;
+	struct etherdream_point *frame;
+	struct etherdream_stats before, after;
+	long frames;
+	long emu_underflows;
+	long latency_p50, latency_p99;
+};
+
+static struct bench_dac dacs[MAX_DACS];
+static int ndacs = 1;
+static int pps = 30000;
+static int frame_points = 600;
+static int emu_capacity = 1800;
+static int emu_drop = 0;
+static int fps = 0;
+static int latest = 0;
+static int spin = 0;
+static int fanout = 0;
+static int mirror = 0;
+static volatile int measuring;
+static volatile int stopping;
+
+/* monotonic_us()
+ *
+ * Return CLOCK_MONOTONIC in microseconds; this is the clock the emulator
+ * measures latency against.
+ */
+static long long monotonic_us(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+}
+
+/* cpu_us()
+ *
+ * Return the CPU time used by this process, in microseconds.
+ */
+static long long cpu_us(void) {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL
+	     + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/* fill_frame(pts, n)
+ *
+ * Fill in a circle of n points.
+ */
+static void fill_frame(struct etherdream_point *pts, int n) {
+	int i;
+	for (i = 0; i < n; i++) {
+		double a = 2 * M_PI * i / n;
+		pts[i].x = sin(a) * 20000;
+		pts[i].y = cos(a) * 20000;
+		pts[i].r = pts[i].g = pts[i].b = pts[i].i = 65535;
+		pts[i].u1 = pts[i].u2 = 0;
+	}
+}
+
+/* writer(arg)
+ *
+ * Thread function: write frames to one DAC as fast as it will take them, or
+ * fps times a second if set, stamping each with the time it was written
+ * while measuring.
+ */
+static void *writer(void *arg) {
+	struct bench_dac *b = arg;
+	struct timespec next;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (!stopping) {
+		if (fps) {
+			next.tv_nsec += 1000000000 / fps;
+			if (next.tv_nsec >= 1000000000) {
+				next.tv_nsec -= 1000000000;
+				next.tv_sec++;
+			}
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+			                NULL);
+		}
+
+		if (etherdream_wait_for_ready(b->d) < 0)
+			break;
+
+		uint32_t now = measuring ? (uint32_t)monotonic_us() : 0;
+		if (measuring && !now)
+			now = 1;
+		b->frame[0].u1 = now >> 16;
+		b->frame[0].u2 = now & 0xFFFF;
+
+		if (etherdream_write(b->d, b->frame, frame_points, pps,
+		                     latest ? -1 : 1) == 0)
+			b->frames++;
+	}
+
+	return NULL;
+}
+
+/* fanout_writer(arg)
+ *
+ * Thread function for -O: convert each frame once and write it to every
+ * DAC with etherdream_write_frame(), pacing as writer() does.
+ */
+static void *fanout_writer(void *arg) {
+	struct etherdream_point *frame = arg;
+	struct timespec next;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (!stopping) {
+		if (fps) {
+			next.tv_nsec += 1000000000 / fps;
+			if (next.tv_nsec >= 1000000000) {
+				next.tv_nsec -= 1000000000;
+				next.tv_sec++;
+			}
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+			                NULL);
+		}
+
+		for (i = 0; i < ndacs; i++)
+			if (etherdream_wait_for_ready(dacs[i].d) < 0)
+				return NULL;
+
+		uint32_t now = measuring ? (uint32_t)monotonic_us() : 0;
+		if (measuring && !now)
+			now = 1;
+		frame[0].u1 = now >> 16;
+		frame[0].u2 = now & 0xFFFF;
+
+		struct etherdream_frame *f =
+			etherdream_frame_create(frame, frame_points);
+		if (!f)
+			break;
+
+		for (i = 0; i < ndacs; i++)
+			if (etherdream_write_frame(dacs[i].d, f, pps,
+			                           latest ? -1 : 1) == 0)
+				dacs[i].frames++;
+		etherdream_frame_release(f);
+	}
+
+	return NULL;
+}
+
+/* start_emulator(path, out)
+ *
+ * Start the emulator with one DAC for each of ours, with its standard
+ * output on a pipe. Returns its pid, or -1 on failure.
+ */
+static pid_t start_emulator(const char *path, FILE **out) {
+	char count[16], id[16], capacity[16], drop[16];
+	int fds[2];
+
+	snprintf(count, sizeof count, "%d", ndacs);
+	snprintf(id, sizeof id, "%x", EMU_BASE_ID);
+	snprintf(capacity, sizeof capacity, "%d", emu_capacity);
+	snprintf(drop, sizeof drop, "%d", emu_drop);
+
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		return -1;
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+
+	if (!pid) {
+		dup2(fds[1], 1);
+		close(fds[0]);
+		close(fds[1]);
+		execl(path, path, "-a", "127.0.0.2", "-n", count,
+		      "-B", "127.0.0.1", "-i", id, "-c", capacity, "-D", drop,
+		      "-L", (char *)NULL);
+		perror(path);
+		_exit(1);
+	}
+
+	close(fds[1]);
+	*out = fdopen(fds[0], "r");
+	return pid;
+}
+
+/* read_emulator_stats(out)
+ *
+ * Read the emulator's final stats, and fill in the underflow and latency
+ * figures for each DAC from them.
+ */
+static void read_emulator_stats(FILE *out) {
+	char line[512];
+
+	while (fgets(line, sizeof line, out)) {
+		unsigned long id;
+		char *p;
+		int i;
+
+		if (sscanf(line, "dac=%lx", &id) != 1)
+			continue;
+
+		for (i = 0; i < ndacs; i++)
+			if (etherdream_get_id(dacs[i].d) == id)
+				break;
+		if (i == ndacs)
+			continue;
+
+		if ((p = strstr(line, "underflows=")))
+			dacs[i].emu_underflows = atol(p + 11);
+		if ((p = strstr(line, "latency_p50=")))
+			dacs[i].latency_p50 = atol(p + 12);
+		if ((p = strstr(line, "latency_p99=")))
+			dacs[i].latency_p99 = atol(p + 12);
+	}
+}
+
+/* hist_mean(before, after)
+ *
+ * Return the mean of the values added to a histogram between two
+ * snapshots of it.
+ */
+static double hist_mean(const struct etherdream_histogram *before,
+                        const struct etherdream_histogram *after) {
+	uint32_t count = after->count - before->count;
+	if (!count)
+		return 0;
+	return (double)(after->sum - before->sum) / count;
+}
+
+/* hist_p99(before, after)
+ *
+ * Return an upper bound on the 99th percentile of the values added to a
+ * histogram between two snapshots of it: the top of the bucket it is in.
+ */
+static long hist_p99(const struct etherdream_histogram *before,
+                     const struct etherdream_histogram *after) {
+	uint32_t count = after->count - before->count, seen = 0;
+	int i;
+
+	for (i = 0; i < ETHERDREAM_HIST_BUCKETS; i++) {
+		seen += after->bucket[i] - before->bucket[i];
+		if (seen >= count - count / 100)
+			return i ? (1L << i) - 1 : 0;
+	}
+	return after->max;
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"Options:\n"
+		"\t-n count    Number of DACs (default: 1)\n"
+		"\t-r pps      Point rate (default: 30000)\n"
+		"\t-f points   Points per frame (default: 600)\n"
+		"\t-t secs     Time to measure for (default: 10)\n"
+		"\t-w secs     Time to run before measuring (default: 2)\n"
+		"\t-R threads  Use the reactor backend with this many threads\n"
+		"\t-l usec     Set a latency target (-1: automatic)\n"
+		"\t-c points   Emulated DAC buffer size (default: 1800)\n"
+		"\t-F fps      Write this many frames a second, rather than\n"
+		"\t            as fast as possible\n"
+		"\t-L          Latest-frame mode\n"
+		"\t-O          Fan out: convert each frame once, and share it\n"
+		"\t            between all DACs from one writer thread\n"
+		"\t-M          Mirror every other DAC's output with a transform\n"
+		"\t-S usec     Spin for the last usec of each sleep\n"
+		"\t-D msecs    Have the emulator drop each connection after\n"
+		"\t            msecs, to exercise reconnection\n"
+		"\t-e path     Emulator to run (default: ../emulator/emulator)\n"
+		"\t-x          Use the DACs on the network; no emulator\n",
+		argv0);
+}
+
+int main(int argc, char **argv) {
+	const char *emulator = "../emulator/emulator";
+	int seconds = 10, warmup = 2, reactor = 0, latency = 0, external = 0;
+	FILE *emu_out = NULL;
+	pid_t emu_pid = -1;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "n:r:f:t:w:R:l:c:F:LOMS:D:e:xh")) != -1) {
+		switch (opt) {
+		case 'n': ndacs = atoi(optarg); break;
+		case 'r': pps = atoi(optarg); break;
+		case 'f': frame_points = atoi(optarg); break;
+		case 't': seconds = atoi(optarg); break;
+		case 'w': warmup = atoi(optarg); break;
+		case 'R': reactor = atoi(optarg); break;
+		case 'l': latency = atoi(optarg); break;
+		case 'c': emu_capacity = atoi(optarg); break;
+		case 'F': fps = atoi(optarg); break;
+		case 'L': latest = 1; break;
+		case 'O': fanout = 1; break;
+		case 'M': mirror = 1; break;
+		case 'S': spin = atoi(optarg); break;
+		case 'D': emu_drop = atoi(optarg); break;
+		case 'e': emulator = optarg; break;
+		case 'x': external = 1; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (ndacs < 1 || ndacs > MAX_DACS || pps < 1 || frame_points < 1
+	    || seconds < 1 || warmup < 0 || fps < 0 || spin < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	etherdream_lib_start();
+	if (reactor && etherdream_reactor_start(reactor) < 0)
+		return 1;
+
+	if (!external) {
+		emu_pid = start_emulator(emulator, &emu_out);
+		if (emu_pid < 0)
+			return 1;
+	}
+
+	/* Wait until every DAC has broadcast. */
+	long long deadline = monotonic_us() + FIND_TIMEOUT;
+	while (1) {
+		int found = 0;
+		for (i = 0; i < ndacs; i++) {
+			dacs[i].d = external ? etherdream_get(i)
+			                     : etherdream_get(EMU_BASE_ID + i);
+			if (dacs[i].d)
+				found++;
+		}
+		if (found == ndacs)
+			break;
+		if (monotonic_us() > deadline) {
+			fprintf(stderr, "only found %d of %d DACs\n", found,
+			        ndacs);
+			goto fail;
+		}
+		usleep(10000);
+	}
+
+	struct etherdream *list[MAX_DACS];
+	int results[MAX_DACS];
+	for (i = 0; i < ndacs; i++)
+		list[i] = dacs[i].d;
+	if (etherdream_connect_many(list, ndacs, results) < ndacs)
+		goto fail;
+
+	for (i = 0; i < ndacs; i++) {
+		struct bench_dac *b = &dacs[i];
+
+		if (latency)
+			etherdream_set_latency(b->d, latency);
+		if (latest)
+			etherdream_set_latest_frame(b->d, 1);
+		if (spin && etherdream_set_spin(b->d, spin) < 0) {
+			fprintf(stderr, "bad spin time\n");
+			goto fail;
+		}
+		if (mirror && (i & 1)) {
+			struct etherdream_transform t = {
+				.scale_x = -1, .scale_y = 1, .intensity = 1
+			};
+			etherdream_set_transform(b->d, &t);
+		}
+
+		b->frame = calloc(frame_points, sizeof *b->frame);
+		if (!b->frame) {
+			perror("calloc");
+			goto fail;
+		}
+		fill_frame(b->frame, frame_points);
+		if (!fanout)
+			pthread_create(&b->thread, NULL, writer, b);
+	}
+
+	pthread_t fanout_thread;
+	if (fanout)
+		pthread_create(&fanout_thread, NULL, fanout_writer,
+		               dacs[0].frame);
+
+	sleep(warmup);
+
+	long long start = monotonic_us(), start_cpu = cpu_us();
+	for (i = 0; i < ndacs; i++)
+		etherdream_get_stats(dacs[i].d, &dacs[i].before);
+	measuring = 1;
+
+	sleep(seconds);
+
+	measuring = 0;
+	long long elapsed = monotonic_us() - start;
+	long long cpu = cpu_us() - start_cpu;
+	for (i = 0; i < ndacs; i++)
+		etherdream_get_stats(dacs[i].d, &dacs[i].after);
+
+	stopping = 1;
+	if (fanout)
+		pthread_join(fanout_thread, NULL);
+	for (i = 0; i < ndacs; i++) {
+		if (!fanout)
+			pthread_join(dacs[i].thread, NULL);
+		etherdream_stop(dacs[i].d);
+		etherdream_disconnect(dacs[i].d);
+	}
+
+	if (emu_pid > 0) {
+		kill(emu_pid, SIGTERM);
+		read_emulator_stats(emu_out);
+		waitpid(emu_pid, NULL, 0);
+	}
+
+	/* Report */
+	double total_syscalls = 0, total_latency = 0;
+	long total_underflows = 0, worst_p50 = 0, worst_p99 = 0;
+
+	for (i = 0; i < ndacs; i++) {
+		struct bench_dac *b = &dacs[i];
+		struct etherdream_stats *s0 = &b->before, *s1 = &b->after;
+		double secs = elapsed / 1000000.0;
+		double syscalls = (s1->syscalls - s0->syscalls) / secs;
+		double buffer_us = hist_mean(&s0->fullness, &s1->fullness)
+		                 * 1000000.0 / pps;
+		long underflows = s1->underflows - s0->underflows;
+
+		if (b->emu_underflows > underflows)
+			underflows = b->emu_underflows;
+
+		printf("dac=%06lx pps=%d frame=%d points_per_sec=%.0f "
+		       "packets_per_sec=%.0f syscalls_per_sec=%.0f "
+		       "underflows=%ld frames_skipped=%u buffer_latency_us=%.0f "
+		       "buffer_target=%u ack_rtt_us=%.0f latency_p50_us=%ld "
+		       "latency_p99_us=%ld reconnects=%u blackout_max_us=%u "
+		       "wake_mean_us=%.1f wake_p99_us=%ld spin_pct=%.2f\n",
+		       etherdream_get_id(b->d), pps, frame_points,
+		       (s1->points_sent - s0->points_sent) / secs,
+		       (s1->packets_sent - s0->packets_sent) / secs,
+		       syscalls, underflows,
+		       s1->frames_skipped - s0->frames_skipped,
+		       buffer_us, s1->buffer_target,
+		       hist_mean(&s0->ack_rtt, &s1->ack_rtt),
+		       b->latency_p50, b->latency_p99,
+		       s1->reconnects - s0->reconnects, s1->blackout.max,
+		       hist_mean(&s0->sleep_overshoot, &s1->sleep_overshoot),
+		       hist_p99(&s0->sleep_overshoot, &s1->sleep_overshoot),
+		       (s1->spin_time - s0->spin_time) * 100.0 / elapsed);
+
+		total_syscalls += syscalls;
+		total_latency += buffer_us;
+		total_underflows += underflows;
+		if (b->latency_p50 > worst_p50)
+			worst_p50 = b->latency_p50;
+		if (b->latency_p99 > worst_p99)
+			worst_p99 = b->latency_p99;
+	}
+
+	printf("total dacs=%d pps=%d frame=%d seconds=%.1f "
+	       "cpu_pct=%.2f cpu_pct_per_dac=%.3f syscalls_per_sec=%.0f "
+	       "underflows=%ld buffer_latency_us=%.0f latency_p50_us=%ld "
+	       "latency_p99_us=%ld\n",
+	       ndacs, pps, frame_points, elapsed / 1000000.0,
+	       100.0 * cpu / elapsed, 100.0 * cpu / elapsed / ndacs,
+	       total_syscalls, total_underflows, total_latency / ndacs,
+	       worst_p50, worst_p99);
+
+	return 0;
+
+fail:
+	if (emu_pid > 0)
+		kill(emu_pid, SIGTERM);
+	return 1;
+}
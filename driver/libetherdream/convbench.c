@@ -0,0 +1,141 @@
+/* Ether Dream interface library point conversion benchmark
+ *
+ * Copyright 2011-2012 Jacob Potter
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or 3, or the GNU Lesser General Public License version 3, as published
+ * by the Free Software Foundation, at your option.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Time etherdream_convert() with each kernel this CPU supports, with and
+ * without a transform, and check that every kernel's output matches the
+ * scalar one's exactly. Results are printed as one line of key=value pairs
+ * per kernel and transform; the exit status is nonzero on a mismatch.
+ */
+
+#define _GNU_SOURCE
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <protocol.h>
+#include "etherdream.h"
+
+static const struct {
+	enum etherdream_convert_kernel kernel;
+	const char *name;
+} kernels[] = {
+	{ ETHERDREAM_CONVERT_SCALAR, "scalar" },
+	{ ETHERDREAM_CONVERT_SSE2, "sse2" },
+	{ ETHERDREAM_CONVERT_AVX2, "avx2" },
+};
+
+#define NKERNELS	(int)(sizeof kernels / sizeof kernels[0])
+
+/* Exercises rounding and saturation in every field. */
+static const struct etherdream_transform xform = {
+	.scale_x = 1.37f, .scale_y = -0.61f,
+	.offset_x = -1234.5f, .offset_y = 20000.25f,
+	.intensity = 1.25f,
+};
+
+static long long monotonic_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"Options:\n"
+		"\t-n points   Points per call (default: 1000)\n"
+		"\t-t msecs    Time to run each case for (default: 500)\n",
+		argv0);
+}
+
+int main(int argc, char **argv) {
+	int npoints = 1000, msecs = 500;
+	int opt, i, k, x, failed = 0;
+
+	while ((opt = getopt(argc, argv, "n:t:h")) != -1) {
+		switch (opt) {
+		case 'n': npoints = atoi(optarg); break;
+		case 't': msecs = atoi(optarg); break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (npoints < 1 || msecs < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	struct etherdream_point *in = calloc(npoints, sizeof *in);
+	struct dac_point *ref = calloc(npoints, sizeof *ref);
+	struct dac_point *out = calloc(npoints, sizeof *out);
+	if (!in || !ref || !out) {
+		perror("calloc");
+		return 1;
+	}
+
+	srand(1);
+	for (i = 0; i < npoints; i++) {
+		uint16_t *f = (uint16_t *)&in[i];
+		for (k = 0; k < 8; k++)
+			f[k] = rand();
+	}
+
+	for (x = 0; x < 2; x++) {
+		const struct etherdream_transform *t = x ? &xform : NULL;
+
+		etherdream_set_convert_kernel(ETHERDREAM_CONVERT_SCALAR);
+		etherdream_convert(ref, in, npoints, t);
+
+		for (k = 0; k < NKERNELS; k++) {
+			if (etherdream_set_convert_kernel(kernels[k].kernel) < 0)
+				continue;
+
+			memset(out, 0xff, npoints * sizeof *out);
+			etherdream_convert(out, in, npoints, t);
+			if (memcmp(out, ref, npoints * sizeof *out)) {
+				fprintf(stderr, "%s: output differs from "
+				        "scalar\n", kernels[k].name);
+				failed = 1;
+			}
+
+			long long start = monotonic_ns(), elapsed;
+			long long deadline = start + msecs * 1000000LL;
+			long calls = 0;
+			do {
+				for (i = 0; i < 64; i++)
+					etherdream_convert(out, in, npoints,
+					                   t);
+				calls += 64;
+				elapsed = monotonic_ns() - start;
+			} while (start + elapsed < deadline);
+
+			printf("kernel=%s transform=%d points=%d "
+			       "mpoints_per_sec=%.1f ns_per_point=%.3f\n",
+			       kernels[k].name, x, npoints,
+			       (double)calls * npoints * 1000.0 / elapsed,
+			       (double)elapsed / calls / npoints);
+		}
+	}
+
+	return failed;
+}
@@ -16,11 +16,12 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#define _POSIX_C_SOURCE 199309L
+#define _POSIX_C_SOURCE 200112L
 #define _DARWIN_C_SOURCE 1
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <math.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <stdarg.h>
@@ -28,10 +29,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #ifdef __MACH__
@@ -39,43 +42,202 @@
 #include <mach/mach_time.h>
 #endif
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/timerfd.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
 #include <protocol.h>
 #include "etherdream.h"
 
 #define BUFFER_POINTS_PER_FRAME 16000
 #define BUFFER_NFRAMES          2
+#define RING_MIN_POINTS		32768
+#define RING_TIME		300000
+#define RING_FRAMES		64
+#define RING_FRAME_MASK		(RING_FRAMES - 1)
+#define CACHE_LINE		64
 #define MAX_LATE_ACKS		64
-#define MIN_SEND_POINTS		40
+#define BATCH_INTERVAL		4000
+#define CALLBACK_MAX_POINTS	2000
+#define SHARED_XFORM_POINTS	1024
+
+/* The read ring holds a whole number of responses, so that as long as the
+ * DAC's responses keep coming whole, none of them straddles the wrap. */
+#define READ_RING_SIZE		(64 * (int)sizeof(struct dac_response))
 #define DEFAULT_TIMEOUT		2000000
-#define DEBUG_THRESHOLD_POINTS	800
+
+/* Buffer sizing. Rather than assuming the original hardware's 1800-point
+ * buffer, targets and batch sizes are fractions of whatever capacity the
+ * DAC advertises in its broadcasts: we keep an eighteenth of it free (1700
+ * of 1800 points), and send no less than a forty-fifth (40 points) at a
+ * time. DACs we haven't heard from are assumed to be the original.
+ */
+#define DEFAULT_BUFFER_POINTS	1800
+#define DEFAULT_MAX_POINT_RATE	100000
+#define BUFFER_HEADROOM_DIV	18
+#define MIN_SEND_DIV		45
+
+/* Automatic latency. Once a second of playing without trouble, the target
+ * drops by AUTOTUNE_STEP, but never below the ACK round trip plus
+ * JITTER_MARGIN times its mean deviation. Each underflow while there was
+ * more to play raises it by AUTOTUNE_BACKOFF, and from then on it only
+ * comes back down to one step above the target that failed.
+ */
+#define AUTOTUNE_INTERVAL	1000000
+#define AUTOTUNE_STEP		0.9
+#define AUTOTUNE_BACKOFF	1.5
+#define JITTER_MARGIN		4
+
+/* Reconnection. When a connection fails, the sender keeps trying to get it
+ * back for RECONNECT_WINDOW, waiting between attempts from
+ * RECONNECT_MIN_BACKOFF, doubling up to RECONNECT_MAX_BACKOFF.
+ */
+#define RECONNECT_WINDOW	10000000
+#define RECONNECT_MIN_BACKOFF	5000
+#define RECONNECT_MAX_BACKOFF	500000
+#define RECONNECT_POLL		20000
+
+/* The longest etherdream_set_spin() allows, and the timer slack asked for
+ * on the sending threads, in nanoseconds. */
+#define SPIN_MAX		1000
+#define SENDER_TIMER_SLACK	1000
+
+#define TRACE_EVENTS		4096
+#define TRACE_MASK		(TRACE_EVENTS - 1)
+
+/* Bits in dac_status.playback_flags; see firmware/inc/dac.h. */
+#define STATUS_FLAG_UNDERFLOW	(1 << 1)
+#define STATUS_FLAG_ESTOP	(1 << 2)
+
+/* Estimate of the DAC's point clock. The DAC's crystal and ours drift apart,
+ * and ACKs arrive with network jitter, so rather than extrapolating from the
+ * last ACK at the nominal rate, we run an alpha-beta filter (a simple
+ * second-order PLL) over the point_count in every status: "count" tracks how
+ * many points the DAC has played, and "rate" how fast it is really playing
+ * them, in points per microsecond.
+ */
+struct dac_clock {
+	int valid;
+	uint32_t nominal_pps;
+	uint32_t last_raw;
+	long long measured;
+	long long ref_time;
+	double count;
+	double rate;
+};
+
+#define CLOCK_ALPHA		0.125
+#define CLOCK_BETA		0.004
+#define CLOCK_MIN_INTERVAL	1000
+#define CLOCK_MAX_DRIFT		0.01
+
+/* Steps in the connection handshake; see dac_connect_step(). */
+enum conn_step {
+	CS_CONNECTING,
+	CS_HELLO,
+	CS_PREPARE,
+	CS_VERSION,
+	CS_DONE
+};
 
 struct etherdream_conn {
 	int dc_sock;
-	char dc_read_buf[1024];
-	int dc_read_buf_size;
+	enum conn_step dc_step;
+	long long dc_connect_deadline;
+	/* Bytes from the DAC not yet handled: a ring of dc_read_fill bytes
+	 * starting at dc_read_pos. */
+	char dc_read_buf[READ_RING_SIZE];
+	int dc_read_pos;
+	int dc_read_fill;
 	struct dac_response resp;
 	long long dc_last_ack_time;
+	struct dac_clock dc_clock;
+
+	/* Smoothed data ACK round trip time and its mean deviation, in
+	 * microseconds, as TCP keeps them. */
+	double dc_rtt_avg;
+	double dc_rtt_dev;
+
+	/* Set when a status reports a new underflow, for dac_service(). */
+	int dc_underflowed;
 
 	struct {
 		struct queue_command queue;
 		struct data_command_header header;
-		struct dac_point data[1000];
-	} __attribute__((packed)) dc_local_buffer;
+		struct dac_point first;
+	} __attribute__((packed)) dc_send_header;
 
+	int dc_prepare_sent;
 	int dc_begin_sent;
+
+	/* The rate the DAC will be playing at once it reaches the last point
+	 * we sent, and the rate of the first point since the last prepare,
+	 * which begin should ask for; 0 if nothing has been sent yet. */
+	int dc_rate;
+	int dc_begin_rate;
+	long long dc_ack_deadline;
 	int ackbuf[MAX_LATE_ACKS];
+	long long ackbuf_time[MAX_LATE_ACKS];
 	int ackbuf_prod;
 	int ackbuf_cons;
 	int unacked_points;
 	int pending_meta_acks;
 };
 
-struct buffer_item {
-	struct dac_point data[BUFFER_POINTS_PER_FRAME];
+/* The point ring is a single-producer, single-consumer queue of wire-format
+ * points, shared between the application thread and dac_loop(). Positions
+ * are free-running counters; only the low bits index into points[]. Frames
+ * are a thin layer on top: each committed run of points gets a descriptor
+ * in frames[], which dac_loop() walks in order, replaying a frame as many
+ * times as its repeatcount asks before releasing its points.
+ *
+ * A frame from etherdream_write_frame() takes no room in points[]: its
+ * descriptor holds a reference to the shared frame instead, along with the
+ * transform to apply to it on the way out, copied when it was queued.
+ */
+struct ring_frame {
+	unsigned int start;
 	int points;
 	int pps;
 	int repeatcount;
+	struct etherdream_frame *shared;
+	struct etherdream_transform transform;
+	int transform_set;
+};
+
+/* A frame converted to wire format once, to be queued on any number of
+ * DACs. It is freed when the last reference to it is dropped. */
+struct etherdream_frame {
+	int refs;
+	int npoints;
+	struct dac_point points[];
+};
+
+struct etherdream_ring {
+	struct dac_point *points;
+	unsigned int mask;
+	struct ring_frame frames[RING_FRAMES];
+
+	/* Written only by the producer */
+	unsigned int head;
+	unsigned int reserved;
+	unsigned int frame_head;
+	char pad[CACHE_LINE];
+
+	/* Written only by dac_loop() */
+	unsigned int tail;
+	unsigned int frame_tail;
+	int cur_valid;
 	int idx;
+	int repeat_left;
 };
 
 enum dac_state {
@@ -86,17 +248,93 @@ enum dac_state {
 	ST_SHUTDOWN
 };
 
+/* Telemetry. Everything here is written only by whichever thread is
+ * servicing the DAC, so updates are plain stores bracketed by a sequence
+ * count; etherdream_get_stats() retries its copy until it sees the same
+ * even count on both sides.
+ */
+struct dac_stats {
+	unsigned int seq;
+	struct etherdream_stats s;
+	long long window_start;
+	uint64_t window_points;
+	uint64_t window_bytes;
+};
+
+/* Event trace. Rather than formatting text as things happen, the send path
+ * records fixed-size binary events into a per-DAC ring, which is decoded
+ * only when someone asks for it. Writers claim a slot with an atomic
+ * increment, so recording never waits, even when the application thread
+ * and the sender record at once; each slot's seq is zeroed while it is
+ * being written and set to its index + 1 when done, so readers can tell
+ * torn or overwritten slots.
+ */
+struct trace_ring {
+	unsigned int head;
+	char pad[CACHE_LINE - sizeof(unsigned int)];
+	struct etherdream_trace_event *ev;
+};
+
 struct etherdream {
 	pthread_mutex_t mutex;
 	pthread_cond_t loop_cond;
 
-	struct buffer_item buffer[BUFFER_NFRAMES];
-	int frame_buffer_read;
-	int frame_buffer_fullness;
-	int bounce_count;
+	struct etherdream_ring ring;
+	int waiters;
+	int stop_requested;
+
+	int latency_target;
+	int latest_frame;
+
+	/* Frames that etherdream_write() took back in latest-frame mode;
+	 * the sender adds them to its stats. */
+	unsigned int reclaimed;
+
+	/* Limits derived from the DAC's advertised capabilities; see
+	 * dac_size_buffers(). */
+	int buffer_max;
+	int min_send;
+
+	/* State for ETHERDREAM_LATENCY_AUTO: the current target in
+	 * microseconds (0 until playback starts), the lowest it may go after
+	 * an underflow, and when to next lower it. */
+	int auto_latency;
+	int auto_min;
+	long long auto_next;
+
+	struct etherdream_group *group;
+	int group_slot;
+	int group_primed;
+	int group_reseed;
+	double group_offset;
+	double rate_trim;
+
+	etherdream_callback callback;
+	etherdream_source source;
+	void *callback_user;
+	int callback_pps;
+	struct etherdream_point *callback_buf;
+
+	struct etherdream_transform transform;
+	int transform_set;
+
+	/* Where shared frames with a transform are staged on their way out,
+	 * SHARED_XFORM_POINTS at a time. */
+	struct dac_point *shared_buf;
 
 	pthread_t workerthread;
-	
+	struct etherdream_reactor *reactor;
+	int reactor_attached;
+	int timer_fd;
+	long long timer_deadline;
+
+	/* How long before each timed wakeup to start spinning, in
+	 * microseconds; see etherdream_set_spin(). */
+	int spin_usec;
+
+	struct dac_stats stats;
+	struct trace_ring trace;
+
 	struct in_addr addr;
 	struct etherdream_conn conn;
 	unsigned long dac_id;
@@ -106,7 +344,24 @@ struct etherdream {
 
 	enum dac_state state;
 
-	struct etherdream * next;
+	/* Reconnection state; see dac_lost(). dry_time is when the DAC is
+	 * expected to have run out of points after the connection was lost,
+	 * or 0 if there's no blackout to measure. */
+	int reconnect_window;
+	int reconnecting;
+	long long reconnect_deadline;
+	long long retry_at;
+	int retry_backoff;
+	long long outage_start;
+	long long dry_time;
+
+	/* Registry. last_seen is 0 for DACs added by etherdream_add(), which
+	 * don't broadcast and never expire. pinned is set once the
+	 * application has been given d, after which it is never freed. */
+	struct etherdream *hash_next;
+	long long last_seen;
+	int pinned;
+	struct dac_broadcast broadcast;
 };
 
 static FILE *trace_fp = NULL;
@@ -115,12 +370,23 @@ static long long timer_start, timer_freq_numer, timer_freq_denom;
 #else
 static struct timespec start_time;
 #endif
+/* The registry of known DACs: dac_index holds them in the order they were
+ * found, for etherdream_get() by index, and dac_hash chains them by ID.
+ * A DAC that is forgotten leaves a NULL behind in dac_index, so that the
+ * others keep their indices. Both are protected by dac_list_lock.
+ */
+#define DAC_HASH_SIZE		256
+#define DAC_EXPIRY_TIME		10000000
+
 static pthread_mutex_t dac_list_lock;
-static struct etherdream *dac_list = NULL;
+static struct etherdream *dac_hash[DAC_HASH_SIZE];
+static struct etherdream **dac_index;
+static int dac_index_len, dac_index_cap;
 
 /* microseconds()
  *
- * Return the number of microseconds since library initialization.
+ * Return the number of microseconds since library initialization, on a
+ * monotonic clock, so that the time can't step under the sender's feet.
  */
 static long long microseconds(void) {
 #if __MACH__
@@ -128,21 +394,34 @@ static long long microseconds(void) {
 	return time_diff * timer_freq_numer / timer_freq_denom;
 #else
 	struct timespec t;
-	clock_gettime(CLOCK_REALTIME, &t);
+	clock_gettime(CLOCK_MONOTONIC, &t);
 	return (t.tv_sec - start_time.tv_sec) * 1000000 +
 	       (t.tv_nsec - start_time.tv_nsec) / 1000;
 #endif
 }
 
-/* microsleep(us)
+#ifndef __MACH__
+/* monotonic_at(usec, t)
  *
- * Like usleep().
+ * Convert usec, a microseconds() time, to an absolute CLOCK_MONOTONIC time,
+ * for sleeping until.
  */
-static void microsleep(long long us) {
-	struct timespec t;
-	t.tv_sec = us / 1000000;
-	t.tv_nsec = (us % 1000000) * 1000;
-	nanosleep(&t, NULL);
+static void monotonic_at(long long usec, struct timespec *t) {
+	long long ns = start_time.tv_nsec + (usec % 1000000) * 1000;
+	t->tv_sec = start_time.tv_sec + usec / 1000000 + ns / 1000000000;
+	t->tv_nsec = ns % 1000000000;
+}
+#endif
+
+/* sender_thread_init()
+ *
+ * Called at the start of each sending thread: ask for timers that fire on
+ * time rather than up to 50us late, as Linux allows itself by default.
+ */
+static void sender_thread_init(void) {
+#ifdef __linux__
+	prctl(PR_SET_TIMERSLACK, SENDER_TIMER_SLACK, 0, 0, 0);
+#endif
 }
 
 /* trace(d, fmt, ...)
@@ -173,6 +452,28 @@ static void trace(struct etherdream *d, const char *fmt, ...) {
 	fputs(buf, trace_fp);
 }
 
+/* tev(d, id, a, b, c, e)
+ *
+ * Record an event in d's trace ring.
+ */
+static void tev(struct etherdream *d, int id, int a, int b, int c, int e) {
+	if (!d->trace.ev)
+		return;
+
+	unsigned int n = __atomic_fetch_add(&d->trace.head, 1, __ATOMIC_RELAXED);
+	struct etherdream_trace_event *ev = &d->trace.ev[n & TRACE_MASK];
+
+	__atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	ev->time = microseconds();
+	ev->id = id;
+	ev->arg[0] = a;
+	ev->arg[1] = b;
+	ev->arg[2] = c;
+	ev->arg[3] = e;
+	__atomic_store_n(&ev->seq, n + 1, __ATOMIC_RELEASE);
+}
+
 /* log_socket_error(d, call)
  *
  * Log an error in a socket call.
@@ -182,6 +483,49 @@ static void log_socket_error(struct etherdream *d, const char *call) {
 		call, errno, strerror(errno));
 }
 
+/* stats_begin(d), stats_end(d)
+ *
+ * Bracket an update to d's stats.
+ */
+static void stats_begin(struct etherdream *d) {
+	__atomic_store_n(&d->stats.seq, d->stats.seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void stats_end(struct etherdream *d) {
+	__atomic_store_n(&d->stats.seq, d->stats.seq + 1, __ATOMIC_RELEASE);
+}
+
+/* stats_syscall(d)
+ *
+ * Count a system call made on d's behalf.
+ */
+static void stats_syscall(struct etherdream *d) {
+	stats_begin(d);
+	d->stats.s.syscalls++;
+	stats_end(d);
+}
+
+/* spin_until(d, deadline)
+ *
+ * The busy-wait tail of a sleep: burn the last few microseconds before
+ * deadline on the CPU, rather than trusting the scheduler with them.
+ */
+static void spin_until(struct etherdream *d, long long deadline) {
+	long long start = microseconds(), now = start;
+
+	while (now < deadline) {
+#ifdef HAVE_X86_SIMD
+		_mm_pause();
+#endif
+		now = microseconds();
+	}
+
+	stats_begin(d);
+	d->stats.s.spin_time += now - start;
+	stats_end(d);
+}
+
 /* wait_for_fd_activity(d, usec, writable)
  *
  * Wait for activity (if writable is 0, then readable or error; if writable
@@ -195,6 +539,7 @@ static int wait_for_fd_activity(struct etherdream *d, int usec, int writable) {
 	struct timeval t;
 	t.tv_sec = usec / 1000000;
 	t.tv_usec = usec % 1000000;
+	stats_syscall(d);
 	int res = select(d->conn.dc_sock + 1, (writable ? NULL : &set),
 		(writable ? &set : NULL), &set, &t);
 	if (res < 0)
@@ -203,84 +548,160 @@ static int wait_for_fd_activity(struct etherdream *d, int usec, int writable) {
 	return res;
 }
 
-/* read_bytes(d, buf, len)
+/* read_fill(d, max)
  *
- * Read exactly len bytes from d's connection socket into buf. Returns 0 on
- * success, -1 on error (will also log error).
- */ 
-static int read_bytes(struct etherdream *d, char *buf, int len) {
-	while (d->conn.dc_read_buf_size < len) {
-		int res = wait_for_fd_activity(d, DEFAULT_TIMEOUT, 0);
-		if (res < 0)
-			return res;
-		if (res == 0) {
-			trace(d, "!! Read from DAC timed out.\n");
-			return -1;
-		}
+ * Read up to max bytes, as many as have arrived and will fit, from d's
+ * socket into its read ring, in one call however the free space wraps.
+ * Returns the number of bytes read, 0 if there were none, or -1 on error
+ * (will also log error).
+ */
+static int read_fill(struct etherdream *d, int max) {
+	struct etherdream_conn *conn = &d->conn;
+	int space = READ_RING_SIZE - conn->dc_read_fill;
+	int end = (conn->dc_read_pos + conn->dc_read_fill) % READ_RING_SIZE;
+	struct iovec iov[2];
+	struct msghdr msg;
+
+	if (max > space)
+		max = space;
+	if (max <= 0)
+		return 0;
 
-		res = recv(d->conn.dc_sock,
-		           d->conn.dc_read_buf + d->conn.dc_read_buf_size,
-		           len - d->conn.dc_read_buf_size, 0);
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 1;
+	iov[0].iov_base = conn->dc_read_buf + end;
+	iov[0].iov_len = max;
+	if (end + max > READ_RING_SIZE) {
+		iov[0].iov_len = READ_RING_SIZE - end;
+		iov[1].iov_base = conn->dc_read_buf;
+		iov[1].iov_len = max - iov[0].iov_len;
+		msg.msg_iovlen = 2;
+	}
 
-		if (res <= 0) {
-			log_socket_error(d, "recv");
-			return -1;
-		}
+	stats_syscall(d);
+	int res = recvmsg(conn->dc_sock, &msg, MSG_DONTWAIT);
 
-		d->conn.dc_read_buf_size += res;
+	if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	if (res < 0) {
+		log_socket_error(d, "recv");
+		return -1;
+	}
+	if (res == 0) {
+		trace(d, "!! Connection closed by DAC.\n");
+		return -1;
 	}
 
-	memcpy(buf, d->conn.dc_read_buf, len);
-	if (d->conn.dc_read_buf_size > len) {
-		printf("moving %d up by %d\n", d->conn.dc_read_buf_size, len);
-		memmove(d->conn.dc_read_buf, d->conn.dc_read_buf + len,
-		        d->conn.dc_read_buf_size - len);
+	conn->dc_read_fill += res;
+	return res;
+}
+
+/* read_consume(d, len)
+ *
+ * Drop the first len bytes of d's read ring. Once the ring is empty, start
+ * it again from the beginning, which keeps responses from straddling the
+ * wrap (see READ_RING_SIZE).
+ */
+static void read_consume(struct etherdream *d, int len) {
+	struct etherdream_conn *conn = &d->conn;
+
+	conn->dc_read_fill -= len;
+	conn->dc_read_pos = (conn->dc_read_pos + len) % READ_RING_SIZE;
+	if (!conn->dc_read_fill)
+		conn->dc_read_pos = 0;
+}
+
+/* read_bytes(d, buf, len)
+ *
+ * Read exactly len bytes from d's connection socket into buf, if that many
+ * have arrived, without blocking. This never reads past len bytes, so that
+ * the handshake leaves the ring empty. Returns 1 if they were read, 0 if
+ * not all of them are here yet, -1 on error (will also log error).
+ */
+static int read_bytes(struct etherdream *d, char *buf, int len) {
+	struct etherdream_conn *conn = &d->conn;
+
+	if (conn->dc_read_fill < len) {
+		if (read_fill(d, len - conn->dc_read_fill) < 0)
+			return -1;
+		if (conn->dc_read_fill < len)
+			return 0;
 	}
-	d->conn.dc_read_buf_size -= len;
 
-	return 0;
+	int first = READ_RING_SIZE - conn->dc_read_pos;
+	if (first > len)
+		first = len;
+	memcpy(buf, conn->dc_read_buf + conn->dc_read_pos, first);
+	memcpy(buf + first, conn->dc_read_buf, len - first);
+	read_consume(d, len);
+
+	return 1;
 }
 
-/* send_all(d, data, len)
+/* send_iov(d, iov, iovcnt)
  *
- * Send all of data to d's socket. Returns 0 on success, -1 on error or if the
+ * Send all of the buffers in iov to d's socket, in a single writev() if
+ * possible. iov is modified. Returns 0 on success, -1 on error or if the
  * send times out (will also log error).
  */
-static int send_all(struct etherdream *d, const char *data, int len) {
-	do {
-		int res = wait_for_fd_activity(d, 100000, 1);
-		if (res < 0)
-			return -1;
-		if (res == 0) {
-			trace(d, "write timed out\n");
+static int send_iov(struct etherdream *d, struct iovec *iov, int iovcnt) {
+	while (iovcnt) {
+		stats_syscall(d);
+		ssize_t res = writev(d->conn.dc_sock, iov, iovcnt);
+
+		if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			/* Only wait if the socket buffer is full. */
+			int wres = wait_for_fd_activity(d, 100000, 1);
+			if (wres < 0)
+				return -1;
+			if (wres == 0) {
+				trace(d, "write timed out\n");
+				return -1;
+			}
+			continue;
 		}
 
-		res = send(d->conn.dc_sock, data, len, 0);
-
 		if (res < 0) {
-			log_socket_error(d, "send");
+			log_socket_error(d, "writev");
 			return -1;
 		}
 
-		len -= res;
-		data += res;
-	} while (len);
+		/* Skip past whatever made it out. */
+		while (iovcnt && (size_t)res >= iov->iov_len) {
+			res -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + res;
+			iov->iov_len -= res;
+		}
+	}
 
 	return 0;
 }
 
+/* send_all(d, data, len)
+ *
+ * Send all of data to d's socket. Returns 0 on success, -1 on error or if the
+ * send times out (will also log error).
+ */
+static int send_all(struct etherdream *d, const char *data, int len) {
+	struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+	return send_iov(d, &iov, 1);
+}
+
 /* read_resp(d)
  *
- * Read a response from the DAC into d's conn.resp buffer. Returns 0 on
- * success, -1 on error (in which case the error will have been logged).
+ * Read a response from the DAC into d's conn.resp buffer, if one has
+ * arrived. Returns as read_bytes().
  */
 static int read_resp(struct etherdream *d) {
 	int res = read_bytes(d, (char *)&d->conn.resp, sizeof(d->conn.resp));
-	if (res < 0)
-		return res;
-
-	d->conn.dc_last_ack_time = microseconds();
-	return 0;
+	if (res > 0)
+		d->conn.dc_last_ack_time = microseconds();
+	return res;
 }
 
 /* dump_resp(d)
@@ -300,12 +721,13 @@ static void dump_resp(struct etherdream *d) {
 		st->buffer_fullness, st->point_rate, st->point_count);
 }
 
-/* dac_connect(d, host, port)
+/* dac_connect_start(d)
  *
- * Initialize a dac's connection struct and open up a socket. On success,
- * return 0; otherwise, return -1.
+ * Initialize d's connection struct, open up a socket, and start connecting
+ * without waiting for the connection to go through; dac_connect_step()
+ * does the rest. On success, return 0; otherwise, return -1.
  */
-static int dac_connect(struct etherdream *d) {
+static int dac_connect_start(struct etherdream *d) {
 	struct etherdream_conn *conn = &d->conn;
 	memset(conn, 0, sizeof *conn);
 
@@ -324,26 +746,36 @@ static int dac_connect(struct etherdream *d) {
 		.sin_addr.s_addr = d->addr.s_addr, .sin_port = htons(7765)
 	};
 
-	// Because the socket is nonblocking, this will always error...
-	connect(conn->dc_sock, (struct sockaddr *)&addr, (int)sizeof addr);
-	if (errno != EINPROGRESS) {
+	// Because the socket is nonblocking, this will almost always error...
+	if (connect(conn->dc_sock, (struct sockaddr *)&addr, (int)sizeof addr) < 0
+	    && errno != EINPROGRESS) {
 		log_socket_error(d, "connect");
-		goto bail;
+		close(conn->dc_sock);
+		conn->dc_sock = -1;
+		return -1;
 	}
 
-	// Wait for connection to go through
-	{
-		int res = wait_for_fd_activity(d, DEFAULT_TIMEOUT, 1);
-		if (res < 0)
-			goto bail;
-		if (res == 0) {
-			trace(d, "Connection to %s timed out.\n", inet_ntoa(d->addr));
-			goto bail;
-		}
-	}
+	conn->dc_step = CS_CONNECTING;
+	conn->dc_connect_deadline = microseconds() + DEFAULT_TIMEOUT;
+	return 0;
+}
+
+/* dac_connect_step(d)
+ *
+ * Move d's connection handshake along as far as it will go without
+ * blocking: once the TCP connection is up, read the DAC's initial status,
+ * send prepare and read its response, then ask for the firmware version.
+ * Call this whenever d's socket is ready for whatever dac_connect_events()
+ * asks for. Returns 1 when the handshake is done, 0 if it needs to wait
+ * again, or -1 on error, in which case the socket has been closed.
+ */
+static int dac_connect_step(struct etherdream *d) {
+	struct etherdream_conn *conn = &d->conn;
+	int res;
 
-	// See if we have *actually* connected
-	{
+	switch (conn->dc_step) {
+	case CS_CONNECTING: {
+		// See if we have *actually* connected
 		int error;
 		unsigned int len = sizeof error;
 		if (getsockopt(conn->dc_sock, SOL_SOCKET, SO_ERROR, (char *)&error,
@@ -357,60 +789,195 @@ static int dac_connect(struct etherdream *d) {
 			log_socket_error(d, "connect");
 			goto bail;
 		}
-	}
 
-	{
 		int ndelay = 1;
 		if (setsockopt(conn->dc_sock, IPPROTO_TCP, TCP_NODELAY,
 		                                (char *)&ndelay, sizeof(ndelay)) < 0) {
 			log_socket_error(d, "setsockopt TCP_NODELAY");
 			goto bail;
 		}
-	}
-
-	// After we connect, the DAC will send an initial status response
-	if (read_resp(d) < 0)
-		goto bail;
 
-    {
-	    char c = 'p';
-	    send_all(d, &c, 1);
-    }
+		conn->dc_step = CS_HELLO;
+	}
+	/* fall through */
 
-	if (read_resp(d) < 0)
-		goto bail;
-	dump_resp(d);
+	case CS_HELLO: {
+		// After we connect, the DAC will send an initial status response
+		if ((res = read_resp(d)) <= 0)
+			goto wait;
 
-	if (d->sw_revision >= 2) {
-		char c = 'v';
+		char c = 'p';
 		if (send_all(d, &c, 1) < 0)
 			goto bail;
-		int res = read_bytes(d, d->version, sizeof(d->version));
-		if (res < 0)
-			return res;
-	} else {
-		strcpy(d->version, "[old]");
+		conn->dc_step = CS_PREPARE;
 	}
+	/* fall through */
 
-	trace(d, "DAC version %.*s\n", sizeof(d->version), d->version);
-	return 0;
+	case CS_PREPARE:
+		if ((res = read_resp(d)) <= 0)
+			goto wait;
+		dump_resp(d);
+
+		/* When reconnecting, we already know the version. */
+		if (d->reconnecting)
+			break;
+
+		if (d->sw_revision < 2) {
+			strcpy(d->version, "[old]");
+			break;
+		}
+
+		{
+			char c = 'v';
+			if (send_all(d, &c, 1) < 0)
+				goto bail;
+		}
+		conn->dc_step = CS_VERSION;
+		/* fall through */
+
+	case CS_VERSION:
+		if ((res = read_bytes(d, d->version, sizeof(d->version))) <= 0)
+			goto wait;
+		break;
+
+	case CS_DONE:
+		return 1;
+	}
+
+	conn->dc_step = CS_DONE;
+	trace(d, "DAC version %.*s\n", (int)sizeof(d->version), d->version);
+	return 1;
+
+wait:
+	if (res == 0)
+		return 0;
 
 bail:
-	close(d->conn.dc_sock);
+	close(conn->dc_sock);
+	conn->dc_sock = -1;
 	return -1;
 }
 
-/* check_data_response(d)
+/* dac_connect_events(d)
+ *
+ * Return the poll() events that d's connection handshake is waiting for.
+ */
+static short dac_connect_events(struct etherdream *d) {
+	return d->conn.dc_step == CS_CONNECTING ? POLLOUT : POLLIN;
+}
+
+/* hist_add(h, v)
+ *
+ * Record v in h. Bucket 0 counts zero (and negative) values; bucket i
+ * counts values from 2^(i-1) up to 2^i - 1, and the last bucket counts
+ * everything above that.
+ */
+static void hist_add(struct etherdream_histogram *h, long long v) {
+	int b = 0;
+
+	if (v > 0xFFFFFFFFLL)
+		v = 0xFFFFFFFFLL;
+	if (v > 0)
+		b = 32 - __builtin_clz((uint32_t)v);
+	if (b >= ETHERDREAM_HIST_BUCKETS)
+		b = ETHERDREAM_HIST_BUCKETS - 1;
+	if (v < 0)
+		v = 0;
+
+	h->bucket[b]++;
+	h->count++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+}
+
+/* stats_status(d, st)
+ *
+ * Note a status from d, counting underflows and e-stops as their flags
+ * come on.
+ */
+static void stats_status(struct etherdream *d, const struct dac_status *st) {
+	struct etherdream_stats *s = &d->stats.s;
+	int rising = st->playback_flags & ~s->playback_flags;
+
+	s->acks_received++;
+	if (rising & STATUS_FLAG_UNDERFLOW)
+		s->underflows++;
+	if ((rising & STATUS_FLAG_ESTOP)
+	    || (st->light_engine_flags && !s->light_engine_flags))
+		s->estops++;
+	s->playback_flags = st->playback_flags;
+	s->light_engine_flags = st->light_engine_flags;
+}
+
+/* stats_sent(d, npoints, bytes, now)
+ *
+ * Note that a batch of npoints points, bytes long on the wire, was sent.
+ */
+static void stats_sent(struct etherdream *d, int npoints, int bytes,
+                       long long now) {
+	struct dac_stats *ds = &d->stats;
+	long long elapsed = now - ds->window_start;
+
+	ds->s.points_sent += npoints;
+	ds->s.bytes_sent += bytes;
+	ds->s.packets_sent++;
+	ds->window_points += npoints;
+	ds->window_bytes += bytes;
+
+	if (elapsed >= 1000000) {
+		if (elapsed < 2000000) {
+			ds->s.points_per_sec = ds->window_points * 1000000
+			                     / elapsed;
+			ds->s.bytes_per_sec = ds->window_bytes * 1000000
+			                    / elapsed;
+		} else {
+			/* We were idle for a while; start afresh. */
+			ds->s.points_per_sec = ds->s.bytes_per_sec = 0;
+		}
+		ds->window_start = now;
+		ds->window_points = ds->window_bytes = 0;
+	}
+}
+
+/* check_data_response(d, resp, now)
  *
- * Handle a response from d: update our record of the number of sent-but-not-
- * ACKed points, and error if the response was unexpected.
+ * Handle resp from d, received at time now: update our record of the
+ * number of sent-but-not-ACKed points, and error if the response was
+ * unexpected.
  */
-static int check_data_response(struct etherdream *d) {
+static int check_data_response(struct etherdream *d,
+                               const struct dac_response *resp,
+                               long long now) {
 	struct etherdream_conn *conn = &d->conn;
-	if (conn->resp.dac_status.playback_state == 0)
+	if (resp->dac_status.playback_state == 0)
 		conn->dc_begin_sent = 0;
 
-	if (conn->resp.command == 'd') {
+	if (resp->dac_status.playback_flags & ~d->stats.s.playback_flags
+	    & STATUS_FLAG_UNDERFLOW)
+		conn->dc_underflowed = 1;
+
+	long long rtt = -1;
+	if (resp->command == 'd' && conn->ackbuf_prod != conn->ackbuf_cons)
+		rtt = now - conn->ackbuf_time[conn->ackbuf_cons];
+
+	stats_begin(d);
+	stats_status(d, &resp->dac_status);
+	if (rtt >= 0)
+		hist_add(&d->stats.s.ack_rtt, rtt);
+	stats_end(d);
+
+	if (rtt >= 0 && conn->dc_rtt_avg == 0) {
+		conn->dc_rtt_avg = rtt;
+		conn->dc_rtt_dev = rtt / 2;
+	} else if (rtt >= 0) {
+		double err = rtt - conn->dc_rtt_avg;
+		conn->dc_rtt_avg += err / 8;
+		conn->dc_rtt_dev += ((err < 0 ? -err : err)
+		                  - conn->dc_rtt_dev) / 4;
+	}
+
+	if (resp->command == 'd') {
 		if (conn->ackbuf_prod == conn->ackbuf_cons) {
 			trace(d, "!! protocol error: unexpected data ack\n");
 			return -1;
@@ -418,298 +985,2684 @@ static int check_data_response(struct etherdream *d) {
 		conn->unacked_points -= conn->ackbuf[conn->ackbuf_cons];
 		conn->ackbuf_cons = (conn->ackbuf_cons + 1) % MAX_LATE_ACKS;
 	} else {
+		if (resp->command == 'p') {
+			tev(d, ETHERDREAM_EV_PREPARE_ACK, 0, 0, 0, 0);
+			conn->dc_prepare_sent = 0;
+		}
 		conn->pending_meta_acks--;
 	}
 
-	if (conn->resp.response != 'a' && conn->resp.response != 'I') {
+	if (resp->response != 'a' && resp->response != 'I') {
 		trace(d, "!! protocol error: ACK for '%c' got '%c' (%d)\n",
-			conn->resp.command,
-			conn->resp.response, conn->resp.response);
+			resp->command,
+			resp->response, resp->response);
 		return -1;
 	}
 
 	return 0;
 }
 
-/* dac_get_acks(d, wait)
+/* dac_acks_owed(d)
  *
- * Read any ACKs we are owed, waiting up to 'wait' microseconds.
+ * Return nonzero if d has sent commands that have not been ACKed yet.
  */
-static int dac_get_acks(struct etherdream *d, int wait) {
-	while (d->conn.pending_meta_acks
-	       || (d->conn.ackbuf_prod != d->conn.ackbuf_cons)) {
-		int res = wait_for_fd_activity(d, wait, 0);
-		if (res <= 0)
-			return res;
-		if ((res = read_resp(d)) < 0)
-			return res;
-		if ((res = check_data_response(d)) < 0)
-			return res;
-	}
-	return 0;
+static int dac_acks_owed(struct etherdream *d) {
+	return d->conn.pending_meta_acks
+	    || (d->conn.ackbuf_prod != d->conn.ackbuf_cons);
 }
 
-/* dac_send_data(d, data, npoints, rate)
+/* dac_expect_ack(d)
  *
- * Send points to the DAC, including prepare or begin commands and changing
- * the point rate as necessary.
+ * Note that a command has just been sent to d, for the ACK timeout.
  */
-static int dac_send_data(struct etherdream *d, struct dac_point *data,
-                         int npoints, int rate) {
-	int res;
-	const struct dac_status *st = &d->conn.resp.dac_status;
-
-	if (st->playback_state == 0) {
-		trace(d, "L: Sending prepare command...\n");
-		char c = 'p';
-		if ((res = send_all(d, &c, sizeof c)) < 0)
-			return res;
-
-		d->conn.pending_meta_acks++;
-
-		/* Block here until all ACKs received... XXX timeout */
-		while (d->conn.pending_meta_acks)
-			dac_get_acks(d, 1500);
+static void dac_expect_ack(struct etherdream *d) {
+	if (!dac_acks_owed(d))
+		d->conn.dc_ack_deadline = microseconds() + DEFAULT_TIMEOUT;
+}
 
-		trace(d, "L: prepare ACKed\n");
+/* clock_update(c, st, now)
+ *
+ * Feed a status received at time now into the clock estimator.
+ */
+static void clock_update(struct dac_clock *c, const struct dac_status *st,
+                         long long now) {
+	if (st->playback_state != 2 || !st->point_rate) {
+		c->valid = 0;
+		return;
 	}
 
-	if (st->buffer_fullness > 1600 && st->playback_state == 1 \
-	    && !d->conn.dc_begin_sent) {
-		trace(d, "L: Sending begin command...\n");
-
-		struct begin_command b = { .command = 'b', .point_rate = (uint32_t)rate,
-		                           .low_water_mark = 0 };
-		if ((res = send_all(d, (const char *)&b, sizeof b)) < 0)
-			return res;
+	if (c->valid && st->point_rate != c->nominal_pps) {
+		/* The rate changed, perhaps just by a group trim; keep our
+		 * idea of how far off the DAC's crystal is. */
+		c->rate *= (double)st->point_rate / c->nominal_pps;
+		c->nominal_pps = st->point_rate;
+	}
 
-		d->conn.dc_begin_sent = 1;
-		d->conn.pending_meta_acks++;
+	if (!c->valid) {
+		/* Playback just started: lock on to the nominal rate and
+		 * go from there. */
+		c->valid = 1;
+		c->nominal_pps = st->point_rate;
+		c->last_raw = st->point_count;
+		c->measured = st->point_count;
+		c->count = c->measured;
+		c->rate = st->point_rate / 1000000.0;
+		c->ref_time = now;
+		return;
 	}
 
-	if ((res = dac_get_acks(d, 0)) < 0)
-		return res;
+	c->measured += (uint32_t)(st->point_count - c->last_raw);
+	c->last_raw = st->point_count;
 
-	if (npoints <= 0)
-		return 0;
+	/* ACKs tend to arrive in bursts; only the first of each burst says
+	 * anything new about the rate. */
+	long long dt = now - c->ref_time;
+	if (dt < CLOCK_MIN_INTERVAL)
+		return;
 
-	d->conn.dc_local_buffer.queue.command = 'q';
-	d->conn.dc_local_buffer.queue.point_rate = rate;
+	double predicted = c->count + c->rate * dt;
+	double err = c->measured - predicted;
 
-	d->conn.dc_local_buffer.header.command = 'd';
-	d->conn.dc_local_buffer.header.npoints = npoints;
+	c->count = predicted + CLOCK_ALPHA * err;
+	c->rate += CLOCK_BETA * err / dt;
+	c->ref_time = now;
 
-	memcpy(&d->conn.dc_local_buffer.data[0], data,
-		npoints * sizeof(struct dac_point));
+	/* Real crystals are within a few hundred ppm of each other; anything
+	 * beyond that is jitter. */
+	double nominal = c->nominal_pps / 1000000.0;
+	if (c->rate > nominal * (1 + CLOCK_MAX_DRIFT))
+		c->rate = nominal * (1 + CLOCK_MAX_DRIFT);
+	if (c->rate < nominal * (1 - CLOCK_MAX_DRIFT))
+		c->rate = nominal * (1 - CLOCK_MAX_DRIFT);
+}
 
-	d->conn.dc_local_buffer.data[0].control |= DAC_CTRL_RATE_CHANGE;
+/* clock_played_since_ack(c, now)
+ *
+ * Estimate how many points the DAC has played between the last status it
+ * sent and time now.
+ */
+static int clock_played_since_ack(const struct dac_clock *c, long long now) {
+	if (!c->valid)
+		return 0;
 
-	/* Write the data */
-	if ((res = send_all(d, (const char *)&d->conn.dc_local_buffer,
-		8 + npoints * sizeof(struct dac_point))) < 0)
-		return res;
+	double played = c->count + c->rate * (now - c->ref_time);
+	return (int)(played - c->measured);
+}
 
-	/* Expect two ACKs */
-	d->conn.pending_meta_acks++;
-	d->conn.ackbuf[d->conn.ackbuf_prod] = npoints;
-	d->conn.ackbuf_prod = (d->conn.ackbuf_prod + 1) % MAX_LATE_ACKS;
-	d->conn.unacked_points += npoints;
+/* clock_time_of(c, ahead, pps, now)
+ *
+ * Estimate the time at which the point that is ahead points after the last
+ * status's point_count will be played.
+ */
+static long long clock_time_of(const struct dac_clock *c, int ahead, int pps,
+                               long long now) {
+	if (!c->valid)
+		return now + (long long)ahead * 1000000 / pps;
 
-	return 0;
+	double target = c->measured + ahead;
+	return c->ref_time + (long long)((target - c->count) / c->rate);
 }
 
-#define SHOULD_TRACE() (expected_fullness < DEBUG_THRESHOLD_POINTS \
-           || d->conn.resp.dac_status.buffer_fullness < DEBUG_THRESHOLD_POINTS)
-
-/* dac_loop(dv)
+/* dac_buffer_target(d, pps)
  *
- * Main thread function for sending data to the DAC.
+ * Return how many points we aim to keep in d's buffer at rate pps.
  */
-static void *dac_loop(void *dv) {
-	struct etherdream *d = (struct etherdream *)dv;
-	int res = 0;
+static int dac_buffer_target(struct etherdream *d, int pps) {
+	int us = __atomic_load_n(&d->latency_target, __ATOMIC_RELAXED);
+	if (us == ETHERDREAM_LATENCY_AUTO)
+		us = d->auto_latency;
+	if (!us)
+		return d->buffer_max;
+
+	int target = (long long)us * pps / 1000000;
+	if (target > d->buffer_max)
+		target = d->buffer_max;
+	if (target < 4 * d->min_send)
+		target = 4 * d->min_send;
+	return target;
+}
 
-	pthread_mutex_lock(&d->mutex);
+/* dac_jitter_floor(d)
+ *
+ * Return the lowest latency, in microseconds, that d's network round trip
+ * and its jitter leave room for.
+ */
+static int dac_jitter_floor(struct etherdream *d) {
+	struct etherdream_conn *conn = &d->conn;
+	return conn->dc_rtt_avg + JITTER_MARGIN * conn->dc_rtt_dev
+	     + BATCH_INTERVAL;
+}
 
-	while (1) {
-		/* Wait for us to have data */
-		int state;
-		while ((state = d->state) == ST_READY) {
-			trace(d, "L: waiting\n");
-			pthread_cond_wait(&d->loop_cond, &d->mutex);
-		}
+/* dac_autotune(d, now)
+ *
+ * If d's latency is being tuned automatically and it has been playing
+ * smoothly for long enough, try a slightly lower target.
+ */
+static void dac_autotune(struct etherdream *d, long long now) {
+	struct dac_status *st = &d->conn.resp.dac_status;
 
-		pthread_mutex_unlock(&d->mutex);
+	if (st->playback_state != 2 || !st->point_rate) {
+		d->auto_next = now + AUTOTUNE_INTERVAL;
+		return;
+	}
 
-		if (state != ST_RUNNING)
-			break;
+	if (!d->auto_latency) {
+		/* Start from a full buffer. */
+		d->auto_latency = (long long)d->buffer_max * 1000000
+		                / st->point_rate;
+		d->auto_next = now + AUTOTUNE_INTERVAL;
+		return;
+	}
 
-		struct buffer_item *b = &d->buffer[d->frame_buffer_read];
-		int cap;
-		int expected_used, expected_fullness;
+	if (now < d->auto_next)
+		return;
+	d->auto_next = now + AUTOTUNE_INTERVAL;
+
+	int floor = dac_jitter_floor(d);
+	if (floor < d->auto_min)
+		floor = d->auto_min;
+	int next = d->auto_latency * AUTOTUNE_STEP;
+	if (next < floor)
+		next = floor;
+	if (next != d->auto_latency)
+		tev(d, ETHERDREAM_EV_RETUNE, next, floor, 0, 0);
+	d->auto_latency = next;
+}
 
-		while (1) {
-			res = 0;
+/* dac_autotune_underflow(d)
+ *
+ * Back d's automatic latency target off after an underflow.
+ */
+static void dac_autotune_underflow(struct etherdream *d) {
+	if (!d->auto_latency)
+		return;
 
-			/* Estimate how much data has been consumed since the
-			 * last time we got an ACK. */
-			long long time_diff = microseconds()
-			                    - d->conn.dc_last_ack_time;
+	/* The DAC has stopped, so go by the rate it was playing at. */
+	int pps = d->conn.dc_clock.nominal_pps;
+	int limit = pps ? (long long)d->buffer_max * 1000000 / pps
+	                : d->auto_latency;
+	int next = d->auto_latency * AUTOTUNE_BACKOFF;
+	if (next > limit)
+		next = limit;
+
+	tev(d, ETHERDREAM_EV_RETUNE, next, dac_jitter_floor(d), 1, 0);
+	trace(d, "Underflow; latency target now %d us\n", next);
+	d->auto_min = d->auto_latency / AUTOTUNE_STEP;
+	if (d->auto_min > next)
+		d->auto_min = next;
+	d->auto_latency = next;
+}
 
-			expected_used = time_diff * b->pps / 1000000;
+/* dac_read_acks(d)
+ *
+ * Read and process whatever responses have already arrived from d, without
+ * blocking. Returns 0 on success, -1 on error (will also log error).
+ */
+static int dac_read_acks(struct etherdream *d) {
+	struct etherdream_conn *conn = &d->conn;
+	const int len = sizeof(struct dac_response);
 
-			if (d->conn.resp.dac_status.playback_state != 2)
-				expected_used = 0;
+	while (1) {
+		int space = READ_RING_SIZE - conn->dc_read_fill;
+		int res = read_fill(d, space);
+		if (res < 0)
+			return -1;
+
+		/* Handle every complete response where it lies in the
+		 * ring; only the last of them is kept in conn->resp, as the
+		 * DAC's current status. */
+		long long now = microseconds();
+		const struct dac_response *resp = NULL;
+		struct dac_response split;
+
+		while (conn->dc_read_fill >= len) {
+			int pos = conn->dc_read_pos;
+			if (pos + len <= READ_RING_SIZE) {
+				resp = (const struct dac_response *)
+				       (conn->dc_read_buf + pos);
+			} else {
+				/* Straddles the wrap; only possible if the
+				 * stream fell out of step with the ring. */
+				int first = READ_RING_SIZE - pos;
+				memcpy(&split, conn->dc_read_buf + pos, first);
+				memcpy((char *)&split + first,
+				       conn->dc_read_buf, len - first);
+				resp = &split;
+			}
+
+			tev(d, ETHERDREAM_EV_ACK, resp->command,
+			    resp->dac_status.buffer_fullness,
+			    resp->dac_status.point_count,
+			    resp->dac_status.playback_state);
+			if (check_data_response(d, resp, now) < 0) {
+				conn->resp = *resp;
+				return -1;
+			}
+			clock_update(&conn->dc_clock, &resp->dac_status, now);
+
+			if (conn->dc_read_fill < 2 * len)
+				conn->resp = *resp;
+			read_consume(d, len);
+		}
+
+		if (resp) {
+			conn->dc_last_ack_time = now;
+			conn->dc_ack_deadline = conn->dc_last_ack_time
+			                      + DEFAULT_TIMEOUT;
+		}
+
+		if (res < space)
+			return 0;
+	}
+}
+
+/* Group playback. Members of a group hold off on sending begin until every
+ * member has primed its buffer; the last one to do so schedules a common
+ * start time a few milliseconds out, and each member's sender sends its own
+ * begin at that deadline. After that, each member compares its clock
+ * estimate against the rest of the group whenever it is serviced, and trims
+ * the point rate it asks for in proportion to how far ahead or behind it
+ * is. The trim moves in whole steps, since every change of rate costs a
+ * queue command.
+ *
+ * A member that reconnects comes back with its DAC counting points from
+ * scratch; once its new clock is valid, it is re-seeded with an offset
+ * that lines its count up with where the rest of the group is, and kept
+ * in step from there.
+ */
+
+#define GROUP_MAX		32
+#define GROUP_START_DELAY	5000
+#define GROUP_TRIM_GAIN		0.0001
+#define GROUP_MAX_TRIM		0.005
+#define GROUP_TRIM_STEP		0.0005
+#define GROUP_STALE_TIME	200000
+
+struct group_member {
+	struct etherdream *d;
+	int valid;
+	long long ref_time;
+	double count;
+	double rate;
+};
+
+struct etherdream_group {
+	pthread_mutex_t lock;
+	int n;
+	int primed;
+	long long start_time;
+	struct group_member members[GROUP_MAX];
+};
+
+/* group_begin_time(d, now)
+ *
+ * Called when d is primed and ready to begin. Returns the time at which it
+ * should send begin, or 0 if the rest of its group isn't ready yet.
+ */
+static long long group_begin_time(struct etherdream *d, long long now) {
+	struct etherdream_group *g = d->group;
+	long long start;
+
+	pthread_mutex_lock(&g->lock);
+	if (!d->group_primed) {
+		d->group_primed = 1;
+		if (++g->primed == g->n) {
+			g->start_time = now + GROUP_START_DELAY;
+			tev(d, ETHERDREAM_EV_GROUP_START, g->n,
+			    GROUP_START_DELAY, 0, 0);
+		}
+	}
+	start = g->start_time;
+	pthread_mutex_unlock(&g->lock);
+
+	return start;
+}
+
+/* group_trim(d, now)
+ *
+ * Publish d's clock estimate to its group, and update d's rate trim to pull
+ * it towards the group's average position. If d has just reconnected, work
+ * out its offset from the group first.
+ */
+static void group_trim(struct etherdream *d, long long now) {
+	struct etherdream_group *g = d->group;
+	const struct dac_clock *c = &d->conn.dc_clock;
+	struct group_member *me = &g->members[d->group_slot];
+	double sum = 0, mine;
+	int i, count = 0;
+
+	pthread_mutex_lock(&g->lock);
+
+	if (!c->valid) {
+		me->valid = 0;
+		pthread_mutex_unlock(&g->lock);
+		d->rate_trim = 0;
+		return;
+	}
+
+	mine = c->count + c->rate * (now - c->ref_time);
+
+	if (d->group_reseed) {
+		for (i = 0; i < g->n; i++) {
+			struct group_member *m = &g->members[i];
+			if (i == d->group_slot || !m->valid
+			    || now - m->ref_time > GROUP_STALE_TIME)
+				continue;
+			sum += m->count + m->rate * (now - m->ref_time);
+			count++;
+		}
+		if (count)
+			d->group_offset = sum / count - mine;
+		d->group_reseed = 0;
+		trace(d, "Rejoined group, offset %d points.\n",
+		      (int)d->group_offset);
+		sum = 0;
+		count = 0;
+	}
+
+	mine += d->group_offset;
+	me->valid = 1;
+	me->ref_time = c->ref_time;
+	me->count = c->count + d->group_offset;
+	me->rate = c->rate;
+
+	for (i = 0; i < g->n; i++) {
+		struct group_member *m = &g->members[i];
+		if (!m->valid || now - m->ref_time > GROUP_STALE_TIME)
+			continue;
+		sum += m->count + m->rate * (now - m->ref_time);
+		count++;
+	}
+
+	pthread_mutex_unlock(&g->lock);
+
+	double err = mine - sum / count;
+
+	/* If we're way off - say a member underflowed and restarted - rate
+	 * trimming can't help. */
+	if (err > c->nominal_pps / 10 || err < -(double)c->nominal_pps / 10) {
+		d->rate_trim = 0;
+		return;
+	}
+
+	double trim = -err * GROUP_TRIM_GAIN;
+	if (trim > GROUP_MAX_TRIM)
+		trim = GROUP_MAX_TRIM;
+	if (trim < -GROUP_MAX_TRIM)
+		trim = -GROUP_MAX_TRIM;
+
+	/* Only move once the trim wanted is a whole step away from the one
+	 * in use, so that the rate isn't changed with every batch. */
+	if (fabs(trim - d->rate_trim) >= GROUP_TRIM_STEP)
+		d->rate_trim = round(trim / GROUP_TRIM_STEP) * GROUP_TRIM_STEP;
+}
+
+/* dac_start_playback(d, rate, target, now, begin_at)
+ *
+ * Send prepare or begin commands as necessary; playback begins once the
+ * buffer is nearly up to target. If d is in a group and is holding its begin
+ * for the rest of the group, *begin_at is set to when it should be sent (or
+ * -1 if not yet known). Returns 1 if a prepare is outstanding and no data
+ * should be sent until it has been ACKed, 0 if data can be sent, or -1 on
+ * error.
+ */
+static int dac_start_playback(struct etherdream *d, int rate, int target,
+                              long long now, long long *begin_at) {
+	const struct dac_status *st = &d->conn.resp.dac_status;
+
+	*begin_at = 0;
+
+	if (d->conn.dc_prepare_sent)
+		return 1;
+
+	if (st->playback_state == 0) {
+		tev(d, ETHERDREAM_EV_PREPARE, 0, 0, 0, 0);
+		char c = 'p';
+		dac_expect_ack(d);
+		if (send_all(d, &c, sizeof c) < 0)
+			return -1;
+
+		d->conn.pending_meta_acks++;
+		d->conn.dc_prepare_sent = 1;
+
+		/* Prepare empties the DAC's rate queue along with its
+		 * buffer. */
+		d->conn.dc_rate = d->conn.dc_begin_rate = 0;
+		return 1;
+	}
+
+	if (st->buffer_fullness > target - target / 16
+	    && st->playback_state == 1 \
+	    && !d->conn.dc_begin_sent) {
+		if (d->group) {
+			long long at = group_begin_time(d, now);
+			if (!at || now < at) {
+				*begin_at = at ? at : -1;
+				return 0;
+			}
+		}
+
+		if (d->conn.dc_begin_rate)
+			rate = d->conn.dc_begin_rate;
+
+		tev(d, ETHERDREAM_EV_BEGIN, rate, st->buffer_fullness, 0, 0);
+
+		struct begin_command b = { .command = 'b', .point_rate = (uint32_t)rate,
+		                           .low_water_mark = 0 };
+		dac_expect_ack(d);
+		if (send_all(d, (const char *)&b, sizeof b) < 0)
+			return -1;
+
+		d->conn.dc_begin_sent = 1;
+		d->conn.pending_meta_acks++;
+	}
+
+	return 0;
+}
+
+/* dac_send_data(d, data, npoints, rate)
+ *
+ * Send points to the DAC, to be played at rate. The points go out straight
+ * from data. A queue command is only sent when rate differs from the rate
+ * the previous points will be played at, in which case the first point is
+ * flagged to take the change; that point is staged, along with the headers,
+ * in d's connection struct.
+ */
+static int dac_send_data(struct etherdream *d, const struct dac_point *data,
+                         int npoints, int rate) {
+	struct etherdream_conn *conn = &d->conn;
+	struct iovec iov[2];
+	int iovcnt = 2, change = 0;
+	int res;
+
+	if (npoints <= 0)
+		return 0;
+
+	if (!conn->dc_rate) {
+		/* The first points since prepare: begin sets the rate. */
+		conn->dc_rate = conn->dc_begin_rate = rate;
+	} else if (rate != conn->dc_rate) {
+		change = 1;
+	}
+
+	conn->dc_send_header.header.command = 'd';
+	conn->dc_send_header.header.npoints = npoints;
+
+	if (change) {
+		conn->dc_send_header.queue.command = 'q';
+		conn->dc_send_header.queue.point_rate = rate;
+
+		conn->dc_send_header.first = data[0];
+		conn->dc_send_header.first.control |= DAC_CTRL_RATE_CHANGE;
+
+		iov[0].iov_base = &conn->dc_send_header;
+		iov[0].iov_len = sizeof(conn->dc_send_header);
+		iov[1].iov_base = (void *)(data + 1);
+		iov[1].iov_len = (npoints - 1) * sizeof(struct dac_point);
+		if (npoints == 1)
+			iovcnt = 1;
+	} else {
+		iov[0].iov_base = &conn->dc_send_header.header;
+		iov[0].iov_len = sizeof(conn->dc_send_header.header);
+		iov[1].iov_base = (void *)data;
+		iov[1].iov_len = npoints * sizeof(struct dac_point);
+	}
+
+	/* Write the data. send_iov() eats into iov as it goes, so count the
+	 * bytes first. */
+	int bytes = iov[0].iov_len + iov[1].iov_len;
+	long long now = microseconds();
+	dac_expect_ack(d);
+	if ((res = send_iov(d, iov, iovcnt)) < 0)
+		return res;
+
+	stats_begin(d);
+	stats_sent(d, npoints, bytes, now);
+	if (change)
+		d->stats.s.rate_changes++;
+	stats_end(d);
+
+	/* Expect an ACK for the data, and one for the queue command if we
+	 * sent one */
+	if (change) {
+		conn->pending_meta_acks++;
+		conn->dc_rate = rate;
+	}
+	conn->ackbuf[conn->ackbuf_prod] = npoints;
+	conn->ackbuf_time[conn->ackbuf_prod] = now;
+	conn->ackbuf_prod = (conn->ackbuf_prod + 1) % MAX_LATE_ACKS;
+	conn->unacked_points += npoints;
+
+	return 0;
+}
+
+/* ring_frames_queued(r)
+ *
+ * Return the number of frames in r that have been committed and not yet
+ * released by dac_loop(), including the one currently playing.
+ */
+static unsigned int ring_frames_queued(struct etherdream_ring *r) {
+	return __atomic_load_n(&r->frame_head, __ATOMIC_SEQ_CST)
+	     - __atomic_load_n(&r->frame_tail, __ATOMIC_SEQ_CST);
+}
+
+/* ring_points_free(r)
+ *
+ * Return the number of points that the producer could still reserve in r.
+ */
+static unsigned int ring_points_free(struct etherdream_ring *r) {
+	unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	return r->mask + 1 - (r->head + r->reserved - tail);
+}
+
+/* dac_has_work(d)
+ *
+ * Return nonzero if d has something to play: either queued frames, or a
+ * callback or source to pull points from.
+ */
+static int dac_has_work(struct etherdream *d) {
+	return ring_frames_queued(&d->ring)
+	    || __atomic_load_n(&d->callback, __ATOMIC_ACQUIRE)
+	    || __atomic_load_n(&d->source, __ATOMIC_ACQUIRE);
+}
+
+/* wake_waiters(d)
+ *
+ * Wake up any application threads blocked in etherdream_wait_for_ready() or
+ * etherdream_ring_wait(). This only takes the lock if someone is waiting.
+ */
+static void wake_waiters(struct etherdream *d) {
+	if (!__atomic_load_n(&d->waiters, __ATOMIC_SEQ_CST))
+		return;
+
+	pthread_mutex_lock(&d->mutex);
+	pthread_cond_broadcast(&d->loop_cond);
+	pthread_mutex_unlock(&d->mutex);
+}
+
+/* ring_drop_shared(r, from, to)
+ *
+ * Drop the references held by the frames in r from from up to (but not
+ * including) to, which are about to be thrown away unplayed.
+ */
+static void ring_drop_shared(struct etherdream_ring *r, unsigned int from,
+                             unsigned int to) {
+	for (; from != to; from++) {
+		struct ring_frame *f = &r->frames[from & RING_FRAME_MASK];
+		if (f->shared)
+			etherdream_frame_release(f->shared);
+		f->shared = NULL;
+	}
+}
+
+/* ring_release_frame(d)
+ *
+ * Called from dac_loop() when it is done with the current frame: hand its
+ * points back to the producer and move on to the next frame.
+ */
+static void ring_release_frame(struct etherdream *d) {
+	struct etherdream_ring *r = &d->ring;
+	struct ring_frame *f = &r->frames[r->frame_tail & RING_FRAME_MASK];
+	struct etherdream_frame *shared = f->shared;
+
+	__atomic_store_n(&r->tail, f->start + (shared ? 0 : f->points),
+	                 __ATOMIC_RELEASE);
+	__atomic_store_n(&r->frame_tail, r->frame_tail + 1, __ATOMIC_SEQ_CST);
+	r->cur_valid = 0;
+	r->idx = 0;
+
+	if (shared)
+		etherdream_frame_release(shared);
+
+	wake_waiters(d);
+}
+
+/* ring_skip_stale(d)
+ *
+ * Latest-frame mode: release every queued frame but the newest, none of
+ * which have started playing. Called with d->mutex held and at least one
+ * frame queued, so as not to race with ring_reclaim(); returns the number
+ * of frames released, and leaves waking the producer to the caller.
+ */
+static unsigned int ring_skip_stale(struct etherdream *d) {
+	struct etherdream_ring *r = &d->ring;
+	unsigned int skipped = ring_frames_queued(r) - 1;
+	unsigned int reclaimed = __atomic_exchange_n(&d->reclaimed, 0,
+	                                             __ATOMIC_RELAXED);
+
+	if (skipped) {
+		unsigned int newest = __atomic_load_n(&r->frame_head,
+		                                      __ATOMIC_ACQUIRE) - 1;
+		ring_drop_shared(r, r->frame_tail, newest);
+		__atomic_store_n(&r->tail,
+		                 r->frames[newest & RING_FRAME_MASK].start,
+		                 __ATOMIC_RELEASE);
+		__atomic_store_n(&r->frame_tail, newest, __ATOMIC_SEQ_CST);
+		tev(d, ETHERDREAM_EV_SKIP, skipped, 0, 0, 0);
+	}
+
+	if (skipped || reclaimed) {
+		stats_begin(d);
+		d->stats.s.frames_skipped += skipped + reclaimed;
+		stats_end(d);
+	}
+
+	return skipped;
+}
+
+/* ring_reclaim(d)
+ *
+ * Latest-frame mode: called by the producer when a new frame won't fit.
+ * Take back every queued frame behind the oldest, along with its points;
+ * none of them have started playing, and the new frame would have replaced
+ * them anyway. The oldest may be playing, so it is left alone, and the ring
+ * always has room for it and one more of the largest frames.
+ */
+static void ring_reclaim(struct etherdream *d) {
+	struct etherdream_ring *r = &d->ring;
+
+	pthread_mutex_lock(&d->mutex);
+	unsigned int first = __atomic_load_n(&r->frame_tail,
+	                                     __ATOMIC_ACQUIRE) + 1;
+	unsigned int n = r->frame_head - first;
+
+	if (ring_frames_queued(r) > 1) {
+		ring_drop_shared(r, first, r->frame_head);
+		r->head = r->frames[first & RING_FRAME_MASK].start;
+		__atomic_store_n(&r->frame_head, first, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&d->reclaimed, n, __ATOMIC_RELAXED);
+		tev(d, ETHERDREAM_EV_SKIP, n, 0, 0, 0);
+	}
+	pthread_mutex_unlock(&d->mutex);
+}
+
+/* dac_set_idle(d)
+ *
+ * Called from the sending side when it has run out of frames: switch d to
+ * ST_READY so that the next etherdream_ring_commit() wakes it. Returns 1 if
+ * d is now idle, 0 if a frame arrived in the meantime or d is shutting down.
+ */
+static int dac_set_idle(struct etherdream *d) {
+	int idle = 0;
+
+	pthread_mutex_lock(&d->mutex);
+	if (d->state == ST_RUNNING) {
+		tev(d, ETHERDREAM_EV_IDLE, 0, 0, 0, 0);
+		__atomic_store_n(&d->state, ST_READY, __ATOMIC_SEQ_CST);
+	}
+	if (d->state == ST_READY) {
+		if (dac_has_work(d))
+			__atomic_store_n(&d->state, ST_RUNNING,
+			                 __ATOMIC_SEQ_CST);
+		else
+			idle = 1;
+	}
+	pthread_mutex_unlock(&d->mutex);
+
+	return idle;
+}
+
+/* Point conversion. An etherdream_point holds the same eight fields as the
+ * wire-format dac_point, but the wire format puts a control word in front,
+ * so each point lands two bytes further along than the last. The vector
+ * kernels convert eight points at a time in registers, applying the
+ * transform (if there is one) on the way, then shift them into place with
+ * nine 16-byte stores. The scalar kernel is the reference the others must
+ * match bit for bit, and handles whatever is left over at the end.
+ */
+typedef void (*convert_fn)(struct dac_point *out,
+                           const struct etherdream_point *in, int n,
+                           const struct etherdream_transform *t);
+
+static convert_fn convert_kernel;
+
+/* xform_signed(v, scale, offset), xform_unsigned(v, scale)
+ *
+ * Transform one field, saturating and rounding as the vector kernels do.
+ */
+static int16_t xform_signed(int16_t v, float scale, float offset) {
+	float f = v * scale + offset;
+	if (f < -32768.0f)
+		f = -32768.0f;
+	if (f > 32767.0f)
+		f = 32767.0f;
+	return lrintf(f);
+}
+
+static uint16_t xform_unsigned(uint16_t v, float scale) {
+	float f = v * scale;
+	if (f < 0.0f)
+		f = 0.0f;
+	if (f > 65535.0f)
+		f = 65535.0f;
+	return lrintf(f);
+}
+
+/* convert_scalar(out, in, n, t)
+ *
+ * Convert n points one field at a time.
+ */
+static void convert_scalar(struct dac_point *out,
+                           const struct etherdream_point *in, int n,
+                           const struct etherdream_transform *t) {
+	int i;
+
+	if (!t) {
+		for (i = 0; i < n; i++) {
+			out[i].control = 0;
+			out[i].x = in[i].x;
+			out[i].y = in[i].y;
+			out[i].r = in[i].r;
+			out[i].g = in[i].g;
+			out[i].b = in[i].b;
+			out[i].i = in[i].i;
+			out[i].u1 = in[i].u1;
+			out[i].u2 = in[i].u2;
+		}
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		out[i].control = 0;
+		out[i].x = xform_signed(in[i].x, t->scale_x, t->offset_x);
+		out[i].y = xform_signed(in[i].y, t->scale_y, t->offset_y);
+		out[i].r = xform_unsigned(in[i].r, t->intensity);
+		out[i].g = xform_unsigned(in[i].g, t->intensity);
+		out[i].b = xform_unsigned(in[i].b, t->intensity);
+		out[i].i = xform_unsigned(in[i].i, t->intensity);
+		out[i].u1 = in[i].u1;
+		out[i].u2 = in[i].u2;
+	}
+}
+
+#if HAVE_X86_SIMD
+
+/* store8(out, p)
+ *
+ * Store the eight points in p, each holding the fields that follow the
+ * control word, as wire-format points with a control word of 0. Point k
+ * starts 2k + 2 bytes into the kth 16-byte block of out, so each block is
+ * the tail of one point and the head of the next.
+ */
+__attribute__((target("sse2")))
+static inline void store8(struct dac_point *out, const __m128i *p) {
+	__m128i *o = (__m128i *)out;
+	_mm_storeu_si128(o + 0, _mm_slli_si128(p[0], 2));
+	_mm_storeu_si128(o + 1, _mm_or_si128(_mm_srli_si128(p[0], 14),
+	                                     _mm_slli_si128(p[1], 4)));
+	_mm_storeu_si128(o + 2, _mm_or_si128(_mm_srli_si128(p[1], 12),
+	                                     _mm_slli_si128(p[2], 6)));
+	_mm_storeu_si128(o + 3, _mm_or_si128(_mm_srli_si128(p[2], 10),
+	                                     _mm_slli_si128(p[3], 8)));
+	_mm_storeu_si128(o + 4, _mm_or_si128(_mm_srli_si128(p[3], 8),
+	                                     _mm_slli_si128(p[4], 10)));
+	_mm_storeu_si128(o + 5, _mm_or_si128(_mm_srli_si128(p[4], 6),
+	                                     _mm_slli_si128(p[5], 12)));
+	_mm_storeu_si128(o + 6, _mm_or_si128(_mm_srli_si128(p[5], 4),
+	                                     _mm_slli_si128(p[6], 14)));
+	_mm_storeu_si128(o + 7, _mm_srli_si128(p[6], 2));
+	_mm_storeu_si128(o + 8, p[7]);
+}
+
+/* convert_sse2(out, in, n, t)
+ *
+ * Convert n points, eight at a time, with SSE2. Each point is one register
+ * of eight 16-bit fields; for the transform it is widened to two registers
+ * of four floats, x and y sign-extended and the rest zero-extended.
+ */
+__attribute__((target("sse2")))
+static void convert_sse2(struct dac_point *out,
+                         const struct etherdream_point *in, int n,
+                         const struct etherdream_transform *t) {
+	const __m128i *src = (const __m128i *)in;
+	__m128i p[8];
+	int i, k;
+
+	if (!t) {
+		for (i = 0; i + 8 <= n; i += 8) {
+			for (k = 0; k < 8; k++)
+				p[k] = _mm_loadu_si128(src + i + k);
+			store8(out + i, p);
+		}
+		convert_scalar(out + i, in + i, n - i, NULL);
+		return;
+	}
+
+	const __m128i xy = _mm_set_epi32(0, 0, -1, -1);
+	const __m128 mul_lo = _mm_set_ps(t->intensity, t->intensity,
+	                                 t->scale_y, t->scale_x);
+	const __m128 add_lo = _mm_set_ps(0, 0, t->offset_y, t->offset_x);
+	const __m128 min_lo = _mm_set_ps(0, 0, -32768.0f, -32768.0f);
+	const __m128 max_lo = _mm_set_ps(65535.0f, 65535.0f,
+	                                 32767.0f, 32767.0f);
+	const __m128 mul_hi = _mm_set_ps(1, 1, t->intensity, t->intensity);
+	const __m128 max_hi = _mm_set1_ps(65535.0f);
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		for (k = 0; k < 8; k++) {
+			__m128i v = _mm_loadu_si128(src + i + k);
+			__m128i lo = _mm_unpacklo_epi16(v, v);
+			__m128i hi = _mm_unpackhi_epi16(v, v);
+
+			lo = _mm_or_si128(
+				_mm_and_si128(xy, _mm_srai_epi32(lo, 16)),
+				_mm_andnot_si128(xy, _mm_srli_epi32(lo, 16)));
+			hi = _mm_srli_epi32(hi, 16);
+
+			__m128 flo = _mm_add_ps(_mm_mul_ps(
+				_mm_cvtepi32_ps(lo), mul_lo), add_lo);
+			__m128 fhi = _mm_mul_ps(_mm_cvtepi32_ps(hi), mul_hi);
+			flo = _mm_min_ps(_mm_max_ps(flo, min_lo), max_lo);
+			fhi = _mm_min_ps(_mm_max_ps(fhi, _mm_setzero_ps()),
+			                 max_hi);
+
+			/* Keep the low 16 bits of each lane, so that packing
+			 * doesn't saturate values above 32767. */
+			lo = _mm_cvtps_epi32(flo);
+			hi = _mm_cvtps_epi32(fhi);
+			lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+			hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+			p[k] = _mm_packs_epi32(lo, hi);
+		}
+		store8(out + i, p);
+	}
+
+	convert_scalar(out + i, in + i, n - i, t);
+}
+
+/* convert_avx2(out, in, n, t)
+ *
+ * Convert n points, eight at a time, with AVX2: each point's fields are
+ * widened into a single register of eight floats. Without a transform
+ * there is nothing for the wider registers to do, so that case is left to
+ * convert_sse2().
+ */
+__attribute__((target("avx2")))
+static void convert_avx2(struct dac_point *out,
+                         const struct etherdream_point *in, int n,
+                         const struct etherdream_transform *t) {
+	const __m128i *src = (const __m128i *)in;
+	__m128i p[8];
+	int i, k;
+
+	if (!t) {
+		convert_sse2(out, in, n, NULL);
+		return;
+	}
+
+	const __m256 mul = _mm256_set_ps(1, 1, t->intensity, t->intensity,
+	                                 t->intensity, t->intensity,
+	                                 t->scale_y, t->scale_x);
+	const __m256 add = _mm256_set_ps(0, 0, 0, 0, 0, 0,
+	                                 t->offset_y, t->offset_x);
+	const __m256 min = _mm256_set_ps(0, 0, 0, 0, 0, 0,
+	                                 -32768.0f, -32768.0f);
+	const __m256 max = _mm256_set_ps(65535.0f, 65535.0f, 65535.0f,
+	                                 65535.0f, 65535.0f, 65535.0f,
+	                                 32767.0f, 32767.0f);
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i w[2];
+
+		for (k = 0; k < 8; k++) {
+			__m128i v = _mm_loadu_si128(src + i + k);
+			__m256i s = _mm256_blend_epi32(_mm256_cvtepu16_epi32(v),
+			                               _mm256_cvtepi16_epi32(v),
+			                               0x03);
+			__m256 f = _mm256_add_ps(_mm256_mul_ps(
+				_mm256_cvtepi32_ps(s), mul), add);
+			f = _mm256_min_ps(_mm256_max_ps(f, min), max);
+
+			s = _mm256_cvtps_epi32(f);
+			w[k & 1] = _mm256_srai_epi32(_mm256_slli_epi32(s, 16),
+			                             16);
+
+			if (k & 1) {
+				/* Packing works within 128-bit lanes, so the
+				 * two points come out interleaved. */
+				__m256i pk = _mm256_permute4x64_epi64(
+					_mm256_packs_epi32(w[0], w[1]), 0xd8);
+				p[k - 1] = _mm256_castsi256_si128(pk);
+				p[k] = _mm256_extracti128_si256(pk, 1);
+			}
+		}
+		store8(out + i, p);
+	}
+
+	convert_scalar(out + i, in + i, n - i, t);
+}
+
+#endif
+
+/* convert_pick()
+ *
+ * Choose the fastest kernel this CPU can run.
+ */
+static convert_fn convert_pick(void) {
+#if HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return convert_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return convert_sse2;
+#endif
+	return convert_scalar;
+}
+
+/* etherdream_convert(out, in, n, t)
+ *
+ * Documented in etherdream.h.
+ */
+void etherdream_convert(struct dac_point *out,
+                        const struct etherdream_point *in, int n,
+                        const struct etherdream_transform *t) {
+	convert_fn fn = __atomic_load_n(&convert_kernel, __ATOMIC_RELAXED);
+	if (!fn) {
+		fn = convert_pick();
+		__atomic_store_n(&convert_kernel, fn, __ATOMIC_RELAXED);
+	}
+	fn(out, in, n, t);
+}
+
+/* etherdream_set_convert_kernel(kernel)
+ *
+ * Documented in etherdream.h.
+ */
+int etherdream_set_convert_kernel(enum etherdream_convert_kernel kernel) {
+	convert_fn fn = NULL;
+
+	switch (kernel) {
+	case ETHERDREAM_CONVERT_AUTO:
+		fn = convert_pick();
+		break;
+	case ETHERDREAM_CONVERT_SCALAR:
+		fn = convert_scalar;
+		break;
+#if HAVE_X86_SIMD
+	case ETHERDREAM_CONVERT_SSE2:
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("sse2"))
+			fn = convert_sse2;
+		break;
+	case ETHERDREAM_CONVERT_AVX2:
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			fn = convert_avx2;
+		break;
+#endif
+	default:
+		break;
+	}
+
+	if (!fn)
+		return -1;
+	__atomic_store_n(&convert_kernel, fn, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* transform_wire(out, in, n, t)
+ *
+ * Transform n points that are already in wire format, as convert_scalar()
+ * would have on their way in, keeping their control and user words.
+ */
+static void transform_wire(struct dac_point *out, const struct dac_point *in,
+                           int n, const struct etherdream_transform *t) {
+	int i;
+
+	for (i = 0; i < n; i++) {
+		out[i].control = in[i].control;
+		out[i].x = xform_signed(in[i].x, t->scale_x, t->offset_x);
+		out[i].y = xform_signed(in[i].y, t->scale_y, t->offset_y);
+		out[i].r = xform_unsigned(in[i].r, t->intensity);
+		out[i].g = xform_unsigned(in[i].g, t->intensity);
+		out[i].b = xform_unsigned(in[i].b, t->intensity);
+		out[i].i = xform_unsigned(in[i].i, t->intensity);
+		out[i].u1 = in[i].u1;
+		out[i].u2 = in[i].u2;
+	}
+}
+
+/* ring_write_points(d, pts, npts)
+ *
+ * Convert pts into wire format, applying d's transform if it has one, and
+ * append them to the points reserved in d's ring. The caller must have
+ * checked that there is room.
+ */
+static void ring_write_points(struct etherdream *d,
+                              const struct etherdream_point *pts, int npts) {
+	const struct etherdream_transform *t =
+		d->transform_set ? &d->transform : NULL;
+	int done = 0;
+	while (done < npts) {
+		struct dac_point *next;
+		int n = etherdream_ring_reserve(d, npts - done, &next);
+
+		etherdream_convert(next, pts + done, n, t);
+		done += n;
+	}
+}
+
+/* dac_pull_request(d, npoints, pps, now, req)
+ *
+ * Fill in req to ask a callback or source for npoints points, starting with
+ * the next point that has not been sent to the DAC.
+ */
+static void dac_pull_request(struct etherdream *d, int npoints, int pps,
+                             long long now, struct etherdream_request *req) {
+	const struct dac_status *st = &d->conn.resp.dac_status;
+
+	/* The DAC has played point_count points as of the last ACK, and
+	 * everything in its buffer or in flight is ahead of the points we
+	 * are about to ask for. */
+	int ahead = st->buffer_fullness + d->conn.unacked_points;
+
+	req->point_index = st->point_count + ahead;
+	req->emit_time = clock_time_of(&d->conn.dc_clock, ahead, pps, now);
+	req->npoints = npoints;
+	req->pps = pps;
+}
+
+/* dac_pull(d, npoints, pps, now)
+ *
+ * Pull mode: ask d's callback for up to npoints points and queue whatever
+ * it gives back as a frame. Returns the number of points queued.
+ */
+static int dac_pull(struct etherdream *d, int npoints, int pps,
+                    long long now) {
+	etherdream_callback cb = __atomic_load_n(&d->callback, __ATOMIC_ACQUIRE);
+	struct etherdream_request req;
+
+	if (npoints > CALLBACK_MAX_POINTS)
+		npoints = CALLBACK_MAX_POINTS;
+	if (npoints > (int)ring_points_free(&d->ring))
+		npoints = ring_points_free(&d->ring);
+	if (!cb || npoints <= 0)
+		return 0;
+
+	dac_pull_request(d, npoints, pps, now, &req);
+
+	int n = cb(d, &req, d->callback_buf, d->callback_user);
+	tev(d, ETHERDREAM_EV_PULL, npoints, n, req.point_index, 0);
+	if (n <= 0)
+		return 0;
+	if (n > npoints)
+		n = npoints;
+
+	ring_write_points(d, d->callback_buf, n);
+	etherdream_ring_commit(d, pps, 1);
+	return n;
+}
+
+/* dac_pull_source(d, npoints, pps, rate, now)
+ *
+ * Zero-copy pull mode: ask d's source for up to npoints points and send
+ * them to the DAC, at rate, from wherever the source keeps them. Returns
+ * the number of points sent, or -1 if the connection has failed.
+ */
+static int dac_pull_source(struct etherdream *d, int npoints, int pps,
+                           int rate, long long now) {
+	etherdream_source src = __atomic_load_n(&d->source, __ATOMIC_ACQUIRE);
+	const struct dac_point *pts = NULL;
+	struct etherdream_request req;
+
+	if (!src || npoints <= 0)
+		return 0;
+
+	dac_pull_request(d, npoints, pps, now, &req);
+
+	int n = src(d, &req, &pts, d->callback_user);
+	tev(d, ETHERDREAM_EV_PULL, npoints, n, req.point_index, 0);
+	if (n <= 0 || !pts)
+		return 0;
+	if (n > npoints)
+		n = npoints;
+
+	tev(d, ETHERDREAM_EV_SEND, n, 0, rate, d->conn.unacked_points);
+	if (dac_send_data(d, pts, n, rate) < 0)
+		return -1;
+	return n;
+}
+
+/* dac_service(d, next)
+ *
+ * Do as much work for d as can be done without blocking: handle any ACKs
+ * that have arrived, start playback if needed, and send points until the
+ * DAC's buffer is at its target level. This is the body of both dac_loop()
+ * and the reactor backend.
+ *
+ * On return, *next is the time (in microseconds()) at which d should be
+ * serviced again even if no response arrives, or -1 if d has run out of
+ * frames. Returns 0 on success, -1 if the connection has failed.
+ */
+static int dac_service(struct etherdream *d, long long *next) {
+	struct etherdream_ring *r = &d->ring;
+	struct etherdream_conn *conn = &d->conn;
+	const struct dac_status *st = &conn->resp.dac_status;
+	int res;
+
+	*next = -1;
+
+	if (dac_read_acks(d) < 0)
+		return -1;
+
+	long long now = microseconds();
+
+	if (dac_acks_owed(d) && now > conn->dc_ack_deadline) {
+		trace(d, "!! Timed out waiting for ACK.\n");
+		return -1;
+	}
+
+	if (d->dry_time && st->playback_state == 2) {
+		/* Playing again after a reconnect; if the DAC ran dry in
+		 * the meantime, the laser was dark from then until now. */
+		long long dark = now - d->dry_time;
+		stats_begin(d);
+		hist_add(&d->stats.s.blackout, dark > 0 ? dark : 0);
+		stats_end(d);
+		d->dry_time = 0;
+	}
+
+	if (d->group)
+		group_trim(d, now);
+
+	if (__atomic_load_n(&d->latency_target, __ATOMIC_RELAXED)
+	    == ETHERDREAM_LATENCY_AUTO) {
+		/* Only an underflow with more left to play means the target
+		 * was too low; otherwise the application just ran dry. */
+		if (conn->dc_underflowed && dac_has_work(d))
+			dac_autotune_underflow(d);
+		dac_autotune(d, now);
+	}
+	conn->dc_underflowed = 0;
+
+	while (1) {
+		struct ring_frame *f = NULL;
+		int pps;
+
+		if (ring_frames_queued(r)) {
+			if (!r->cur_valid && __atomic_load_n(&d->latest_frame,
+			                                     __ATOMIC_RELAXED)) {
+				/* Settle which frame plays next with
+				 * ring_reclaim(), which may be taking back
+				 * the ones behind it. */
+				unsigned int skipped = 0;
+				pthread_mutex_lock(&d->mutex);
+				if (ring_frames_queued(r)) {
+					skipped = ring_skip_stale(d);
+					f = &r->frames[r->frame_tail
+					               & RING_FRAME_MASK];
+					r->cur_valid = 1;
+					r->idx = 0;
+					r->repeat_left = f->repeatcount;
+				}
+				pthread_mutex_unlock(&d->mutex);
+				if (skipped)
+					wake_waiters(d);
+				if (!r->cur_valid)
+					continue;
+			}
+
+			f = &r->frames[r->frame_tail & RING_FRAME_MASK];
+			if (!r->cur_valid) {
+				r->cur_valid = 1;
+				r->idx = 0;
+				r->repeat_left = f->repeatcount;
+			}
+			pps = f->pps;
+		} else if (__atomic_load_n(&d->callback, __ATOMIC_ACQUIRE)
+		           || __atomic_load_n(&d->source, __ATOMIC_ACQUIRE)) {
+			pps = d->callback_pps;
+		} else {
+			break;
+		}
+
+		int target = dac_buffer_target(d, pps);
+
+		long long begin_at;
+
+		if ((res = dac_start_playback(d, pps, target, now,
+		                              &begin_at)) < 0)
+			return res;
+		if (res) {
+			/* Waiting on the prepare ACK. */
+			*next = conn->dc_ack_deadline;
+			return 0;
+		}
+
+		/* Don't overrun our record of outstanding data ACKs. */
+		if ((conn->ackbuf_prod + 1) % MAX_LATE_ACKS
+		    == conn->ackbuf_cons) {
+			*next = conn->dc_ack_deadline;
+			return 0;
+		}
+
+		/* Estimate how much data has been consumed since the
+		 * last time we got an ACK. */
+		int expected_used = clock_played_since_ack(&conn->dc_clock, now);
+
+		int expected_fullness = st->buffer_fullness
+		                      + conn->unacked_points - expected_used;
+
+		/* Now, see how much data we should write. Rather than a
+		 * fixed batch size, wait until there's room for about
+		 * BATCH_INTERVAL worth of points, but don't let the buffer
+		 * drop more than a quarter below the target. */
+		int cap = target - expected_fullness;
+		int min_send = (long long)pps * BATCH_INTERVAL / 1000000;
+
+		if (min_send > target / 4)
+			min_send = target / 4;
+		if (min_send < d->min_send)
+			min_send = d->min_send;
+
+		if (cap <= min_send && st->playback_state == 2) {
+			/* Wait a little. */
+			int diff = min_send - cap;
+			int wait_time = 500 + (1000000L * diff / pps);
+
+			tev(d, ETHERDREAM_EV_WAIT, cap, expected_fullness,
+			    wait_time, conn->unacked_points);
+
+			*next = now + wait_time;
+			return 0;
+		}
+
+		if (cap <= 0) {
+			/* Not playing yet, and the buffer is full; check
+			 * back once the DAC has ACKed enough to begin, or
+			 * when our group is due to start. */
+			*next = begin_at > 0 ? begin_at : now + 1000;
+			return 0;
+		}
+
+		int rate = pps;
+		if (d->rate_trim != 0)
+			rate = pps * (1 + d->rate_trim) + 0.5;
+
+		if (!f && __atomic_load_n(&d->source, __ATOMIC_ACQUIRE)) {
+			/* Zero-copy pull mode: the source's points go
+			 * straight out. */
+			if ((res = dac_pull_source(d, cap, pps, rate, now)) < 0)
+				return res;
+			if (!res) {
+				*next = now + 1000;
+				return 0;
+			}
+			now = microseconds();
+			continue;
+		}
+
+		if (!f) {
+			/* Pull mode: ask for exactly as many points as
+			 * there's room for, then go around again to send
+			 * them. */
+			if (!dac_pull(d, cap, pps, now)) {
+				*next = now + 1000;
+				return 0;
+			}
+			continue;
+		}
+
+		/* How many points can we send? A frame may wrap around the
+		 * end of the ring, in which case it goes out in two pieces. */
+		const struct dac_point *data;
+		int b_left = f->points - r->idx;
+
+		if (cap > b_left)
+			cap = b_left;
+
+		if (f->shared) {
+			/* Shared frames go out straight from the frame,
+			 * unless this DAC transforms them. */
+			data = f->shared->points + r->idx;
+			if (f->transform_set) {
+				if (cap > SHARED_XFORM_POINTS)
+					cap = SHARED_XFORM_POINTS;
+				transform_wire(d->shared_buf, data, cap,
+				               &f->transform);
+				data = d->shared_buf;
+			}
+		} else {
+			unsigned int pos = (f->start + r->idx) & r->mask;
+			int contig = r->mask + 1 - pos;
+
+			if (cap > contig)
+				cap = contig;
+			data = &r->points[pos];
+		}
+
+		stats_begin(d);
+		hist_add(&d->stats.s.fullness, expected_fullness);
+		d->stats.s.buffer_target = target;
+		stats_end(d);
+
+		tev(d, ETHERDREAM_EV_SEND, cap, expected_fullness, rate,
+		    conn->unacked_points);
+
+		if ((res = dac_send_data(d, data, cap, rate)) < 0)
+			return res;
+
+		now = microseconds();
+
+		/* What next? */
+		r->idx += cap;
+
+		if (r->idx < f->points) {
+			/* There's more in this frame. */
+			continue;
+		}
+
+		r->idx = 0;
+
+		if (__atomic_exchange_n(&d->stop_requested, 0, __ATOMIC_ACQ_REL))
+			r->repeat_left = 0;
+
+		if (ring_frames_queued(r) > 1
+		    && __atomic_load_n(&d->latest_frame, __ATOMIC_RELAXED)) {
+			/* Latest-frame mode: a newer frame takes over here,
+			 * however many repeats this one had left. */
+			ring_release_frame(d);
+		} else if (r->repeat_left > 1) {
+			/* Play this frame again? */
+			r->repeat_left--;
+		} else if (r->repeat_left >= 0 || ring_frames_queued(r) > 1) {
+			/* Move to the next frame, or go idle if there
+			 * isn't one. */
+			ring_release_frame(d);
+		} else {
+			/* repeatcount is negative and there's no new frame,
+			 * so just play this one over again. */
+		}
+	}
+
+	return 0;
+}
+
+/* dac_lost(d)
+ *
+ * Called from d's sender when its connection has failed: close the socket,
+ * and get ready to reconnect, unless reconnection is turned off or d is
+ * being disconnected. Returns 0 if d should reconnect, -1 if not.
+ */
+static int dac_lost(struct etherdream *d) {
+	struct etherdream_conn *conn = &d->conn;
+	const struct dac_status *st = &conn->resp.dac_status;
+	long long now = microseconds();
+
+	close(conn->dc_sock);
+	conn->dc_sock = -1;
+
+	int window = __atomic_load_n(&d->reconnect_window, __ATOMIC_RELAXED);
+	if (!window || __atomic_load_n(&d->state, __ATOMIC_SEQ_CST)
+	               == ST_SHUTDOWN)
+		return -1;
+
+	trace(d, "Connection lost; reconnecting.\n");
+	tev(d, ETHERDREAM_EV_LOST, st->buffer_fullness, st->playback_state,
+	    0, 0);
+
+	/* The DAC carries on playing what it has; work out when that will
+	 * run out, to measure the blackout against. */
+	d->dry_time = 0;
+	if (st->playback_state == 2)
+		d->dry_time = clock_time_of(&conn->dc_clock,
+		                            st->buffer_fullness,
+		                            st->point_rate, now);
+
+	/* Its point count starts over on the new connection, so it sits out
+	 * of its group's reckoning until group_trim() can re-seed it. */
+	struct etherdream_group *g = d->group;
+	if (g) {
+		pthread_mutex_lock(&g->lock);
+		g->members[d->group_slot].valid = 0;
+		pthread_mutex_unlock(&g->lock);
+		d->group_reseed = 1;
+		d->rate_trim = 0;
+	}
+
+	d->reconnecting = 1;
+	d->outage_start = now;
+	d->reconnect_deadline = now + window;
+	d->retry_at = now;
+	d->retry_backoff = RECONNECT_MIN_BACKOFF;
+	return 0;
+}
+
+/* dac_reconnect_step(d, next)
+ *
+ * Move d's reconnection along without blocking: start a connection attempt
+ * if it's time to, or take the handshake as far as it will go. Returns 1
+ * once d is connected again, with its current frame rewound so that the
+ * DAC's buffer is refilled from the start of it; 0 if it needs to wait, on
+ * its socket (if it has one) or until *next; or -1 to give up.
+ */
+static int dac_reconnect_step(struct etherdream *d, long long *next) {
+	struct etherdream_conn *conn = &d->conn;
+	long long now = microseconds();
+	int res = 0;
+
+	if (conn->dc_sock >= 0) {
+		struct pollfd pfd = {
+			.fd = conn->dc_sock, .events = dac_connect_events(d)
+		};
+		stats_syscall(d);
+		if (poll(&pfd, 1, 0) > 0)
+			res = dac_connect_step(d);
+		if (res == 0 && now > conn->dc_connect_deadline) {
+			close(conn->dc_sock);
+			conn->dc_sock = -1;
+			res = -1;
+		}
+
+		if (res == 0) {
+			*next = conn->dc_connect_deadline;
+			return 0;
+		}
+
+		if (res > 0) {
+			trace(d, "Reconnected after %lld us.\n",
+			      now - d->outage_start);
+			tev(d, ETHERDREAM_EV_RECONNECT, now - d->outage_start,
+			    0, 0, 0);
+			stats_begin(d);
+			d->stats.s.reconnects++;
+			stats_end(d);
+
+			/* The DAC may well still be playing; pick its clock
+			 * up from where the handshake found it, since
+			 * nothing else will until we send it more data. */
+			clock_update(&conn->dc_clock, &conn->resp.dac_status,
+			             now);
+			conn->dc_last_ack_time = now;
+
+			d->ring.idx = 0;
+			d->reconnecting = 0;
+			return 1;
+		}
+
+		d->retry_at = now + d->retry_backoff;
+		d->retry_backoff *= 2;
+		if (d->retry_backoff > RECONNECT_MAX_BACKOFF)
+			d->retry_backoff = RECONNECT_MAX_BACKOFF;
+	}
+
+	if (now >= d->reconnect_deadline) {
+		trace(d, "!! Giving up on reconnecting.\n");
+		d->reconnecting = 0;
+		return -1;
+	}
+
+	if (now < d->retry_at) {
+		*next = d->retry_at;
+		return 0;
+	}
+
+	if (dac_connect_start(d) < 0) {
+		d->retry_at = now + d->retry_backoff;
+		*next = d->retry_at;
+		return 0;
+	}
+
+	if (conn->dc_connect_deadline > d->reconnect_deadline)
+		conn->dc_connect_deadline = d->reconnect_deadline;
+	*next = now;
+	return 0;
+}
+
+/* dac_reconnect(d)
+ *
+ * dac_loop()'s way of reconnecting: after a failure, block until d is
+ * connected again. Returns 0 on success, -1 if d should shut down.
+ */
+static int dac_reconnect(struct etherdream *d) {
+	if (dac_lost(d) < 0)
+		return -1;
+
+	while (1) {
+		long long next;
+		int res = dac_reconnect_step(d, &next);
+		if (res)
+			return res > 0 ? 0 : -1;
+
+		/* Check for etherdream_disconnect() every so often. */
+		long long delay = next - microseconds();
+		if (delay > RECONNECT_POLL)
+			delay = RECONNECT_POLL;
+		if (delay > 0) {
+			struct pollfd pfd = {
+				.fd = d->conn.dc_sock,
+				.events = dac_connect_events(d)
+			};
+			stats_syscall(d);
+			poll(&pfd, 1, (delay + 999) / 1000);
+		}
+
+		if (__atomic_load_n(&d->state, __ATOMIC_SEQ_CST)
+		    == ST_SHUTDOWN)
+			return -1;
+	}
+}
+
+/* dac_sleep_until(d, deadline)
+ *
+ * dac_loop()'s sleep: wait until deadline, a microseconds() time, or until
+ * the DAC says something. If no ACKs are owed, nothing can arrive, and this
+ * sleeps on the absolute deadline itself; otherwise select()'s timeout is
+ * worked out from it just beforehand. Either way, the last spin_usec of
+ * the wait are spent spinning. Returns 1 if the socket became readable, 0
+ * at the deadline, or -1 on error.
+ */
+static int dac_sleep_until(struct etherdream *d, long long deadline) {
+	int spin = __atomic_load_n(&d->spin_usec, __ATOMIC_RELAXED);
+	long long wake = deadline - spin;
+	long long delay = wake - microseconds();
+
+	if (delay > 0) {
+#ifndef __MACH__
+		if (!dac_acks_owed(d)) {
+			struct timespec t;
+			monotonic_at(wake, &t);
+			stats_syscall(d);
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+			                       &t, NULL) == EINTR)
+				;
+		} else
+#endif
+		{
+			int res = wait_for_fd_activity(d, delay, 0);
+			if (res)
+				return res;
+		}
+	} else if (delay + spin <= 0) {
+		/* Already past the deadline; nothing to measure. */
+		return 1;
+	}
+
+	if (spin)
+		spin_until(d, deadline);
+	return 0;
+}
+
+/* dac_loop(dv)
+ *
+ * Main thread function for sending data to the DAC, when not using the
+ * reactor backend.
+ */
+static void *dac_loop(void *dv) {
+	struct etherdream *d = (struct etherdream *)dv;
+
+	sender_thread_init();
+
+	while (1) {
+		/* Wait for us to have data. The lock is only needed to
+		 * sleep; while frames keep coming, we never touch it. */
+		if (__atomic_load_n(&d->state, __ATOMIC_SEQ_CST) != ST_RUNNING
+		    || !dac_has_work(d)) {
+			pthread_mutex_lock(&d->mutex);
+			if (d->state == ST_RUNNING) {
+				tev(d, ETHERDREAM_EV_IDLE, 0, 0, 0, 0);
+				__atomic_store_n(&d->state, ST_READY,
+				                 __ATOMIC_SEQ_CST);
+			}
+			while (d->state == ST_READY && !dac_has_work(d)) {
+				tev(d, ETHERDREAM_EV_SLEEP, 0, 0, 0, 0);
+				pthread_cond_wait(&d->loop_cond, &d->mutex);
+			}
+			if (d->state == ST_READY)
+				__atomic_store_n(&d->state, ST_RUNNING,
+				                 __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&d->mutex);
+		}
+
+		if (__atomic_load_n(&d->state, __ATOMIC_SEQ_CST) != ST_RUNNING)
+			break;
+
+		long long next;
+		if (dac_service(d, &next) < 0) {
+			if (dac_reconnect(d) < 0)
+				break;
+			continue;
+		}
+
+		if (next < 0)
+			continue;
+
+		int res = dac_sleep_until(d, next);
+		if (res < 0) {
+			if (dac_reconnect(d) < 0)
+				break;
+			continue;
+		}
+		if (res == 0) {
+			stats_begin(d);
+			hist_add(&d->stats.s.sleep_overshoot,
+			         microseconds() - next);
+			stats_end(d);
+		}
+	}
+
+	trace(d, "L: Shutting down.\n");
+	pthread_mutex_lock(&d->mutex);
+	d->state = ST_SHUTDOWN;
+	pthread_cond_broadcast(&d->loop_cond);
+	pthread_mutex_unlock(&d->mutex);
+	return 0;
+}
+
+#ifdef __linux__
+
+/* The reactor backend: instead of a thread per DAC, a small number of
+ * threads each multiplex many DACs with epoll. Every DAC's socket and a
+ * per-DAC timerfd are registered with the reactor's epoll set, so a DAC is
+ * only serviced when an ACK arrives or its send deadline comes due. An
+ * eventfd wakes the reactor when an idle DAC gets a new frame or is being
+ * disconnected.
+ */
+
+#define REACTOR_MAX_THREADS	16
+#define REACTOR_MAX_DACS	64
+
+struct etherdream_reactor {
+	int epoll_fd;
+	int wake_fd;
+	pthread_t thread;
+
+	pthread_mutex_t lock;
+	struct etherdream *dacs[REACTOR_MAX_DACS];
+	int ndacs;
+};
+
+static struct etherdream_reactor reactors[REACTOR_MAX_THREADS];
+static int reactor_count;
+static int reactor_next;
+
+/* reactor_wake(re)
+ *
+ * Make re's thread rescan its DACs.
+ */
+static void reactor_wake(struct etherdream_reactor *re) {
+	uint64_t one = 1;
+	if (write(re->wake_fd, &one, sizeof one) < 0)
+		log_socket_error(NULL, "write eventfd");
+}
+
+/* reactor_arm(d, next)
+ *
+ * Set d's timer to go off at time next, or disarm it if next is -1.
+ */
+static void reactor_arm(struct etherdream *d, long long next) {
+	struct itimerspec its;
+	memset(&its, 0, sizeof its);
+
+	d->timer_deadline = next;
+
+	if (next >= 0) {
+		/* Wake up early by the spin time, and spin the rest. An
+		 * absolute time of zero would disarm the timer. */
+		long long wake = next - __atomic_load_n(&d->spin_usec,
+		                                        __ATOMIC_RELAXED);
+		if (wake < 1)
+			wake = 1;
+		monotonic_at(wake, &its.it_value);
+	}
+
+	stats_syscall(d);
+	timerfd_settime(d->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* reactor_detach(re, d)
+ *
+ * Remove d from re, and let etherdream_disconnect() know that it's gone.
+ * Called only from re's thread.
+ */
+static void reactor_detach(struct etherdream_reactor *re,
+                           struct etherdream *d) {
+	trace(d, "L: Shutting down.\n");
+
+	if (d->conn.dc_sock >= 0)
+		epoll_ctl(re->epoll_fd, EPOLL_CTL_DEL, d->conn.dc_sock, NULL);
+	epoll_ctl(re->epoll_fd, EPOLL_CTL_DEL, d->timer_fd, NULL);
+	close(d->timer_fd);
+
+	pthread_mutex_lock(&re->lock);
+	int i;
+	for (i = 0; i < re->ndacs; i++) {
+		if (re->dacs[i] == d) {
+			re->dacs[i] = re->dacs[--re->ndacs];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&re->lock);
+
+	pthread_mutex_lock(&d->mutex);
+	d->state = ST_SHUTDOWN;
+	d->reactor_attached = 0;
+	pthread_cond_broadcast(&d->loop_cond);
+	pthread_mutex_unlock(&d->mutex);
+}
+
+/* reactor_watch(re, d, events)
+ *
+ * Have re watch d's socket for events. The socket may be new, or reuse the
+ * number of one that was closed (which also took it out of the epoll set).
+ */
+static void reactor_watch(struct etherdream_reactor *re, struct etherdream *d,
+                          uint32_t events) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof ev);
+	ev.events = events;
+	ev.data.ptr = d;
+
+	if (epoll_ctl(re->epoll_fd, EPOLL_CTL_MOD, d->conn.dc_sock, &ev) < 0
+	    && (errno != ENOENT
+	        || epoll_ctl(re->epoll_fd, EPOLL_CTL_ADD, d->conn.dc_sock,
+	                     &ev) < 0))
+		log_socket_error(d, "epoll_ctl");
+}
+
+static void reactor_service(struct etherdream_reactor *re,
+                            struct etherdream *d);
+
+/* reactor_reconnect(re, d)
+ *
+ * The reactor's way of reconnecting: take d's reconnection one step at a
+ * time, as its socket or timer fire, so as not to hold up the other DACs.
+ */
+static void reactor_reconnect(struct etherdream_reactor *re,
+                              struct etherdream *d) {
+	long long next;
+	int res = dac_reconnect_step(d, &next);
+
+	if (res < 0) {
+		reactor_detach(re, d);
+		return;
+	}
+
+	if (d->conn.dc_sock >= 0)
+		reactor_watch(re, d, res > 0 ? EPOLLIN
+		                   : dac_connect_events(d) == POLLOUT ? EPOLLOUT
+		                   : EPOLLIN);
+
+	if (res > 0)
+		reactor_service(re, d);
+	else
+		reactor_arm(d, next);
+}
+
+/* reactor_service(re, d)
+ *
+ * Run d's send logic, then either arm its timer for the next deadline or
+ * leave it idle until a new frame comes in.
+ */
+static void reactor_service(struct etherdream_reactor *re,
+                            struct etherdream *d) {
+	long long next;
+
+	while (1) {
+		if (dac_service(d, &next) < 0) {
+			if (dac_lost(d) < 0)
+				reactor_detach(re, d);
+			else
+				reactor_reconnect(re, d);
+			return;
+		}
 
-			expected_fullness =
-				  d->conn.resp.dac_status.buffer_fullness
-				+ d->conn.unacked_points - expected_used;
+		if (next < 0) {
+			if (dac_set_idle(d) || __atomic_load_n(&d->state,
+			                       __ATOMIC_SEQ_CST) != ST_RUNNING)
+				break;
+			continue;
+		}
 
-			/* Now, see how much data we should write. */
-			cap = 1700 - expected_fullness;
+		if (next > microseconds())
+			break;
+	}
 
-			if (cap > MIN_SEND_POINTS)
-				break;
-			if (d->conn.resp.dac_status.playback_state != 2) {
-				microsleep(1000);
-				break;
+	reactor_arm(d, next);
+}
+
+/* reactor_idle(re, d)
+ *
+ * d's socket is readable but it has nothing to send: the ACKs for the last
+ * of what it did send, or the DAC closing the connection. Take them in, as
+ * the socket would otherwise stay readable and keep waking the reactor.
+ */
+static void reactor_idle(struct etherdream_reactor *re, struct etherdream *d) {
+	if (dac_read_acks(d) < 0) {
+		if (dac_lost(d) < 0)
+			reactor_detach(re, d);
+		else
+			reactor_reconnect(re, d);
+	}
+}
+
+/* reactor_scan(re)
+ *
+ * Handle a wakeup: start any idle DACs that have new frames, and drop any
+ * that are being disconnected.
+ */
+static void reactor_scan(struct etherdream_reactor *re) {
+	struct etherdream *list[REACTOR_MAX_DACS];
+	int i, n;
+
+	pthread_mutex_lock(&re->lock);
+	n = re->ndacs;
+	memcpy(list, re->dacs, n * sizeof list[0]);
+	pthread_mutex_unlock(&re->lock);
+
+	for (i = 0; i < n; i++) {
+		struct etherdream *d = list[i];
+		int state = __atomic_load_n(&d->state, __ATOMIC_SEQ_CST);
+
+		if (state == ST_SHUTDOWN) {
+			reactor_detach(re, d);
+		} else if (state == ST_READY && dac_has_work(d)) {
+			pthread_mutex_lock(&d->mutex);
+			if (d->state == ST_READY)
+				__atomic_store_n(&d->state, ST_RUNNING,
+				                 __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&d->mutex);
+			reactor_service(re, d);
+		}
+	}
+}
+
+/* reactor_loop(rv)
+ *
+ * Thread function for a reactor.
+ */
+static void *reactor_loop(void *rv) {
+	struct etherdream_reactor *re = (struct etherdream_reactor *)rv;
+	struct epoll_event events[REACTOR_MAX_DACS];
+
+	sender_thread_init();
+
+	while (1) {
+		int i, n = epoll_wait(re->epoll_fd, events, REACTOR_MAX_DACS, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			log_socket_error(NULL, "epoll_wait");
+			return NULL;
+		}
+
+		for (i = 0; i < n; i++) {
+			struct etherdream *d = events[i].data.ptr;
+			uint64_t count;
+
+			if (!d) {
+				if (read(re->wake_fd, &count, sizeof count) < 0)
+					log_socket_error(NULL, "read eventfd");
+				reactor_scan(re);
+				continue;
+			}
+
+			/* d may have been detached by a scan earlier in
+			 * this batch, and its timer closed. */
+			if (!d->reactor_attached)
+				continue;
+
+			/* Either the socket or the timer fired; clear the
+			 * timer in case it was the latter. */
+			stats_syscall(d);
+			if (read(d->timer_fd, &count, sizeof count) < 0) {
+				if (errno != EAGAIN)
+					log_socket_error(d, "read timerfd");
+			} else if (d->timer_deadline >= 0) {
+				if (__atomic_load_n(&d->spin_usec,
+				                    __ATOMIC_RELAXED))
+					spin_until(d, d->timer_deadline);
+				stats_begin(d);
+				hist_add(&d->stats.s.sleep_overshoot,
+				         microseconds() - d->timer_deadline);
+				stats_end(d);
+			}
+
+			int state = __atomic_load_n(&d->state,
+			                            __ATOMIC_SEQ_CST);
+			if (d->reconnecting)
+				reactor_reconnect(re, d);
+			else if (state == ST_RUNNING)
+				reactor_service(re, d);
+			else if (state == ST_READY)
+				reactor_idle(re, d);
+		}
+	}
+
+	return NULL;
+}
+
+/* reactor_attach(d)
+ *
+ * Hand a newly-connected d over to one of the reactors. Returns 0 on success,
+ * -1 on failure.
+ */
+static int reactor_attach(struct etherdream *d) {
+	struct etherdream_reactor *re = &reactors[reactor_next++ % reactor_count];
+	struct epoll_event ev;
+
+	d->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (d->timer_fd < 0) {
+		log_socket_error(d, "timerfd_create");
+		return -1;
+	}
+
+	pthread_mutex_lock(&re->lock);
+	if (re->ndacs == REACTOR_MAX_DACS) {
+		pthread_mutex_unlock(&re->lock);
+		trace(d, "!! Too many DACs for reactor.\n");
+		close(d->timer_fd);
+		return -1;
+	}
+	re->dacs[re->ndacs++] = d;
+	d->reactor = re;
+	d->reactor_attached = 1;
+	pthread_mutex_unlock(&re->lock);
+
+	memset(&ev, 0, sizeof ev);
+	ev.events = EPOLLIN;
+	ev.data.ptr = d;
+	if (epoll_ctl(re->epoll_fd, EPOLL_CTL_ADD, d->conn.dc_sock, &ev) < 0
+	    || epoll_ctl(re->epoll_fd, EPOLL_CTL_ADD, d->timer_fd, &ev) < 0) {
+		log_socket_error(d, "epoll_ctl");
+		reactor_detach(re, d);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* etherdream_reactor_start(nthreads)
+ *
+ * Documented in etherdream.h.
+ */
+int etherdream_reactor_start(int nthreads) {
+	if (reactor_count)
+		return 0;
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > REACTOR_MAX_THREADS)
+		nthreads = REACTOR_MAX_THREADS;
+
+	int i;
+	for (i = 0; i < nthreads; i++) {
+		struct etherdream_reactor *re = &reactors[i];
+		struct epoll_event ev;
+
+		pthread_mutex_init(&re->lock, NULL);
+		re->epoll_fd = epoll_create1(0);
+		re->wake_fd = eventfd(0, EFD_NONBLOCK);
+		if (re->epoll_fd < 0 || re->wake_fd < 0) {
+			log_socket_error(NULL, "epoll_create1/eventfd");
+			return -1;
+		}
+
+		memset(&ev, 0, sizeof ev);
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(re->epoll_fd, EPOLL_CTL_ADD, re->wake_fd, &ev) < 0) {
+			log_socket_error(NULL, "epoll_ctl");
+			return -1;
+		}
+
+		int res = pthread_create(&re->thread, NULL, reactor_loop, re);
+		if (res) {
+			trace(NULL, "!! Reactor thread error: %s\n", strerror(res));
+			return -1;
+		}
+	}
+
+	reactor_count = nthreads;
+	trace(NULL, "== reactor started with %d threads ==\n", nthreads);
+	return 0;
+}
+
+#else
+
+static const int reactor_count = 0;
+
+static void reactor_wake(struct etherdream_reactor *re) {
+	(void)re;
+}
+
+static int reactor_attach(struct etherdream *d) {
+	(void)d;
+	return -1;
+}
+
+int etherdream_reactor_start(int nthreads) {
+	(void)nthreads;
+	trace(NULL, "!! reactor backend requires epoll\n");
+	return -1;
+}
+
+#endif
+
+/* dac_kick(d)
+ *
+ * Wake d's sender if it is idle, so that it notices new work.
+ */
+static void dac_kick(struct etherdream *d) {
+	if (__atomic_load_n(&d->state, __ATOMIC_SEQ_CST) != ST_READY)
+		return;
+
+	if (d->reactor) {
+		reactor_wake(d->reactor);
+	} else {
+		pthread_mutex_lock(&d->mutex);
+		pthread_cond_signal(&d->loop_cond);
+		pthread_mutex_unlock(&d->mutex);
+	}
+}
+
+/* dac_size_buffers(d)
+ *
+ * Work out d's buffer limits and how big its point ring should be from the
+ * capabilities in its last broadcast.
+ */
+static void dac_size_buffers(struct etherdream *d) {
+	pthread_mutex_lock(&dac_list_lock);
+	int points = d->broadcast.buffer_capacity + 1;
+	int max_rate = d->broadcast.max_point_rate;
+	pthread_mutex_unlock(&dac_list_lock);
+
+	/* The DAC reports one less than its buffer size, since it can never
+	 * quite fill it. */
+	if (points <= 1)
+		points = DEFAULT_BUFFER_POINTS;
+	if (!max_rate)
+		max_rate = DEFAULT_MAX_POINT_RATE;
+
+	d->buffer_max = points - points / BUFFER_HEADROOM_DIV;
+	d->min_send = points / MIN_SEND_DIV;
+	if (d->min_send < 1)
+		d->min_send = 1;
+
+	/* The ring has to hold two of the largest frames, and at least
+	 * RING_TIME worth of points at the fastest rate the DAC can play. */
+	unsigned int ring = RING_MIN_POINTS;
+	while (ring < (long long)max_rate * RING_TIME / 1000000)
+		ring *= 2;
+
+	if (d->ring.points && ring != d->ring.mask + 1) {
+		free(d->ring.points);
+		d->ring.points = NULL;
+	}
+	d->ring.mask = ring - 1;
+
+	trace(d, "Buffer of %d points, %d pps max: target %d, ring %u\n",
+	      points, max_rate, d->buffer_max, ring);
+}
+
+/* dac_alloc_buffers(d)
+ *
+ * Allocate d's point ring and the other buffers that are only needed once
+ * it is connected, if that hasn't been done already. Returns 0 on success,
+ * -1 on failure.
+ */
+static int dac_alloc_buffers(struct etherdream *d) {
+	if (!d->ring.points)
+		d->ring.points = calloc(d->ring.mask + 1,
+		                        sizeof *d->ring.points);
+	if (!d->callback_buf)
+		d->callback_buf = calloc(CALLBACK_MAX_POINTS,
+		                         sizeof *d->callback_buf);
+	if (!d->shared_buf)
+		d->shared_buf = calloc(SHARED_XFORM_POINTS,
+		                       sizeof *d->shared_buf);
+	if (!d->trace.ev)
+		d->trace.ev = calloc(TRACE_EVENTS, sizeof *d->trace.ev);
+
+	if (!d->ring.points || !d->callback_buf || !d->shared_buf
+	    || !d->trace.ev) {
+		trace(d, "!! malloc(point ring) failed\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* dac_connect_begin(d)
+ *
+ * Get d ready to connect, and start connecting. Returns 0 on success, -1 on
+ * failure.
+ */
+static int dac_connect_begin(struct etherdream *d) {
+	trace(d, "L: Connecting.\n");
+
+	dac_size_buffers(d);
+	if (dac_alloc_buffers(d) < 0)
+		return -1;
+
+	// Initialize buffer
+	struct etherdream_ring *r = &d->ring;
+	ring_drop_shared(r, r->frame_tail, r->frame_head);
+	r->head = r->reserved = r->frame_head = 0;
+	r->tail = r->frame_tail = 0;
+	r->cur_valid = r->idx = r->repeat_left = 0;
+	d->stop_requested = 0;
+	d->auto_latency = d->auto_min = 0;
+
+	return dac_connect_start(d);
+}
+
+/* dac_connect_finish(d)
+ *
+ * Called once d's handshake is done: hand it to its sender. Returns 0 on
+ * success, -1 on failure.
+ */
+static int dac_connect_finish(struct etherdream *d) {
+	d->state = ST_READY;
+
+	if (reactor_count) {
+		if (reactor_attach(d) < 0) {
+			close(d->conn.dc_sock);
+			return -1;
+		}
+	} else {
+		int res = pthread_create(&d->workerthread, NULL, dac_loop, d);
+		if (res) {
+			trace(d, "!! Begin thread error: %s\n", strerror(res));
+			close(d->conn.dc_sock);
+			return -1;
+		}
+	}
+
+	trace(d, "Ready.\n");
+
+	return 0;
+}
+
+/* etherdream_connect_many(dacs, n, results)
+ *
+ * Documented in etherdream.h.
+ */
+int etherdream_connect_many(struct etherdream **dacs, int n, int *results) {
+	struct pollfd *fds = calloc(n, sizeof *fds);
+	int *pending = calloc(n, sizeof *pending);
+	int i, npending = 0, connected = 0;
+
+	if (!fds || !pending) {
+		trace(NULL, "!! malloc(connect state) failed\n");
+		free(fds);
+		free(pending);
+		for (i = 0; i < n; i++)
+			results[i] = -1;
+		return 0;
+	}
+
+	/* The application got these from etherdream_get(), which pinned
+	 * them already, but make sure. */
+	pthread_mutex_lock(&dac_list_lock);
+	for (i = 0; i < n; i++)
+		dacs[i]->pinned = 1;
+	pthread_mutex_unlock(&dac_list_lock);
+
+	for (i = 0; i < n; i++) {
+		results[i] = -1;
+		if (dac_connect_begin(dacs[i]) < 0)
+			trace(dacs[i], "!! DAC connection failed.\n");
+		else
+			pending[npending++] = i;
+	}
+
+	while (npending) {
+		long long now = microseconds(), deadline = -1;
+		int j, k;
+
+		for (j = 0; j < npending; j++) {
+			struct etherdream *d = dacs[pending[j]];
+			fds[j].fd = d->conn.dc_sock;
+			fds[j].events = dac_connect_events(d);
+			fds[j].revents = 0;
+			if (deadline < 0 || d->conn.dc_connect_deadline < deadline)
+				deadline = d->conn.dc_connect_deadline;
+		}
+
+		int timeout = deadline > now ? (deadline - now + 999) / 1000 : 0;
+		if (poll(fds, npending, timeout) < 0 && errno != EINTR) {
+			log_socket_error(NULL, "poll");
+			for (j = 0; j < npending; j++)
+				close(dacs[pending[j]]->conn.dc_sock);
+			break;
+		}
+
+		now = microseconds();
+		for (j = k = 0; j < npending; j++) {
+			struct etherdream *d = dacs[pending[j]];
+			int res = 0;
+
+			if (fds[j].revents)
+				res = dac_connect_step(d);
+			if (res == 0 && now > d->conn.dc_connect_deadline) {
+				trace(d, "Connection to %s timed out.\n",
+				      inet_ntoa(d->addr));
+				close(d->conn.dc_sock);
+				res = -1;
+			}
+
+			if (res == 0) {
+				pending[k++] = pending[j];
+			} else if (res < 0) {
+				trace(d, "!! DAC connection failed.\n");
+			} else if (dac_connect_finish(d) == 0) {
+				results[pending[j]] = 0;
+				connected++;
 			}
+		}
+		npending = k;
+	}
+
+	free(fds);
+	free(pending);
+	return connected;
+}
+
+int etherdream_connect(struct etherdream *d) {
+	int res;
+	etherdream_connect_many(&d, 1, &res);
+	return res;
+}
+
+void etherdream_disconnect(struct etherdream *d) {
+	trace(d, "L: Disconnecting.\n");
+
+	pthread_mutex_lock(&d->mutex);
+	d->state = ST_SHUTDOWN;
+	pthread_cond_broadcast(&d->loop_cond);
+	if (d->reactor) {
+		/* The reactor will notice and detach d. */
+		reactor_wake(d->reactor);
+		while (d->reactor_attached)
+			pthread_cond_wait(&d->loop_cond, &d->mutex);
+		pthread_mutex_unlock(&d->mutex);
+	} else {
+		pthread_mutex_unlock(&d->mutex);
+		pthread_join(d->workerthread, NULL);
+	}
+
+	if (d->conn.dc_sock >= 0)
+		close(d->conn.dc_sock);
+	d->conn.dc_sock = -1;
+}
+
+/* etherdream_get_id(d)
+ *
+ * Documented in etherdream.h.
+ */
+unsigned long etherdream_get_id(struct etherdream *d) {
+	return d->dac_id;
+}
+
+/* etherdream_get_in_addr(d)
+ *
+ * Documented in etherdream.h.
+ */
+const struct in_addr *etherdream_get_in_addr(struct etherdream *d) {
+    return &d->addr;
+}
+
+/* etherdream_ring_reserve(d, max, pts)
+ *
+ * Documented in etherdream.h.
+ */
+int etherdream_ring_reserve(struct etherdream *d, int max,
+                            struct dac_point **pts) {
+	struct etherdream_ring *r = &d->ring;
+
+	if (max <= 0)
+		return 0;
+
+	unsigned int frame_tail = __atomic_load_n(&r->frame_tail,
+	                                          __ATOMIC_ACQUIRE);
+	if (r->frame_head - frame_tail >= RING_FRAMES)
+		return 0;
+
+	unsigned int pos = r->head + r->reserved;
+	unsigned int n = ring_points_free(r);
+	unsigned int contig = r->mask + 1 - (pos & r->mask);
+
+	if (n > contig)
+		n = contig;
+	if (n > (unsigned int)max)
+		n = max;
+
+	*pts = &r->points[pos & r->mask];
+	r->reserved += n;
+	return n;
+}
+
+/* etherdream_ring_commit(d, pps, repeatcount)
+ *
+ * Documented in etherdream.h.
+ */
+int etherdream_ring_commit(struct etherdream *d, int pps, int repeatcount) {
+	struct etherdream_ring *r = &d->ring;
+
+	/* Ignore empty and 0-repeat frames */
+	if (!r->reserved || !repeatcount) {
+		r->reserved = 0;
+		return 0;
+	}
+
+	struct ring_frame *f = &r->frames[r->frame_head & RING_FRAME_MASK];
+	f->start = r->head;
+	f->points = r->reserved;
+	f->pps = pps;
+	f->repeatcount = repeatcount;
+	f->shared = NULL;
+
+	r->head += r->reserved;
+	r->reserved = 0;
+	__atomic_store_n(&r->frame_head, r->frame_head + 1, __ATOMIC_SEQ_CST);
+
+	/* Kick the writing thread if it went idle. If it hasn't, it will see
+	 * the new frame on its own. */
+	dac_kick(d);
+
+	return 0;
+}
+
+/* etherdream_ring_wait(d, npts)
+ *
+ * Documented in etherdream.h.
+ */
+int etherdream_ring_wait(struct etherdream *d, int npts) {
+	struct etherdream_ring *r = &d->ring;
+
+	pthread_mutex_lock(&d->mutex);
+	__atomic_add_fetch(&d->waiters, 1, __ATOMIC_SEQ_CST);
+	while ((ring_points_free(r) < (unsigned int)npts
+	        || ring_frames_queued(r) >= RING_FRAMES)
+	       && d->state != ST_SHUTDOWN) {
+		pthread_cond_wait(&d->loop_cond, &d->mutex);
+	}
+	__atomic_sub_fetch(&d->waiters, 1, __ATOMIC_SEQ_CST);
+	int is_shutdown = (d->state == ST_SHUTDOWN);
+	pthread_mutex_unlock(&d->mutex);
+
+	return is_shutdown ? -1 : 0;
+}
+
+/* etherdream_set_callback(d, pps, cb, user)
+ *
+ * Documented in etherdream.h.
+ */
+int etherdream_set_callback(struct etherdream *d, int pps,
+                            etherdream_callback cb, void *user) {
+	if (cb && pps <= 0)
+		return -1;
+
+	if (cb) {
+		d->callback_user = user;
+		d->callback_pps = pps;
+	}
+	__atomic_store_n(&d->callback, cb, __ATOMIC_SEQ_CST);
+
+	dac_kick(d);
+	return 0;
+}
+
+/* etherdream_set_source(d, pps, src, user)
+ *
+ * Documented in etherdream.h.
+ */
+int etherdream_set_source(struct etherdream *d, int pps,
+                          etherdream_source src, void *user) {
+	if (src && pps <= 0)
+		return -1;
+
+	if (src) {
+		d->callback_user = user;
+		d->callback_pps = pps;
+	}
+	__atomic_store_n(&d->source, src, __ATOMIC_SEQ_CST);
+
+	dac_kick(d);
+	return 0;
+}
+
+/* etherdream_set_latency(d, usec)
+ *
+ * Documented in etherdream.h.
+ */
+int etherdream_set_latency(struct etherdream *d, int usec) {
+	if (usec < 0 && usec != ETHERDREAM_LATENCY_AUTO)
+		return -1;
+	__atomic_store_n(&d->latency_target, usec, __ATOMIC_RELAXED);
+	return 0;
+}
 
-			/* Wait a little. */
-			int diff = MIN_SEND_POINTS - cap;
-			int wait_time = 500 + (1000000L * diff / b->pps);
+/* etherdream_set_spin(d, usec)
+ *
+ * Documented in etherdream.h.
+ */
+int etherdream_set_spin(struct etherdream *d, int usec) {
+	if (usec < 0 || usec > SPIN_MAX)
+		return -1;
+	__atomic_store_n(&d->spin_usec, usec, __ATOMIC_RELAXED);
+	return 0;
+}
 
-			if (SHOULD_TRACE())
-				trace(d, "L: st %d om %d; b %d + %d - %d = %d"
-					" -> c %d, wait %d us\n",
-					d->conn.resp.dac_status.playback_state,
-					d->conn.pending_meta_acks,
-					d->conn.resp.dac_status.buffer_fullness,
-					d->conn.unacked_points, expected_used,
-					expected_fullness, cap, wait_time);
+/* etherdream_set_reconnect(d, usec)
+ *
+ * Documented in etherdream.h.
+ */
+int etherdream_set_reconnect(struct etherdream *d, int usec) {
+	if (usec < 0)
+		return -1;
+	__atomic_store_n(&d->reconnect_window, usec, __ATOMIC_RELAXED);
+	return 0;
+}
 
-			microsleep(wait_time);
+/* etherdream_set_latest_frame(d, enable)
+ *
+ * Documented in etherdream.h.
+ */
+void etherdream_set_latest_frame(struct etherdream *d, int enable) {
+	__atomic_store_n(&d->latest_frame, !!enable, __ATOMIC_RELAXED);
+	if (enable)
+		wake_waiters(d);
+}
 
-			if ((res = dac_get_acks(d, 0)) < 0)
-				break;
-		}
+/* etherdream_set_transform(d, t)
+ *
+ * Documented in etherdream.h.
+ */
+void etherdream_set_transform(struct etherdream *d,
+                              const struct etherdream_transform *t) {
+	if (t)
+		d->transform = *t;
+	d->transform_set = (t != NULL);
+}
 
-		if (res < 0)
-			break;
+/* etherdream_group_create(dacs, n)
+ *
+ * Documented in etherdream.h.
+ */
+struct etherdream_group *etherdream_group_create(struct etherdream **dacs,
+                                                 int n) {
+	if (n < 1 || n > GROUP_MAX)
+		return NULL;
 
-		/* How many points can we send? */
-		int b_left = b->points - b->idx;
+	struct etherdream_group *g = calloc(1, sizeof *g);
+	if (!g) {
+		trace(NULL, "!! malloc(struct etherdream_group) failed\n");
+		return NULL;
+	}
 
-		if (cap > b_left)
-			cap = b_left;
-		if (cap > 80)
-			cap = 80;
-
-		if (SHOULD_TRACE())
-			trace(d, "L: st %d om %d; b %d + %d - %d = %d"
-				" -> write %d\n",
-				d->conn.resp.dac_status.playback_state,
-				d->conn.pending_meta_acks,
-				d->conn.resp.dac_status.buffer_fullness,
-				d->conn.unacked_points, expected_used,
-				expected_fullness, cap);
-
-		res = dac_send_data(d, b->data + b->idx, cap, b->pps);
-		if (res < 0)
-			break;
+	pthread_mutex_init(&g->lock, NULL);
+	g->n = n;
 
-		pthread_mutex_lock(&d->mutex);
+	int i;
+	for (i = 0; i < n; i++) {
+		g->members[i].d = dacs[i];
+		dacs[i]->group_slot = i;
+		dacs[i]->group_primed = 0;
+		dacs[i]->group_reseed = 0;
+		dacs[i]->group_offset = 0;
+		dacs[i]->rate_trim = 0;
+		__atomic_store_n(&dacs[i]->group, g, __ATOMIC_RELEASE);
+	}
 
-		/* What next? */
-		b->idx += cap;
+	return g;
+}
 
-		if (b->idx < b->points) {
-			/* There's more in this frame. */
+/* etherdream_group_offsets(g, offsets)
+ *
+ * Documented in etherdream.h.
+ */
+int etherdream_group_offsets(struct etherdream_group *g, int *offsets) {
+	long long now = microseconds();
+	double pos[GROUP_MAX], sum = 0;
+	int i, count = 0;
+
+	pthread_mutex_lock(&g->lock);
+	for (i = 0; i < g->n; i++) {
+		struct group_member *m = &g->members[i];
+		if (!m->valid)
 			continue;
-		}
+		pos[i] = m->count + m->rate * (now - m->ref_time);
+		sum += pos[i];
+		count++;
+	}
+	for (i = 0; i < g->n; i++) {
+		if (g->members[i].valid)
+			offsets[i] = (int)(pos[i] - sum / count);
+		else
+			offsets[i] = 0;
+	}
+	pthread_mutex_unlock(&g->lock);
 
-		b->idx = 0;
+	return count == g->n ? 0 : -1;
+}
 
-		if (b->repeatcount > 1) {
-			/* Play this frame again? */
-			b->repeatcount--;
-		} else if (d->frame_buffer_fullness > 1) {
-			/* Move to the next frame */
-			d->frame_buffer_fullness--;
-			d->frame_buffer_read++;
-			if (d->frame_buffer_read >= BUFFER_NFRAMES)
-				d->frame_buffer_read = 0;
-			pthread_cond_broadcast(&d->loop_cond);
-		} else if (b->repeatcount >= 0) {
-			/* Stop playing until we get a new frame. */
-			trace(d, "L: returning to idle\n");
-			d->state = ST_READY;
-		} else {
-			/* repeatcount is negative and there's no new frame,
-			 * so just play this one over again. */
-		}
+/* etherdream_group_destroy(g)
+ *
+ * Documented in etherdream.h.
+ */
+void etherdream_group_destroy(struct etherdream_group *g) {
+	int i;
+	for (i = 0; i < g->n; i++) {
+		__atomic_store_n(&g->members[i].d->group, NULL, __ATOMIC_RELEASE);
+		g->members[i].d->rate_trim = 0;
 	}
+	pthread_mutex_destroy(&g->lock);
+	free(g);
+}
 
-	trace(d, "L: Shutting down.\n");
-	d->state = ST_SHUTDOWN;
-	pthread_cond_broadcast(&d->loop_cond);
-	return 0;
+/* etherdream_get_stats(d, stats)
+ *
+ * Documented in etherdream.h.
+ */
+void etherdream_get_stats(struct etherdream *d,
+                          struct etherdream_stats *stats) {
+	unsigned int seq;
+
+	do {
+		seq = __atomic_load_n(&d->stats.seq, __ATOMIC_ACQUIRE);
+		memcpy(stats, &d->stats.s, sizeof *stats);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1)
+	         || seq != __atomic_load_n(&d->stats.seq, __ATOMIC_RELAXED));
 }
 
-int etherdream_connect(struct etherdream *d) {
-	trace(d, "L: Connecting.\n");
+/* etherdream_trace_read(d, events, max)
+ *
+ * Documented in etherdream.h.
+ */
+int etherdream_trace_read(struct etherdream *d,
+                          struct etherdream_trace_event *events, int max) {
+	unsigned int head = __atomic_load_n(&d->trace.head, __ATOMIC_ACQUIRE);
+	unsigned int n = head < TRACE_EVENTS ? head : TRACE_EVENTS;
+	int count = 0;
 
-	// Initialize buffer
-	d->frame_buffer_read = 0;
-	d->frame_buffer_fullness = 0;
-	memset(d->buffer, 0, sizeof(d->buffer));
+	if (!d->trace.ev)
+		return 0;
 
-	// Connect to the DAC
-	if (dac_connect(d) < 0) {
-		trace(d, "!! DAC connection failed.\n");
-		return -1;
-	}
+	if (max < 0)
+		max = 0;
+	if (n > (unsigned int)max)
+		n = max;
 
-	d->state = ST_READY;
+	unsigned int i;
+	for (i = head - n; i != head; i++) {
+		const struct etherdream_trace_event *ev =
+			&d->trace.ev[i & TRACE_MASK];
 
-	int res = pthread_create(&d->workerthread, NULL, dac_loop, d);
-	if (res) {
-		trace(d, "!! Begin thread error: %s\n", strerror(res));
-		return -1;
+		if (__atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE) != i + 1)
+			continue;
+		events[count] = *ev;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&ev->seq, __ATOMIC_RELAXED) != i + 1)
+			continue;
+		count++;
 	}
 
-	trace(d, "Ready.\n");
-
-	return 0;
+	return count;
 }
 
-void etherdream_disconnect(struct etherdream *d) {
-	trace(d, "L: Disconnecting.\n");
-
-	pthread_mutex_lock(&d->mutex);
-	if (d->state == ST_READY)
-		pthread_cond_broadcast(&d->loop_cond);
-	d->state = ST_SHUTDOWN;
-	pthread_mutex_unlock(&d->mutex);
-
-	pthread_join(d->workerthread, NULL);
-	close(d->conn.dc_sock);
-}
+static const char *const trace_formats[] = {
+	[ETHERDREAM_EV_SEND] = "send %d points, fullness %d, rate %d, "
+	                       "unacked %d",
+	[ETHERDREAM_EV_WAIT] = "wait: room %d, fullness %d, for %d us, "
+	                       "unacked %d",
+	[ETHERDREAM_EV_ACK] = "ack '%c': buffer %d, count %d, state %d",
+	[ETHERDREAM_EV_PREPARE] = "prepare",
+	[ETHERDREAM_EV_PREPARE_ACK] = "prepare ACKed",
+	[ETHERDREAM_EV_BEGIN] = "begin at %d pps, buffer %d",
+	[ETHERDREAM_EV_PULL] = "pull %d points, got %d, index %d",
+	[ETHERDREAM_EV_IDLE] = "returning to idle",
+	[ETHERDREAM_EV_SLEEP] = "waiting for frames",
+	[ETHERDREAM_EV_NOT_READY] = "write not ready: %d points, %d reps",
+	[ETHERDREAM_EV_GROUP_START] = "all %d group members primed, "
+	                              "starting in %d us",
+	[ETHERDREAM_EV_RETUNE] = "latency target %d us, floor %d us, "
+	                         "underflow %d",
+	[ETHERDREAM_EV_SKIP] = "skipped %d stale frames",
+	[ETHERDREAM_EV_LOST] = "connection lost: buffer %d, state %d",
+	[ETHERDREAM_EV_RECONNECT] = "reconnected after %d us",
+};
 
-/* etherdream_get_id(d)
+/* etherdream_trace_dump(d, fp)
  *
  * Documented in etherdream.h.
  */
-unsigned long etherdream_get_id(struct etherdream *d) {
-	return d->dac_id;
+void etherdream_trace_dump(struct etherdream *d, FILE *fp) {
+	static struct etherdream_trace_event events[TRACE_EVENTS];
+	static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+	int i, n;
+
+	pthread_mutex_lock(&dump_lock);
+	n = etherdream_trace_read(d, events, TRACE_EVENTS);
+
+	for (i = 0; i < n; i++) {
+		const struct etherdream_trace_event *ev = &events[i];
+		const char *fmt = NULL;
+
+		if (ev->id < sizeof trace_formats / sizeof trace_formats[0])
+			fmt = trace_formats[ev->id];
+
+		fprintf(fp, "[%d.%06d] %06lx ", (int)(ev->time / 1000000),
+		        (int)(ev->time % 1000000), d->dac_id);
+		if (fmt)
+			fprintf(fp, fmt, ev->arg[0], ev->arg[1], ev->arg[2],
+			        ev->arg[3]);
+		else
+			fprintf(fp, "event %d: %d %d %d %d", ev->id,
+			        ev->arg[0], ev->arg[1], ev->arg[2], ev->arg[3]);
+		fputc('\n', fp);
+	}
+
+	pthread_mutex_unlock(&dump_lock);
 }
 
-/* etherdream_get_in_addr(d)
+/* etherdream_time_us()
  *
  * Documented in etherdream.h.
  */
-const struct in_addr *etherdream_get_in_addr(struct etherdream *d) {
-    return &d->addr;
+long long etherdream_time_us(void) {
+	return microseconds();
 }
 
 /* etherdream_write(d, pts, npts, pps, reps)
@@ -727,48 +3680,90 @@ int etherdream_write(struct etherdream *d, const struct etherdream_point *pts,
 	if (!reps)
 		return 0;
 
-	pthread_mutex_lock(&d->mutex);
-
-	/* If not ready for a new frame, bail */
-	if (d->frame_buffer_fullness == BUFFER_NFRAMES) {
-		pthread_mutex_unlock(&d->mutex);
-		trace(d, "M: NOT READY: %d points, %d reps\n", npts, reps);
+	/* In latest-frame mode, make room by dropping frames that would
+	 * only have been skipped. Otherwise, if there's no room for the
+	 * whole frame, bail. */
+	if ((ring_points_free(&d->ring) < (unsigned int)npts
+	     || ring_frames_queued(&d->ring) >= RING_FRAMES)
+	    && __atomic_load_n(&d->latest_frame, __ATOMIC_RELAXED))
+		ring_reclaim(d);
+
+	if (ring_points_free(&d->ring) < (unsigned int)npts
+	    || ring_frames_queued(&d->ring) >= RING_FRAMES) {
+		tev(d, ETHERDREAM_EV_NOT_READY, npts, reps, 0, 0);
 		return -1;
 	}
 
-	struct buffer_item *next = &d->buffer[(d->frame_buffer_read
-	                         + d->frame_buffer_fullness) % BUFFER_NFRAMES];
+	/* XXX: automatically pad out small frames */
+
+	ring_write_points(d, pts, npts);
+	return etherdream_ring_commit(d, pps, reps);
+}
 
-	pthread_mutex_unlock(&d->mutex);
+/* etherdream_frame_create(pts, npts)
+ *
+ * Documented in etherdream.h.
+ */
+struct etherdream_frame *etherdream_frame_create(
+		const struct etherdream_point *pts, int npts) {
+	if (npts < 1 || npts > BUFFER_POINTS_PER_FRAME)
+		return NULL;
 
-	// trace(d, "M: Writing: %d points, %d reps, %d pps\n", npts, reps, pps);
+	struct etherdream_frame *f = malloc(sizeof *f
+	                                    + npts * sizeof *f->points);
+	if (!f)
+		return NULL;
 
-	/* XXX: automatically pad out small frames */
+	f->refs = 1;
+	f->npoints = npts;
+	etherdream_convert(f->points, pts, npts, NULL);
+	return f;
+}
 
-	int i;
-	for (i = 0; i < npts; i++) {
-		next->data[i].x = pts[i].x;
-		next->data[i].y = pts[i].y;
-		next->data[i].r = pts[i].r;
-		next->data[i].g = pts[i].g;
-		next->data[i].b = pts[i].b;
-		next->data[i].i = pts[i].i;
-		next->data[i].u1 = pts[i].u1; 
-		next->data[i].u2 = pts[i].u2;
-		next->data[i].control = 0;
-	}
-
-	next->pps = pps;
-	next->repeatcount = reps;
-	next->points = npts;
-
-	/* Advance buffer and signal the writing thread if necessary */
-	pthread_mutex_lock(&d->mutex);
-	d->frame_buffer_fullness++;
-	if (d->state == ST_READY)
-		pthread_cond_signal(&d->loop_cond);
-	d->state = ST_RUNNING;
-	pthread_mutex_unlock(&d->mutex);
+/* etherdream_frame_release(f)
+ *
+ * Documented in etherdream.h.
+ */
+void etherdream_frame_release(struct etherdream_frame *f) {
+	if (f && !__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL))
+		free(f);
+}
+
+/* etherdream_write_frame(d, f, pps, reps)
+ *
+ * Documented in etherdream.h.
+ */
+int etherdream_write_frame(struct etherdream *d, struct etherdream_frame *f,
+                           int pps, int reps) {
+	struct etherdream_ring *r = &d->ring;
+
+	/* Ignore 0-repeat frames */
+	if (!reps)
+		return 0;
+
+	if (ring_frames_queued(r) >= RING_FRAMES
+	    && __atomic_load_n(&d->latest_frame, __ATOMIC_RELAXED))
+		ring_reclaim(d);
+
+	if (ring_frames_queued(r) >= RING_FRAMES) {
+		tev(d, ETHERDREAM_EV_NOT_READY, f->npoints, reps, 0, 0);
+		return -1;
+	}
+
+	__atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+
+	struct ring_frame *rf = &r->frames[r->frame_head & RING_FRAME_MASK];
+	rf->start = r->head;
+	rf->points = f->npoints;
+	rf->pps = pps;
+	rf->repeatcount = reps;
+	rf->shared = f;
+	rf->transform_set = d->transform_set;
+	if (d->transform_set)
+		rf->transform = d->transform;
+
+	__atomic_store_n(&r->frame_head, r->frame_head + 1, __ATOMIC_SEQ_CST);
+	dac_kick(d);
 
 	return 0;
 }
@@ -778,10 +3773,14 @@ int etherdream_write(struct etherdream *d, const struct etherdream_point *pts,
  * Documented in etherdream.h.
  */
 int etherdream_is_ready(struct etherdream *d) {
-	pthread_mutex_lock(&d->mutex);
-	int ready = (d->frame_buffer_fullness != BUFFER_NFRAMES);
-	pthread_mutex_unlock(&d->mutex);
-	return ready;
+	/* Its sender sets ST_SHUTDOWN on the way out, whether it was asked
+	 * to or the connection failed and couldn't be got back. */
+	int state = __atomic_load_n(&d->state, __ATOMIC_SEQ_CST);
+	if (state == ST_DISCONNECTED || state == ST_SHUTDOWN)
+		return -1;
+	if (__atomic_load_n(&d->latest_frame, __ATOMIC_RELAXED))
+		return 1;
+	return ring_frames_queued(&d->ring) < BUFFER_NFRAMES;
 }
 
 /* etherdream_wait_for_ready(d)
@@ -790,10 +3789,15 @@ int etherdream_is_ready(struct etherdream *d) {
  */
 int etherdream_wait_for_ready(struct etherdream *d) {
 	pthread_mutex_lock(&d->mutex);
-	while (d->frame_buffer_fullness == BUFFER_NFRAMES && d->state != ST_SHUTDOWN) {
+	__atomic_add_fetch(&d->waiters, 1, __ATOMIC_SEQ_CST);
+	while (ring_frames_queued(&d->ring) >= BUFFER_NFRAMES
+	       && !__atomic_load_n(&d->latest_frame, __ATOMIC_RELAXED)
+	       && d->state != ST_SHUTDOWN && d->state != ST_DISCONNECTED) {
 		pthread_cond_wait(&d->loop_cond, &d->mutex);
 	}
-	int is_shutdown = (d->state == ST_SHUTDOWN);
+	__atomic_sub_fetch(&d->waiters, 1, __ATOMIC_SEQ_CST);
+	int is_shutdown = (d->state == ST_SHUTDOWN
+	                   || d->state == ST_DISCONNECTED);
 	pthread_mutex_unlock(&d->mutex);
 
 	if (is_shutdown) {
@@ -808,27 +3812,195 @@ int etherdream_wait_for_ready(struct etherdream *d) {
  * Documented in etherdream.h.
  */
 int etherdream_stop(struct etherdream *d) {
-	pthread_mutex_lock(&d->mutex);
-	if (d->state == ST_RUNNING)
-		d->buffer[d->frame_buffer_read].repeatcount = 0;
-	pthread_mutex_unlock(&d->mutex);
+	if (__atomic_load_n(&d->state, __ATOMIC_SEQ_CST) == ST_RUNNING)
+		__atomic_store_n(&d->stop_requested, 1, __ATOMIC_RELEASE);
 	return 0;
 }
 
-static void add_dac(struct etherdream *d) {
-    if (dac_list) {
-        struct etherdream *ptr = dac_list;
-        while (ptr->next != NULL) ptr = ptr->next;
-        ptr->next = d;
-    } else {
-        dac_list = d;
-    }
+/* dac_hash_bucket(id)
+ *
+ * Return the registry hash chain for DAC ID id.
+ */
+static struct etherdream **dac_hash_bucket(unsigned long id) {
+	return &dac_hash[((uint32_t)id * 2654435761u) >> 24 & (DAC_HASH_SIZE - 1)];
+}
+
+/* find_dac(id)
+ *
+ * Return the DAC with the given ID, or NULL. Called with dac_list_lock held.
+ */
+static struct etherdream *find_dac(unsigned long id) {
+	struct etherdream *d = *dac_hash_bucket(id);
+	while (d && d->dac_id != id)
+		d = d->hash_next;
+	return d;
+}
+
+/* new_dac(addr)
+ *
+ * Allocate a new DAC entry at addr. Its point ring and other large buffers
+ * are left until it is connected.
+ */
+static struct etherdream *new_dac(struct in_addr addr) {
+	struct etherdream *d = calloc(1, sizeof *d);
+	if (!d) {
+		trace(NULL, "!! malloc(struct etherdream) failed\n");
+		return NULL;
+	}
+
+	pthread_cond_init(&d->loop_cond, NULL);
+	pthread_mutex_init(&d->mutex, NULL);
+	d->addr = addr;
+	d->state = ST_DISCONNECTED;
+	d->reconnect_window = RECONNECT_WINDOW;
+	return d;
+}
+
+/* add_dac(d)
+ *
+ * Add d to the registry. Called with dac_list_lock held. Returns its index,
+ * or -1 on failure.
+ */
+static int add_dac(struct etherdream *d) {
+	if (dac_index_len == dac_index_cap) {
+		int cap = dac_index_cap ? dac_index_cap * 2 : 16;
+		struct etherdream **index = realloc(dac_index,
+		                                    cap * sizeof *index);
+		if (!index) {
+			trace(NULL, "!! malloc(DAC index) failed\n");
+			return -1;
+		}
+		dac_index = index;
+		dac_index_cap = cap;
+	}
+
+	if (d->last_seen) {
+		struct etherdream **bucket = dac_hash_bucket(d->dac_id);
+		d->hash_next = *bucket;
+		*bucket = d;
+	}
+
+	dac_index[dac_index_len] = d;
+	return dac_index_len++;
+}
+
+/* remove_dac(i)
+ *
+ * Remove the i'th DAC from the registry and free it, leaving its index
+ * empty. Called with dac_list_lock held.
+ */
+static void remove_dac(int i) {
+	struct etherdream *d = dac_index[i];
+	struct etherdream **p = dac_hash_bucket(d->dac_id);
+
+	while (*p && *p != d)
+		p = &(*p)->hash_next;
+	if (*p)
+		*p = d->hash_next;
+
+	/* Only empty indices at the end can be given up. */
+	dac_index[i] = NULL;
+	while (dac_index_len && !dac_index[dac_index_len - 1])
+		dac_index_len--;
+
+	pthread_cond_destroy(&d->loop_cond);
+	pthread_mutex_destroy(&d->mutex);
+	ring_drop_shared(&d->ring, d->ring.frame_tail, d->ring.frame_head);
+	free(d->ring.points);
+	free(d->callback_buf);
+	free(d->shared_buf);
+	free(d->trace.ev);
+	free(d);
+}
+
+/* expire_dacs(now)
+ *
+ * Forget about DACs that have stopped broadcasting. DACs that are pinned are
+ * kept, since the application may be holding on to them.
+ */
+static void expire_dacs(long long now) {
+	int i;
+
+	pthread_mutex_lock(&dac_list_lock);
+	for (i = dac_index_len - 1; i >= 0; i--) {
+		struct etherdream *d = dac_index[i];
+		if (!d || d->pinned || !d->last_seen
+		    || now - d->last_seen < DAC_EXPIRY_TIME)
+			continue;
+
+		trace(NULL, "_: DAC %06lx went away\n", d->dac_id);
+		remove_dac(i);
+	}
+	pthread_mutex_unlock(&dac_list_lock);
+}
+
+/* note_broadcast(buf, src, now)
+ *
+ * Handle a broadcast from a DAC: record it against the DAC it came from, or
+ * add the DAC if it is new.
+ */
+static void note_broadcast(const struct dac_broadcast *buf,
+                           struct in_addr src, long long now) {
+	unsigned long id = (buf->mac_address[3] << 16)
+	                 | (buf->mac_address[4] << 8)
+	                 | buf->mac_address[5];
+	int i;
+
+	pthread_mutex_lock(&dac_list_lock);
+	struct etherdream *d = find_dac(id);
+
+	/* A DAC added by hand with etherdream_add() takes on the identity of
+	 * the first broadcast from its address. */
+	for (i = 0; !d && i < dac_index_len; i++) {
+		struct etherdream *p = dac_index[i];
+		if (p && !p->last_seen && p->addr.s_addr == src.s_addr) {
+			d = p;
+			d->dac_id = id;
+			d->last_seen = now;
+			struct etherdream **bucket = dac_hash_bucket(id);
+			d->hash_next = *bucket;
+			*bucket = d;
+		}
+	}
+
+	if (d) {
+		if (d->state == ST_DISCONNECTED) {
+			d->addr = src;
+			memcpy(d->mac_address, buf->mac_address, 6);
+			d->sw_revision = buf->sw_revision;
+		}
+		d->last_seen = now;
+		d->broadcast = *buf;
+		pthread_mutex_unlock(&dac_list_lock);
+		return;
+	}
+
+	pthread_mutex_unlock(&dac_list_lock);
+
+	/* Make a new DAC entry */
+	d = new_dac(src);
+	if (!d)
+		return;
+
+	memcpy(d->mac_address, buf->mac_address, 6);
+	d->dac_id = id;
+	d->sw_revision = buf->sw_revision;
+	d->last_seen = now;
+	d->broadcast = *buf;
+
+	trace(NULL, "_: Found new DAC: %s\n", inet_ntoa(src));
+
+	pthread_mutex_lock(&dac_list_lock);
+	if (add_dac(d) < 0)
+		free(d);
+	pthread_mutex_unlock(&dac_list_lock);
 }
 
 /* watch_for_dacs(arg)
  *
  * Thread function for the broadcast monitor thread. This listens for UDP
- * broadcasts from Ether Dream boards on the network and adds them to our list.
+ * broadcasts from Ether Dream boards on the network and adds them to the
+ * registry, and forgets about the ones that go quiet.
  */
 static void *watch_for_dacs(void *arg) {
 	(void)arg;
@@ -846,6 +4018,14 @@ static void *watch_for_dacs(void *arg) {
 		return NULL;
 	}
 
+	/* Wake up at least once a second to expire old DACs. */
+	struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv,
+	                                                     sizeof tv) < 0) {
+		log_socket_error(NULL, "setsockopt SO_RCVTIMEO");
+		return NULL;
+	}
+
 	struct sockaddr_in addr = {
 		.sin_family = AF_INET,
 		.sin_addr.s_addr = htonl(INADDR_ANY), .sin_port = htons(7654)
@@ -857,58 +4037,28 @@ static void *watch_for_dacs(void *arg) {
 
 	trace(NULL, "_: listening for DACs...\n");
 
+	long long last_expiry = microseconds();
+
 	while (1) {
 		struct sockaddr_in src;
 		struct dac_broadcast buf;
 		unsigned int srclen = sizeof src;
 		int len = recvfrom(sock, (char *)&buf, sizeof buf, 0,
 		                   (struct sockaddr *)&src, &srclen);
-		if (len < 0) {
+		if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+		    && errno != EINTR) {
 			log_socket_error(NULL, "recvfrom");
 			return NULL;
 		}
 
-		/* See if this is a DAC we already knew about */
-		pthread_mutex_lock(&dac_list_lock);
-		struct etherdream *p = dac_list;
-		while (p) {
-			if (p->addr.s_addr == src.sin_addr.s_addr)
-				break;
-			p = p->next;
-		}
-
-		if (p && (p->addr.s_addr == src.sin_addr.s_addr)) {
-			pthread_mutex_unlock(&dac_list_lock);
-			continue;
-		}
-
-		pthread_mutex_unlock(&dac_list_lock);
+		long long now = microseconds();
+		if (len >= (int)sizeof buf)
+			note_broadcast(&buf, src.sin_addr, now);
 
-		/* Make a new DAC entry */
-		struct etherdream *new_dac;
-		new_dac = (struct etherdream *)malloc(sizeof (struct etherdream));
-		if (!new_dac) {
-			trace(NULL, "!! malloc(struct etherdream) failed\n");
-			continue;
+		if (now - last_expiry >= 1000000) {
+			expire_dacs(now);
+			last_expiry = now;
 		}
-
-		memset(new_dac, 0, sizeof *new_dac);
-		pthread_cond_init(&new_dac->loop_cond, NULL);
-		pthread_mutex_init(&new_dac->mutex, NULL);
-
-		new_dac->addr = src.sin_addr;
-		memcpy(new_dac->mac_address, buf.mac_address, 6);
-		new_dac->dac_id = (buf.mac_address[3] << 16)
-		                | (buf.mac_address[4] << 8)
-		                | buf.mac_address[5];
-		new_dac->sw_revision = buf.sw_revision;
-		new_dac->state = ST_DISCONNECTED;
-
-		trace(NULL, "_: Found new DAC: %s\n", inet_ntoa(src.sin_addr));
-
-		pthread_mutex_lock(&dac_list_lock);
-        add_dac(new_dac);
-		pthread_mutex_unlock(&dac_list_lock);
 	}
 
 	trace(NULL, "_: Exiting\n");
@@ -928,7 +4078,7 @@ int etherdream_lib_start(void) {
 	timer_freq_numer = timebase_info.numer;
 	timer_freq_denom = timebase_info.denom * 1000;
 #else
-	clock_gettime(CLOCK_REALTIME, &start_time);
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
 #endif
 
 	// Set up the logging fd (just stderr for now)
@@ -945,23 +4095,13 @@ int etherdream_lib_start(void) {
 	return 0;
 }
 
-static int dac_list_length() {
-	int count = 0;
-	struct etherdream *d = dac_list;
-	while (d) {
-		d = d->next;
-		count++;
-	}
-    return count;
-}
-
 /* etherdream_dac_count()
  *
  * Documented in etherdream.h.
  */
 int etherdream_dac_count(void) {
 	pthread_mutex_lock(&dac_list_lock);
-	int count = dac_list_length();
+	int count = dac_index_len;
 	pthread_mutex_unlock(&dac_list_lock);
 	trace(NULL, "== etherdream_lib_get_dac_count(): %d\n", count);
 	return count;
@@ -972,18 +4112,37 @@ int etherdream_dac_count(void) {
  * Documented in etherdream.h.
  */
 struct etherdream *etherdream_get(unsigned long idx) {
-	struct etherdream *d = dac_list;
-	unsigned long i = 0;
+	struct etherdream *d;
+
+	// Match by either numerical position or ID
+	pthread_mutex_lock(&dac_list_lock);
+	if (idx < (unsigned long)dac_index_len)
+		d = dac_index[idx];
+	else
+		d = find_dac(idx);
+	if (d)
+		d->pinned = 1;
+	pthread_mutex_unlock(&dac_list_lock);
+
+	return d;
+}
+
+/* etherdream_get_broadcast(d, bc)
+ *
+ * Documented in etherdream.h.
+ */
+long long etherdream_get_broadcast(struct etherdream *d,
+                                   struct dac_broadcast *bc) {
+	long long age = -1;
 
-	while (d) {
-		// Match by either numerical position or ID
-		if (idx == i || idx == d->dac_id)
-			return d;
-		i++;
-		d = d->next;
+	pthread_mutex_lock(&dac_list_lock);
+	if (d->last_seen) {
+		*bc = d->broadcast;
+		age = microseconds() - d->last_seen;
 	}
+	pthread_mutex_unlock(&dac_list_lock);
 
-	return NULL;
+	return age;
 }
 
 /* etherdream_add()
@@ -991,28 +4150,20 @@ struct etherdream *etherdream_get(unsigned long idx) {
  * Documented in etherdream.h
  */
 int etherdream_add(const char *ipaddr) {
-
-    struct sockaddr_in sa;
-    inet_pton(AF_INET, ipaddr, &(sa.sin_addr));
+	struct sockaddr_in sa;
+	inet_pton(AF_INET, ipaddr, &(sa.sin_addr));
 
 	/* Make a new DAC entry */
-	struct etherdream *new_dac;
-	new_dac = (struct etherdream *)malloc(sizeof (struct etherdream));
-	if (!new_dac) {
-		trace(NULL, "!! malloc(struct etherdream) failed\n");
+	struct etherdream *d = new_dac(sa.sin_addr);
+	if (!d)
 		return -1;
-	}
-
-	memset(new_dac, 0, sizeof *new_dac);
-	pthread_cond_init(&new_dac->loop_cond, NULL);
-	pthread_mutex_init(&new_dac->mutex, NULL);
-
-	new_dac->addr = sa.sin_addr;
-	new_dac->state = ST_DISCONNECTED;
+	d->pinned = 1;
 
 	pthread_mutex_lock(&dac_list_lock);
-	int count = dac_list_length();
-    add_dac(new_dac);
+	int idx = add_dac(d);
 	pthread_mutex_unlock(&dac_list_lock);
-    return count;
+
+	if (idx < 0)
+		free(d);
+	return idx;
 }
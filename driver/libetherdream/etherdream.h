@@ -6,6 +6,7 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stdio.h>
 
 struct etherdream_point {
 	int16_t x;
@@ -19,6 +20,10 @@ struct etherdream_point {
 };
 
 struct etherdream;
+struct etherdream_group;
+struct etherdream_frame;
+struct dac_point;
+struct dac_broadcast;
 
 /* etherdream_lib_start()
  *
@@ -29,13 +34,32 @@ struct etherdream;
  */
 int etherdream_lib_start(void);
 
+/* etherdream_reactor_start(nthreads)
+ *
+ * Use the event-loop backend: rather than starting a thread per DAC,
+ * etherdream_connect() hands each DAC to one of nthreads shared threads,
+ * which sleep in epoll until a DAC sends a response or is due for more data.
+ * Call this after etherdream_lib_start() and before connecting to any DACs.
+ * Only available on Linux.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int etherdream_reactor_start(int nthreads);
+
 /* etherdream_dac_count()
  *
  * Return the number of detected DACs since etherdream_lib_start() was called.
  * Ether Dream DACs broadcast once per second, so calling code should wait a
  * little over a second after etherdream_lib_start() to ensure that all DACs
  * on the network are seen.
- */ 
+ *
+ * A DAC that has not broadcast for ten seconds, and has never been
+ * returned by etherdream_get(), is forgotten. Its index is left empty, and
+ * etherdream_get() returns NULL for it, so that every other DAC keeps its
+ * index; the count only goes down if the last DACs are forgotten. A DAC
+ * that etherdream_get() has returned is never forgotten, so the pointer
+ * stays valid for as long as the library is running.
+ */
 int etherdream_dac_count(void);
 
 /* etherdream_get(idx)
@@ -61,17 +85,38 @@ unsigned long etherdream_get_id(struct etherdream *d);
  */
 const struct in_addr *etherdream_get_in_addr(struct etherdream *d);
 
+/* etherdream_get_broadcast(d, bc)
+ *
+ * Copy the most recent broadcast from d (struct dac_broadcast, from
+ * protocol.h, which includes its status) into bc. This does not require a
+ * connection to d. Returns the age of the broadcast in microseconds, or -1
+ * if d has never broadcast (for instance, if it was added with
+ * etherdream_add() and has not been heard from).
+ */
+long long etherdream_get_broadcast(struct etherdream *d,
+                                   struct dac_broadcast *bc);
+
 /* etherdream_connect(d)
  *
  * Open a connection to d. This must be called before most other etherdream_
- * functions can be used.
+ * functions can be used. Returns 0 on success, -1 on failure.
  */
 int etherdream_connect(struct etherdream *d);
 
+/* etherdream_connect_many(dacs, n, results)
+ *
+ * Open connections to the n DACs in dacs all at once, rather than one after
+ * another; this takes about as long as connecting to the slowest of them.
+ * results[i] is set to 0 if dacs[i] connected, or -1 if not. Returns the
+ * number of DACs that connected.
+ */
+int etherdream_connect_many(struct etherdream **dacs, int n, int *results);
+
 /* etherdream_is_ready(d)
  *
  * Return 1 if the local buffer for d can accept more frames, 0 if not, -1 on
- * error (if the connection to d has not been opened or has failed).
+ * error (if the connection to d has not been opened, has been closed, or
+ * has failed for good). While d is reconnecting it is not yet an error.
  */
 int etherdream_is_ready(struct etherdream *d);
 
@@ -84,7 +129,9 @@ int etherdream_wait_for_ready(struct etherdream *d);
 
 /* etherdream_write(d, pts, npts, pps, repeatcount)
  *
- * Write a "frame" consisting of pts (length npts) to d.
+ * Write a "frame" consisting of pts (length npts) to d. This is a wrapper
+ * around etherdream_ring_reserve() and etherdream_ring_commit(); it fails
+ * with -1 only if the point ring cannot hold the whole frame.
  *
  * If repeatcount is -1, pts will be sent to the laser repeatedly until new
  * data is received or until etherdream_stop is called. Otherwise, the points
@@ -92,6 +139,10 @@ int etherdream_wait_for_ready(struct etherdream *d);
  * automatically stop. pps specifies the output rate (30000 is a common value).
  * repeatcount must not be 0.
  *
+ * Each frame may have its own pps. A change of rate takes effect exactly at
+ * the first point of the frame that asks for it, and the DAC is only told
+ * about the rate when it actually changes.
+ *
  * The Ether Dream uses a continuous streaming protocol, so if new frames are
  * continuously sent, frame boundaries are not visible; however, to reduce
  * overhead, frames should be reasonably large (at least 50-100 points).
@@ -99,6 +150,404 @@ int etherdream_wait_for_ready(struct etherdream *d);
 int etherdream_write(struct etherdream *d, const struct etherdream_point *pts,
                      int npts, int pps, int repeatcount);
 
+/* etherdream_frame_create(pts, npts)
+ *
+ * Convert the npts points at pts (at most 16000) to the DAC's wire format
+ * once, for sending the same frame to many DACs with
+ * etherdream_write_frame(). Returns the frame, holding one reference for
+ * the caller, or NULL on failure.
+ */
+struct etherdream_frame *etherdream_frame_create(
+		const struct etherdream_point *pts, int npts);
+
+/* etherdream_frame_release(f)
+ *
+ * Drop a reference to f. It is freed once every DAC it was written to is
+ * done with it as well, so the caller may release it as soon as it has
+ * been written everywhere. f may be NULL.
+ */
+void etherdream_frame_release(struct etherdream_frame *f);
+
+/* etherdream_write_frame(d, f, pps, repeatcount)
+ *
+ * As etherdream_write(), but queue a frame made by etherdream_frame_create()
+ * without copying it: d takes a reference to f and sends its points
+ * straight out of it, so the cost of writing one frame to many DACs does
+ * not grow with the frame's size. If d has a transform set, it is applied
+ * as the points are sent. Returns -1 if d has too many frames queued; the
+ * point ring's space is not used. This must not be called while points are
+ * reserved in d's ring.
+ */
+int etherdream_write_frame(struct etherdream *d, struct etherdream_frame *f,
+                           int pps, int repeatcount);
+
+/* etherdream_ring_reserve(d, max, pts)
+ *
+ * Streaming interface: reserve space for up to max points in d's point ring
+ * and set *pts to point at it. Points are in the DAC's wire format (struct
+ * dac_point from protocol.h) and are filled in place by the caller; the
+ * control word should normally be 0.
+ *
+ * The reserved space is contiguous, so fewer than max points may be returned
+ * when the ring wraps; call again to reserve the remainder. Returns the number
+ * of points reserved, or 0 if the ring is full. This does not block or take
+ * any locks, and must only be called from one thread at a time per DAC.
+ */
+int etherdream_ring_reserve(struct etherdream *d, int max,
+                            struct dac_point **pts);
+
+/* etherdream_ring_commit(d, pps, repeatcount)
+ *
+ * Publish every point reserved since the last commit as a single frame, to be
+ * played at pps points per second. repeatcount behaves as in
+ * etherdream_write(). Returns 0 on success.
+ */
+int etherdream_ring_commit(struct etherdream *d, int pps, int repeatcount);
+
+/* etherdream_ring_wait(d, npts)
+ *
+ * Block the invoking thread until at least npts points can be reserved in
+ * d's point ring. Returns 0 on success, -1 if the connection to d is not open
+ * or has failed.
+ */
+int etherdream_ring_wait(struct etherdream *d, int npts);
+
+/* struct etherdream_request
+ *
+ * Passed to a pull-mode callback to describe the points being asked for.
+ * point_index is the DAC's running point count (as in the point_count field
+ * of struct dac_status) at which the first requested point will be played,
+ * and emit_time is the estimated time at which that will happen, on the
+ * etherdream_time_us() clock.
+ */
+struct etherdream_request {
+	uint32_t point_index;
+	long long emit_time;
+	int npoints;
+	int pps;
+};
+
+/* etherdream_callback
+ *
+ * A pull-mode callback. It should fill in up to req->npoints points at pts
+ * and return how many it wrote. It runs on the library's sending thread
+ * (shared with other DACs if the reactor backend is in use), just before
+ * the points are sent, so it must not block.
+ */
+typedef int (*etherdream_callback)(struct etherdream *d,
+                                   const struct etherdream_request *req,
+                                   struct etherdream_point *pts, void *user);
+
+/* etherdream_set_callback(d, pps, cb, user)
+ *
+ * Switch d to pull mode: rather than the application writing frames, the
+ * library calls cb whenever the DAC has room for more points, asking for
+ * only as many as it needs to stay at its buffer target. This keeps latency
+ * between generating a point and its emission to the DAC's buffer alone.
+ *
+ * While a callback is set, the application must not write frames to d or
+ * use the ring interface. Pass a NULL cb to return to push mode. Returns 0
+ * on success, -1 on error.
+ */
+int etherdream_set_callback(struct etherdream *d, int pps,
+                            etherdream_callback cb, void *user);
+
+/* etherdream_source
+ *
+ * A zero-copy pull-mode source. Rather than filling in points, it sets *pts
+ * to up to req->npoints contiguous points that are already in the DAC's wire
+ * format, and returns how many there are; they are sent to the DAC straight
+ * from there, and must stay in place until the source is next called. The
+ * same threading rules apply as for etherdream_callback.
+ */
+typedef int (*etherdream_source)(struct etherdream *d,
+                                 const struct etherdream_request *req,
+                                 const struct dac_point **pts, void *user);
+
+/* etherdream_set_source(d, pps, src, user)
+ *
+ * Like etherdream_set_callback(), but with a zero-copy source. Points from a
+ * source bypass the point ring, and so any transform set on d. Pass a NULL
+ * src to return to push mode. Returns 0 on success, -1 on error.
+ */
+int etherdream_set_source(struct etherdream *d, int pps,
+                          etherdream_source src, void *user);
+
+/* etherdream_time_us()
+ *
+ * Return the library's clock, in microseconds. This is the time base for
+ * the emit_time field of struct etherdream_request.
+ */
+long long etherdream_time_us(void);
+
+/* etherdream_set_latency(d, usec)
+ *
+ * Set how far ahead of the laser the library should keep d's buffer, in
+ * microseconds. Lower values reduce latency at the cost of less margin for
+ * network and scheduling hiccups. The target is limited by the size of the
+ * DAC's buffer; 0 restores the default of keeping it nearly full.
+ *
+ * ETHERDREAM_LATENCY_AUTO has the library find the target itself: it starts
+ * with the buffer nearly full and lowers the target a little every second,
+ * down to what the measured network round trip and jitter allow, for as
+ * long as the DAC keeps up. Whenever the DAC underflows with more points
+ * still to play, the target goes back up, and from then on only comes back
+ * down to a little above where it failed.
+ * The current target is in the buffer_target field of the stats.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+#define ETHERDREAM_LATENCY_AUTO	(-1)
+
+int etherdream_set_latency(struct etherdream *d, int usec);
+
+/* etherdream_set_spin(d, usec)
+ *
+ * Sending is paced by sleeping until a deadline, and how late the sender
+ * wakes up (see sleep_overshoot in struct etherdream_stats) eats into the
+ * buffer. With usec > 0, the sender instead wakes up usec microseconds
+ * early and spins until the deadline, trading that much CPU time per
+ * wakeup for accuracy; 50 to 100 is usually enough. With the reactor
+ * backend, other DACs on the same thread wait while it spins. At most
+ * 1000; 0 (the default) turns spinning off. Returns 0 on success, -1 on
+ * error.
+ */
+int etherdream_set_spin(struct etherdream *d, int usec);
+
+/* etherdream_set_reconnect(d, usec)
+ *
+ * If d's connection fails, the library reconnects by itself, retrying with
+ * a short but growing delay between attempts for up to usec microseconds
+ * (10 seconds by default) before giving up and shutting down as before,
+ * after which etherdream_is_ready() and etherdream_wait_for_ready() fail. A
+ * DAC carries on playing what's in its buffer while disconnected; once
+ * back, the frame that was playing is sent again from its start, and the
+ * frames queued behind it follow. Writes made in the meantime are queued
+ * as usual. A member of a group stays in it: once back, it is lined up
+ * with wherever the rest of the group has got to, and kept in step from
+ * there. Pass 0 to turn reconnection off. Returns 0 on success, -1 on error.
+ */
+int etherdream_set_reconnect(struct etherdream *d, int usec);
+
+/* etherdream_set_latest_frame(d, enable)
+ *
+ * Latest-frame mode, for interactive content. Normally frames play in the
+ * order they were written and etherdream_wait_for_ready() holds the writer
+ * back while two are queued. In this mode, a new frame replaces any queued
+ * frame that has not started playing, and cuts short the repeats of the
+ * one that has, so there is never a backlog: what reaches the laser is at
+ * most one frame plus the DAC's buffer behind the latest write. Frames are
+ * only ever swapped at a frame boundary, never part way through.
+ *
+ * While enabled, etherdream_write() and etherdream_write_frame() always
+ * find room, by taking back the queued frames that haven't started playing
+ * if they have to, so etherdream_is_ready() is always true while d is
+ * connected and etherdream_wait_for_ready() doesn't wait. The application
+ * should pace itself, and write frames with a repeatcount of -1 so that the
+ * last one keeps playing until the next arrives.
+ */
+void etherdream_set_latest_frame(struct etherdream *d, int enable);
+
+/* etherdream_set_transform(d, t)
+ *
+ * Have points written to d with etherdream_write() or returned by its
+ * callback scaled and offset on their way into the point ring:
+ *
+ *	x' = x * scale_x + offset_x	y' = y * scale_y + offset_y
+ *
+ * with r, g, b and i multiplied by intensity, all rounded to nearest and
+ * saturated. This costs next to nothing over the plain conversion to wire
+ * format. Points written through the ring interface are not transformed;
+ * frames queued with etherdream_write_frame() are transformed as they are
+ * sent, which lets each DAC sharing a frame mirror, offset or dim it its
+ * own way, using the transform in effect when the frame was queued. Pass
+ * NULL for t to stop transforming. This must be called from the thread that
+ * writes points to d (or from its callback).
+ */
+struct etherdream_transform {
+	float scale_x, scale_y;
+	float offset_x, offset_y;
+	float intensity;
+};
+
+void etherdream_set_transform(struct etherdream *d,
+                              const struct etherdream_transform *t);
+
+/* etherdream_convert(out, in, n, t)
+ *
+ * Convert n points from in to the DAC's wire format in out, with control
+ * words of 0, transforming them by t as etherdream_set_transform()
+ * describes unless t is NULL. This is what etherdream_write() does, for
+ * applications filling the point ring themselves.
+ */
+void etherdream_convert(struct dac_point *out,
+                        const struct etherdream_point *in, int n,
+                        const struct etherdream_transform *t);
+
+/* etherdream_set_convert_kernel(kernel)
+ *
+ * Conversion has SSE2 and AVX2 versions as well as plain C; by default the
+ * fastest one the CPU supports is used. This forces a particular one, for
+ * benchmarking and testing. All of them give identical results. Returns 0
+ * on success, -1 if this CPU or build can't run the one asked for.
+ */
+enum etherdream_convert_kernel {
+	ETHERDREAM_CONVERT_AUTO,
+	ETHERDREAM_CONVERT_SCALAR,
+	ETHERDREAM_CONVERT_SSE2,
+	ETHERDREAM_CONVERT_AVX2,
+};
+
+int etherdream_set_convert_kernel(enum etherdream_convert_kernel kernel);
+
+/* etherdream_group_create(dacs, n)
+ *
+ * Tie the n DACs in dacs together for synchronized playback. Each member
+ * primes its buffer as usual but holds off on starting; once all of them
+ * are primed, they all start together. While playing, each member's point
+ * rate is trimmed slightly so that all members stay within a few points of
+ * each other.
+ *
+ * The DACs must be connected but not yet playing. Returns the new group, or
+ * NULL on failure.
+ */
+struct etherdream_group *etherdream_group_create(struct etherdream **dacs,
+                                                 int n);
+
+/* etherdream_group_offsets(g, offsets)
+ *
+ * Fill offsets (which must have room for one int per member, in the order
+ * passed to etherdream_group_create()) with how many points each member is
+ * ahead of the group average. Returns 0 if every member is playing, -1 if
+ * not (in which case the offsets of members that are not are 0).
+ */
+int etherdream_group_offsets(struct etherdream_group *g, int *offsets);
+
+/* etherdream_group_destroy(g)
+ *
+ * Free g. Its members carry on playing independently. This must not be
+ * called while any member's connection is active.
+ */
+void etherdream_group_destroy(struct etherdream_group *g);
+
+/* Telemetry. Each DAC keeps running counters and a few histograms, which
+ * are cheap enough to always be on. Counters only ever go up (other than
+ * the rate, flag and target fields, which are current values), so callers wanting
+ * numbers over an interval should take the difference of two snapshots.
+ *
+ * Histograms have power-of-two buckets: bucket 0 counts zero values, bucket
+ * i counts values from 2^(i-1) to 2^i - 1, and the last bucket counts
+ * everything from 2^(ETHERDREAM_HIST_BUCKETS - 2) up.
+ */
+#define ETHERDREAM_HIST_BUCKETS	20
+
+struct etherdream_histogram {
+	uint32_t bucket[ETHERDREAM_HIST_BUCKETS];
+	uint32_t count;
+	uint32_t max;
+	uint64_t sum;
+};
+
+struct etherdream_stats {
+	uint64_t points_sent;
+	uint64_t bytes_sent;
+	uint32_t packets_sent;
+	uint32_t acks_received;
+
+	/* Socket and timer system calls made on this DAC's behalf. */
+	uint32_t syscalls;
+
+	/* Number of rate-change (queue) commands sent. */
+	uint32_t rate_changes;
+
+	/* Frames dropped unplayed in latest-frame mode. */
+	uint32_t frames_skipped;
+
+	/* Send rate over the last second or so. */
+	uint32_t points_per_sec;
+	uint32_t bytes_per_sec;
+
+	/* Number of times the DAC has reported an underflow or e-stop, and
+	 * the flags from its latest status. */
+	uint32_t underflows;
+	uint32_t estops;
+	uint16_t playback_flags;
+	uint16_t light_engine_flags;
+
+	/* Time from sending data to its ACK, in microseconds. */
+	struct etherdream_histogram ack_rtt;
+
+	/* Estimated points in the DAC's buffer when sending more, and the
+	 * number of points the sender was aiming for. */
+	struct etherdream_histogram fullness;
+	uint32_t buffer_target;
+
+	/* How late the sender woke up from a timed sleep, in microseconds,
+	 * and how long it has spent spinning (see etherdream_set_spin()). */
+	struct etherdream_histogram sleep_overshoot;
+	uint64_t spin_time;
+
+	/* Number of times the connection was lost and re-established, and
+	 * how long the laser went dark each time, in microseconds: from when
+	 * the DAC's buffer ran out until it was playing again (0 if it never
+	 * ran out). */
+	uint32_t reconnects;
+	struct etherdream_histogram blackout;
+};
+
+/* etherdream_get_stats(d, stats)
+ *
+ * Copy a consistent snapshot of d's counters into stats. This may be called
+ * from any thread at any time.
+ */
+void etherdream_get_stats(struct etherdream *d,
+                          struct etherdream_stats *stats);
+
+/* Event trace. Each DAC records what its sender does - every batch sent,
+ * every wait, every ACK - as binary events in a ring of the most recent few
+ * thousand. Recording is cheap and never blocks, so it is always on; the
+ * ring is only decoded when asked for.
+ */
+enum etherdream_trace_id {
+	ETHERDREAM_EV_SEND = 1,		/* points, fullness, rate, unacked */
+	ETHERDREAM_EV_WAIT,		/* room, fullness, usec, unacked */
+	ETHERDREAM_EV_ACK,		/* command, buffer, count, state */
+	ETHERDREAM_EV_PREPARE,
+	ETHERDREAM_EV_PREPARE_ACK,
+	ETHERDREAM_EV_BEGIN,		/* rate, buffer */
+	ETHERDREAM_EV_PULL,		/* asked, returned, point index */
+	ETHERDREAM_EV_IDLE,
+	ETHERDREAM_EV_SLEEP,
+	ETHERDREAM_EV_NOT_READY,	/* points, repeatcount */
+	ETHERDREAM_EV_GROUP_START,	/* members, delay */
+	ETHERDREAM_EV_RETUNE,		/* target, floor, underflow */
+	ETHERDREAM_EV_SKIP,		/* frames */
+	ETHERDREAM_EV_LOST,		/* buffer, state */
+	ETHERDREAM_EV_RECONNECT,	/* usec */
+};
+
+struct etherdream_trace_event {
+	uint32_t seq;
+	uint32_t id;
+	int64_t time;		/* microseconds since etherdream_lib_start() */
+	int32_t arg[4];
+};
+
+/* etherdream_trace_read(d, events, max)
+ *
+ * Copy up to max of d's most recent trace events, oldest first, into
+ * events. Returns the number copied. Events being overwritten as this runs
+ * are skipped.
+ */
+int etherdream_trace_read(struct etherdream *d,
+                          struct etherdream_trace_event *events, int max);
+
+/* etherdream_trace_dump(d, fp)
+ *
+ * Decode d's trace ring as text to fp.
+ */
+void etherdream_trace_dump(struct etherdream *d, FILE *fp);
+
 /* etherdream_stop(d)
  *
  * Stop output from d as soon as the current frame is finished.
@@ -17,6 +17,7 @@
 
 #include "gl-render.hpp"
 #include "wav8.hpp"
+#include "xform.hpp"
 
 #include <getopt.h>
 #include <iostream>
@@ -198,6 +199,10 @@ int main(int argc, char **argv) {
         y_size = -y_size;
     }
 
+    PointTransform transform;
+    transform.compile(Calibration::scale_offset(x_size, y_size, x_offset,
+                                                y_offset, brightness));
+
     if (argc - optind != 1) {
         usage(argv[0]);
     }
@@ -247,13 +252,7 @@ int main(int argc, char **argv) {
 
         glr_draw(point_buf);
 
-        for (int i = 0; i < point_buf.size(); i++) {
-            point_buf[i].x = point_buf[i].x * x_size + (x_offset * 32767);
-            point_buf[i].y = point_buf[i].y * y_size + (y_offset * 32767);
-            point_buf[i].r *= brightness;
-            point_buf[i].g *= brightness;
-            point_buf[i].b *= brightness;
-        }
+        transform.apply(point_buf.data(), point_buf.size());
 
         if (ed) {
             // If an Ether Dream is attached, let it drive timing.
@@ -0,0 +1,581 @@
+#include "xform.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* xform_neon has never been built or run on real hardware, so it is left
+ * out unless asked for with -DXFORM_NEON until it has been checked. */
+#if defined(XFORM_NEON) && defined(__ARM_NEON) && defined(__aarch64__)
+#define HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+typedef PointTransform::Program Program;
+
+/* Full scale, in DAC units, of the -1 to 1 coordinates calibrations use. */
+static const double FULL_SCALE = 32767;
+
+/* The affine path is (a * x + b * y + c) >> 14 in 32 bits. Keeping
+ * |a| + |b| under 2 in Q14 and |c| under 2^30 means that can't overflow,
+ * and lets a and b sit side by side in 16-bit lanes. */
+static const int Q = 14;
+static const int32_t Q_COEF_MAX = 32767;
+static const int32_t Q_OFFSET_MAX = 1 << 30;
+
+Calibration Calibration::scale_offset(double x_size, double y_size,
+                                      double x_offset, double y_offset,
+                                      double brightness) {
+    Calibration c;
+    c.matrix[0][0] = x_size;
+    c.matrix[0][2] = x_offset;
+    c.matrix[1][1] = y_size;
+    c.matrix[1][2] = y_offset;
+    c.gain[0] = c.gain[1] = c.gain[2] = brightness;
+    return c;
+}
+
+static int16_t clip_coord(double v) {
+    if (v <= -1) {
+        return -32768;
+    }
+    if (v >= 1) {
+        return 32767;
+    }
+    return lrint(v * FULL_SCALE);
+}
+
+PointTransform::PointTransform() : m_version(0) {
+    compile(Calibration());
+}
+
+bool PointTransform::compile(const Calibration & c) {
+    const auto & m = c.matrix;
+
+    /* w is linear in x and y, so if it's positive at the corners it's
+     * positive everywhere in between. */
+    for (int sx = -1; sx <= 1; sx += 2) {
+        for (int sy = -1; sy <= 1; sy += 2) {
+            if (!(m[2][0] * sx + m[2][1] * sy + m[2][2] > 1e-9)) {
+                return false;
+            }
+        }
+    }
+
+    for (int ch = 0; ch < 4; ch++) {
+        if (!(c.gamma[ch] > 0)) {
+            return false;
+        }
+    }
+
+    Program p;
+    memset(&p, 0, sizeof p);
+
+    p.affine = m[2][0] == 0 && m[2][1] == 0;
+    if (p.affine) {
+        double s = 1 / m[2][2];
+        for (int r = 0; r < 2; r++) {
+            double a = m[r][0] * s * (1 << Q);
+            double b = m[r][1] * s * (1 << Q);
+            double off = m[r][2] * s * FULL_SCALE * (1 << Q);
+            if (!(fabs(a) + fabs(b) <= Q_COEF_MAX && fabs(off) < Q_OFFSET_MAX)) {
+                p.affine = false;
+                break;
+            }
+            p.q[r][0] = lrint(a);
+            p.q[r][1] = lrint(b);
+            p.q[r][2] = lrint(off) + (1 << (Q - 1));
+            if (abs(p.q[r][0]) + abs(p.q[r][1]) > Q_COEF_MAX) {
+                p.affine = false;
+                break;
+            }
+        }
+    }
+
+    for (int r = 0; r < 2; r++) {
+        p.f[r][0] = m[r][0];
+        p.f[r][1] = m[r][1];
+        p.f[r][2] = m[r][2] * FULL_SCALE;
+    }
+    p.f[2][0] = m[2][0] / FULL_SCALE;
+    p.f[2][1] = m[2][1] / FULL_SCALE;
+    p.f[2][2] = m[2][2];
+
+    for (int ch = 0; ch < 4; ch++) {
+        if (c.gain[ch] == 1 && c.offset[ch] == 0 && c.gamma[ch] == 1) {
+            p.color[ch] = Program::KEEP;
+            continue;
+        }
+        if (c.gain[ch] >= 0 && c.gain[ch] < 1 && c.offset[ch] == 0
+            && c.gamma[ch] == 1) {
+            p.color[ch] = Program::SCALE;
+            p.scale[ch] = lrint(c.gain[ch] * 65535);
+            continue;
+        }
+        p.color[ch] = Program::LUT;
+        for (int k = 0; k < 4096; k++) {
+            double v = c.offset[ch] + c.gain[ch] * pow(k / 4095.0, c.gamma[ch]);
+            p.lut[ch][k] = lrint(std::min(std::max(v, 0.0), 1.0) * 65535);
+        }
+        /* Blanked stays blanked, whatever the offset. */
+        p.lut[ch][0] = 0;
+        p.lut[ch][4096] = p.lut[ch][4095];
+    }
+
+    for (int k = 0; k < 4; k++) {
+        p.clip[k] = clip_coord(c.clip[k]);
+    }
+    if (p.clip[0] > p.clip[2] || p.clip[1] > p.clip[3]) {
+        return false;
+    }
+    p.clip_blank = c.clip_blank;
+
+    const int32_t half = 1 << (Q - 1);
+    p.identity = p.affine
+        && p.q[0][0] == 1 << Q && p.q[0][1] == 0 && p.q[0][2] == half
+        && p.q[1][0] == 0 && p.q[1][1] == 1 << Q && p.q[1][2] == half
+        && p.color[0] == Program::KEEP && p.color[1] == Program::KEEP
+        && p.color[2] == Program::KEEP && p.color[3] == Program::KEEP
+        && p.clip[0] == -32768 && p.clip[1] == -32768
+        && p.clip[2] == 32767 && p.clip[3] == 32767;
+
+    m_prog = p;
+    m_version++;
+    return true;
+}
+
+/* Scalar versions: the reference the others have to match exactly. */
+
+/* One pass per channel, rather than one per point, so each loop is a
+ * plain strided load and store. The SIMD kernels do the scaled channels
+ * themselves and only call this for the tables. */
+static void colors_scalar(const Program & p, etherdream_point * pts,
+                          size_t n, bool tables_only) {
+    static const size_t offsets[4] = {
+        offsetof(etherdream_point, r), offsetof(etherdream_point, g),
+        offsetof(etherdream_point, b), offsetof(etherdream_point, i),
+    };
+    for (int ch = 0; ch < 4; ch++) {
+        uint8_t * c = (uint8_t *)pts + offsets[ch];
+        uint16_t v;
+
+        if (p.color[ch] == Program::LUT) {
+            const uint16_t * lut = p.lut[ch];
+            for (size_t i = 0; i < n; i++, c += sizeof *pts) {
+                memcpy(&v, c, 2);
+                v = lut[v >> 4];
+                memcpy(c, &v, 2);
+            }
+        } else if (p.color[ch] == Program::SCALE && !tables_only) {
+            uint32_t s = p.scale[ch];
+            for (size_t i = 0; i < n; i++, c += sizeof *pts) {
+                memcpy(&v, c, 2);
+                v = v * s >> 16;
+                memcpy(c, &v, 2);
+            }
+        }
+    }
+}
+
+static inline int32_t saturate16(int32_t v) {
+    return std::min(std::max(v, -32768), 32767);
+}
+
+static inline int32_t project(const float * f, const float * w,
+                              float x, float y) {
+    float v = (f[0] * x + f[1] * y + f[2]) / (w[0] * x + w[1] * y + w[2]);
+    return lrintf(std::min(std::max(v, -32768.0f), 32767.0f));
+}
+
+static void geometry_scalar(const Program & p, etherdream_point * pts,
+                            size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        int32_t x, y;
+        if (p.affine) {
+            x = saturate16((p.q[0][0] * pts[i].x + p.q[0][1] * pts[i].y
+                            + p.q[0][2]) >> Q);
+            y = saturate16((p.q[1][0] * pts[i].x + p.q[1][1] * pts[i].y
+                            + p.q[1][2]) >> Q);
+        } else {
+            x = project(p.f[0], p.f[2], pts[i].x, pts[i].y);
+            y = project(p.f[1], p.f[2], pts[i].x, pts[i].y);
+        }
+
+        pts[i].x = std::min(std::max(x, (int32_t)p.clip[0]),
+                            (int32_t)p.clip[2]);
+        pts[i].y = std::min(std::max(y, (int32_t)p.clip[1]),
+                            (int32_t)p.clip[3]);
+        if (p.clip_blank && (pts[i].x != x || pts[i].y != y)) {
+            pts[i].r = pts[i].g = pts[i].b = pts[i].i = 0;
+        }
+    }
+}
+
+static void xform_scalar(const Program & p, etherdream_point * pts,
+                         size_t n) {
+    colors_scalar(p, pts, n, false);
+    geometry_scalar(p, pts, n);
+}
+
+/* Two int16s side by side, as one 32-bit lane, low first. */
+static inline int32_t pair16(int32_t lo, int32_t hi) {
+    return (uint16_t)lo | (uint32_t)(uint16_t)hi << 16;
+}
+
+/* The multipliers for channels ch and ch + 1 as one 32-bit lane, or with
+ * mask, which of them are scaled. */
+static inline int32_t scale_pair(const Program & p, int ch, bool mask) {
+    int32_t v[2];
+    for (int k = 0; k < 2; k++) {
+        bool scaled = p.color[ch + k] == Program::SCALE;
+        v[k] = !scaled ? 0 : mask ? 0xffff : p.scale[ch + k];
+    }
+    return pair16(v[0], v[1]);
+}
+
+#if HAVE_X86_SIMD
+
+/* The SIMD versions work on the points four (SSE2) or eight (AVX2) at a
+ * time, after transposing them so that each register holds one 32-bit
+ * word from every point: (x, y), (r, g), (b, i) and (u1, u2). With x and
+ * y side by side, the affine case is one pmaddwd per axis. */
+
+__attribute__((target("sse2")))
+static inline __m128i geometry_sse2(const Program & p, __m128i xy) {
+    __m128i x, y;
+    if (p.affine) {
+        x = _mm_madd_epi16(xy, _mm_set1_epi32(pair16(p.q[0][0], p.q[0][1])));
+        y = _mm_madd_epi16(xy, _mm_set1_epi32(pair16(p.q[1][0], p.q[1][1])));
+        x = _mm_srai_epi32(_mm_add_epi32(x, _mm_set1_epi32(p.q[0][2])), Q);
+        y = _mm_srai_epi32(_mm_add_epi32(y, _mm_set1_epi32(p.q[1][2])), Q);
+    } else {
+        __m128 fx = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(xy, 16), 16));
+        __m128 fy = _mm_cvtepi32_ps(_mm_srai_epi32(xy, 16));
+        __m128 v[3];
+        for (int r = 0; r < 3; r++) {
+            v[r] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(p.f[r][0]), fx),
+                                         _mm_mul_ps(_mm_set1_ps(p.f[r][1]), fy)),
+                              _mm_set1_ps(p.f[r][2]));
+        }
+        __m128 lo = _mm_set1_ps(-32768.0f), hi = _mm_set1_ps(32767.0f);
+        x = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_div_ps(v[0], v[2]), lo), hi));
+        y = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_div_ps(v[1], v[2]), lo), hi));
+    }
+
+    /* packs leaves x0..x3 y0..y3; put them back in pairs. */
+    __m128i v = _mm_packs_epi32(x, y);
+    return _mm_unpacklo_epi16(v, _mm_srli_si128(v, 8));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i scale_sse2(__m128i v, __m128i scale, __m128i mask) {
+    return _mm_or_si128(_mm_and_si128(_mm_mulhi_epu16(v, scale), mask),
+                        _mm_andnot_si128(mask, v));
+}
+
+__attribute__((target("sse2")))
+static void xform_sse2(const Program & p, etherdream_point * pts, size_t n) {
+    const __m128i clip_lo = _mm_set1_epi32(pair16(p.clip[0], p.clip[1]));
+    const __m128i clip_hi = _mm_set1_epi32(pair16(p.clip[2], p.clip[3]));
+    const __m128i scale_rg = _mm_set1_epi32(scale_pair(p, 0, false));
+    const __m128i mask_rg = _mm_set1_epi32(scale_pair(p, 0, true));
+    const __m128i scale_bi = _mm_set1_epi32(scale_pair(p, 2, false));
+    const __m128i mask_bi = _mm_set1_epi32(scale_pair(p, 2, true));
+    size_t i;
+
+    colors_scalar(p, pts, n & ~3, true);
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m128i * q = (__m128i *)(pts + i);
+
+        __m128i p0 = _mm_loadu_si128(q), p1 = _mm_loadu_si128(q + 1);
+        __m128i p2 = _mm_loadu_si128(q + 2), p3 = _mm_loadu_si128(q + 3);
+        __m128i t0 = _mm_unpacklo_epi32(p0, p1), t1 = _mm_unpacklo_epi32(p2, p3);
+        __m128i t2 = _mm_unpackhi_epi32(p0, p1), t3 = _mm_unpackhi_epi32(p2, p3);
+        __m128i xy = _mm_unpacklo_epi64(t0, t1), rg = _mm_unpackhi_epi64(t0, t1);
+        __m128i bi = _mm_unpacklo_epi64(t2, t3), uu = _mm_unpackhi_epi64(t2, t3);
+
+        rg = scale_sse2(rg, scale_rg, mask_rg);
+        bi = scale_sse2(bi, scale_bi, mask_bi);
+
+        xy = geometry_sse2(p, xy);
+        __m128i clipped = _mm_min_epi16(_mm_max_epi16(xy, clip_lo), clip_hi);
+        if (p.clip_blank) {
+            __m128i keep = _mm_cmpeq_epi32(clipped, xy);
+            rg = _mm_and_si128(rg, keep);
+            bi = _mm_and_si128(bi, keep);
+        }
+        xy = clipped;
+
+        t0 = _mm_unpacklo_epi64(xy, rg);
+        t1 = _mm_unpackhi_epi64(xy, rg);
+        t2 = _mm_unpacklo_epi64(bi, uu);
+        t3 = _mm_unpackhi_epi64(bi, uu);
+        t0 = _mm_shuffle_epi32(t0, 0xd8);
+        t1 = _mm_shuffle_epi32(t1, 0xd8);
+        t2 = _mm_shuffle_epi32(t2, 0xd8);
+        t3 = _mm_shuffle_epi32(t3, 0xd8);
+        _mm_storeu_si128(q, _mm_unpacklo_epi64(t0, t2));
+        _mm_storeu_si128(q + 1, _mm_unpackhi_epi64(t0, t2));
+        _mm_storeu_si128(q + 2, _mm_unpacklo_epi64(t1, t3));
+        _mm_storeu_si128(q + 3, _mm_unpackhi_epi64(t1, t3));
+    }
+
+    xform_scalar(p, pts + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i geometry_avx2(const Program & p, __m256i xy) {
+    __m256i x, y;
+    if (p.affine) {
+        x = _mm256_madd_epi16(xy, _mm256_set1_epi32(pair16(p.q[0][0], p.q[0][1])));
+        y = _mm256_madd_epi16(xy, _mm256_set1_epi32(pair16(p.q[1][0], p.q[1][1])));
+        x = _mm256_srai_epi32(_mm256_add_epi32(x, _mm256_set1_epi32(p.q[0][2])), Q);
+        y = _mm256_srai_epi32(_mm256_add_epi32(y, _mm256_set1_epi32(p.q[1][2])), Q);
+    } else {
+        __m256 fx = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(xy, 16), 16));
+        __m256 fy = _mm256_cvtepi32_ps(_mm256_srai_epi32(xy, 16));
+        __m256 v[3];
+        for (int r = 0; r < 3; r++) {
+            v[r] = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(p.f[r][0]), fx),
+                                               _mm256_mul_ps(_mm256_set1_ps(p.f[r][1]), fy)),
+                                 _mm256_set1_ps(p.f[r][2]));
+        }
+        __m256 lo = _mm256_set1_ps(-32768.0f), hi = _mm256_set1_ps(32767.0f);
+        x = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_div_ps(v[0], v[2]), lo), hi));
+        y = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_div_ps(v[1], v[2]), lo), hi));
+    }
+
+    __m256i v = _mm256_packs_epi32(x, y);
+    return _mm256_unpacklo_epi16(v, _mm256_srli_si256(v, 8));
+}
+
+/* Look up both halves of each 32-bit lane in tables a and b. */
+__attribute__((target("avx2")))
+static inline __m256i lut_avx2(const Program & p, int a, int b, __m256i v) {
+    const __m256i low = _mm256_set1_epi32(0xffff);
+    __m256i lo = _mm256_and_si256(v, low);
+    __m256i hi = _mm256_srli_epi32(v, 16);
+    if (p.color[a] == Program::LUT) {
+        lo = _mm256_and_si256(_mm256_i32gather_epi32((const int *)p.lut[a],
+                                  _mm256_srli_epi32(lo, 4), 2), low);
+    }
+    if (p.color[b] == Program::LUT) {
+        hi = _mm256_and_si256(_mm256_i32gather_epi32((const int *)p.lut[b],
+                                  _mm256_srli_epi32(hi, 4), 2), low);
+    }
+    return _mm256_or_si256(lo, _mm256_slli_epi32(hi, 16));
+}
+
+__attribute__((target("avx2")))
+static void xform_avx2(const Program & p, etherdream_point * pts, size_t n) {
+    const __m256i clip_lo = _mm256_set1_epi32(pair16(p.clip[0], p.clip[1]));
+    const __m256i clip_hi = _mm256_set1_epi32(pair16(p.clip[2], p.clip[3]));
+    const __m256i scale_rg = _mm256_set1_epi32(scale_pair(p, 0, false));
+    const __m256i mask_rg = _mm256_set1_epi32(scale_pair(p, 0, true));
+    const __m256i scale_bi = _mm256_set1_epi32(scale_pair(p, 2, false));
+    const __m256i mask_bi = _mm256_set1_epi32(scale_pair(p, 2, true));
+    bool rg_lut = p.color[0] == Program::LUT || p.color[1] == Program::LUT;
+    bool bi_lut = p.color[2] == Program::LUT || p.color[3] == Program::LUT;
+    size_t i;
+
+    /* Each load holds two points, one per 128-bit lane, and the unpacks
+     * work within lanes, so the transposed registers hold points
+     * 0, 2, 4, 6 in the low lane and 1, 3, 5, 7 in the high one. */
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256i * q = (__m256i *)(pts + i);
+        __m256i p0 = _mm256_loadu_si256(q), p1 = _mm256_loadu_si256(q + 1);
+        __m256i p2 = _mm256_loadu_si256(q + 2), p3 = _mm256_loadu_si256(q + 3);
+        __m256i t0 = _mm256_unpacklo_epi32(p0, p1), t1 = _mm256_unpacklo_epi32(p2, p3);
+        __m256i t2 = _mm256_unpackhi_epi32(p0, p1), t3 = _mm256_unpackhi_epi32(p2, p3);
+        __m256i xy = _mm256_unpacklo_epi64(t0, t1), rg = _mm256_unpackhi_epi64(t0, t1);
+        __m256i bi = _mm256_unpacklo_epi64(t2, t3), uu = _mm256_unpackhi_epi64(t2, t3);
+
+        if (rg_lut) {
+            rg = lut_avx2(p, 0, 1, rg);
+        }
+        if (bi_lut) {
+            bi = lut_avx2(p, 2, 3, bi);
+        }
+        rg = _mm256_or_si256(_mm256_and_si256(_mm256_mulhi_epu16(rg, scale_rg), mask_rg),
+                             _mm256_andnot_si256(mask_rg, rg));
+        bi = _mm256_or_si256(_mm256_and_si256(_mm256_mulhi_epu16(bi, scale_bi), mask_bi),
+                             _mm256_andnot_si256(mask_bi, bi));
+
+        xy = geometry_avx2(p, xy);
+        __m256i clipped = _mm256_min_epi16(_mm256_max_epi16(xy, clip_lo), clip_hi);
+        if (p.clip_blank) {
+            __m256i keep = _mm256_cmpeq_epi32(clipped, xy);
+            rg = _mm256_and_si256(rg, keep);
+            bi = _mm256_and_si256(bi, keep);
+        }
+        xy = clipped;
+
+        t0 = _mm256_unpacklo_epi64(xy, rg);
+        t1 = _mm256_unpackhi_epi64(xy, rg);
+        t2 = _mm256_unpacklo_epi64(bi, uu);
+        t3 = _mm256_unpackhi_epi64(bi, uu);
+        t0 = _mm256_shuffle_epi32(t0, 0xd8);
+        t1 = _mm256_shuffle_epi32(t1, 0xd8);
+        t2 = _mm256_shuffle_epi32(t2, 0xd8);
+        t3 = _mm256_shuffle_epi32(t3, 0xd8);
+        _mm256_storeu_si256(q, _mm256_unpacklo_epi64(t0, t2));
+        _mm256_storeu_si256(q + 1, _mm256_unpackhi_epi64(t0, t2));
+        _mm256_storeu_si256(q + 2, _mm256_unpacklo_epi64(t1, t3));
+        _mm256_storeu_si256(q + 3, _mm256_unpackhi_epi64(t1, t3));
+    }
+
+    xform_sse2(p, pts + i, n - i);
+}
+
+#endif
+
+#if HAVE_NEON
+
+static inline uint32x4_t scale_neon(uint32x4_t v, uint16x8_t scale,
+                                    uint16x8_t mask) {
+    uint16x8_t c = vreinterpretq_u16_u32(v);
+    uint16x8_t lo = vshrn_high_n_u32(vshrn_n_u32(vmull_u16(vget_low_u16(c), vget_low_u16(scale)), 16),
+                                     vmull_high_u16(c, scale), 16);
+    return vreinterpretq_u32_u16(vbslq_u16(mask, lo, c));
+}
+
+/* vld4q_u32 does the transpose for us: val[0] is (x, y) for four points,
+ * val[1] (r, g), val[2] (b, i) and val[3] (u1, u2). vqrshrn adds the
+ * rounding half itself, so it is taken back out of the offset. */
+static void xform_neon(const Program & p, etherdream_point * pts, size_t n) {
+    const int16x8_t clip_lo = vreinterpretq_s16_s32(vdupq_n_s32(pair16(p.clip[0], p.clip[1])));
+    const int16x8_t clip_hi = vreinterpretq_s16_s32(vdupq_n_s32(pair16(p.clip[2], p.clip[3])));
+    const int32_t half = 1 << (Q - 1);
+    const uint16x8_t scale_rg = vreinterpretq_u16_s32(vdupq_n_s32(scale_pair(p, 0, false)));
+    const uint16x8_t mask_rg = vreinterpretq_u16_s32(vdupq_n_s32(scale_pair(p, 0, true)));
+    const uint16x8_t scale_bi = vreinterpretq_u16_s32(vdupq_n_s32(scale_pair(p, 2, false)));
+    const uint16x8_t mask_bi = vreinterpretq_u16_s32(vdupq_n_s32(scale_pair(p, 2, true)));
+    size_t i;
+
+    colors_scalar(p, pts, n & ~3, true);
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        uint32_t * q = (uint32_t *)(pts + i);
+
+        uint32x4x4_t v = vld4q_u32(q);
+        v.val[1] = scale_neon(v.val[1], scale_rg, mask_rg);
+        v.val[2] = scale_neon(v.val[2], scale_bi, mask_bi);
+        int32x4_t xy32 = vreinterpretq_s32_u32(v.val[0]);
+        int16x4_t x = vmovn_s32(xy32);
+        int16x4_t y = vshrn_n_s32(xy32, 16);
+        int16x4_t nx, ny;
+
+        if (p.affine) {
+            int32x4_t X = vmlal_n_s16(vmlal_n_s16(vdupq_n_s32(p.q[0][2] - half),
+                                                  x, p.q[0][0]), y, p.q[0][1]);
+            int32x4_t Y = vmlal_n_s16(vmlal_n_s16(vdupq_n_s32(p.q[1][2] - half),
+                                                  x, p.q[1][0]), y, p.q[1][1]);
+            nx = vqrshrn_n_s32(X, Q);
+            ny = vqrshrn_n_s32(Y, Q);
+        } else {
+            float32x4_t fx = vcvtq_f32_s32(vmovl_s16(x));
+            float32x4_t fy = vcvtq_f32_s32(vmovl_s16(y));
+            float32x4_t f[3];
+            for (int r = 0; r < 3; r++) {
+                f[r] = vaddq_f32(vaddq_f32(vmulq_n_f32(fx, p.f[r][0]),
+                                           vmulq_n_f32(fy, p.f[r][1])),
+                                 vdupq_n_f32(p.f[r][2]));
+            }
+            float32x4_t lo = vdupq_n_f32(-32768.0f), hi = vdupq_n_f32(32767.0f);
+            nx = vmovn_s32(vcvtnq_s32_f32(vminq_f32(vmaxq_f32(vdivq_f32(f[0], f[2]), lo), hi)));
+            ny = vmovn_s32(vcvtnq_s32_f32(vminq_f32(vmaxq_f32(vdivq_f32(f[1], f[2]), lo), hi)));
+        }
+
+        int16x4x2_t z = vzip_s16(nx, ny);
+        int16x8_t out = vcombine_s16(z.val[0], z.val[1]);
+        int16x8_t clipped = vminq_s16(vmaxq_s16(out, clip_lo), clip_hi);
+        if (p.clip_blank) {
+            uint32x4_t keep = vceqq_u32(vreinterpretq_u32_s16(clipped),
+                                        vreinterpretq_u32_s16(out));
+            v.val[1] = vandq_u32(v.val[1], keep);
+            v.val[2] = vandq_u32(v.val[2], keep);
+        }
+        v.val[0] = vreinterpretq_u32_s16(clipped);
+        vst4q_u32(q, v);
+    }
+
+    xform_scalar(p, pts + i, n - i);
+}
+
+#endif
+
+typedef void (*xform_fn)(const Program &, etherdream_point *, size_t);
+
+static std::atomic<xform_fn> xform_kernel;
+
+/* Choose the fastest kernel this CPU can run. */
+static xform_fn xform_pick() {
+#if HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return xform_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return xform_sse2;
+#endif
+    /* Even when built, xform_neon has to be asked for with
+     * XFORM_KERNEL_NEON. */
+    return xform_scalar;
+}
+
+void PointTransform::apply(etherdream_point * pts, size_t n) const {
+    if (m_prog.identity) {
+        return;
+    }
+    xform_fn fn = xform_kernel.load(std::memory_order_relaxed);
+    if (!fn) {
+        fn = xform_pick();
+        xform_kernel.store(fn, std::memory_order_relaxed);
+    }
+    fn(m_prog, pts, n);
+}
+
+int xform_set_kernel(XformKernel kernel) {
+    xform_fn fn = nullptr;
+
+    switch (kernel) {
+    case XFORM_KERNEL_AUTO:
+        fn = xform_pick();
+        break;
+    case XFORM_KERNEL_SCALAR:
+        fn = xform_scalar;
+        break;
+#if HAVE_X86_SIMD
+    case XFORM_KERNEL_SSE2:
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse2"))
+            fn = xform_sse2;
+        break;
+    case XFORM_KERNEL_AVX2:
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            fn = xform_avx2;
+        break;
+#endif
+#if HAVE_NEON
+    case XFORM_KERNEL_NEON:
+        fn = xform_neon;
+        break;
+#endif
+    default:
+        break;
+    }
+
+    if (!fn)
+        return -1;
+    xform_kernel.store(fn, std::memory_order_relaxed);
+    return 0;
+}
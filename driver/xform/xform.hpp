@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "etherdream.h"
+
+/* A calibration, as the players and the user think of it: a 3x3 matrix
+ * taking (x, y, 1) to (x', y', w), in coordinates where the DAC's range is
+ * -1 to 1; gain, offset and gamma for each of r, g, b and i, as
+ *
+ *     out = offset + gain * in ^ gamma
+ *
+ * with in and out running from 0 to 1, except that an input of 0 (or
+ * anything below 1/4096) always comes out as 0, so that an offset never
+ * lights up a blanked point; and a clip rectangle, outside of which points
+ * are either pulled in to the edge or, with clip_blank, also blanked. The
+ * default calibration changes nothing.
+ */
+struct Calibration {
+    double matrix[3][3] = { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } };
+    double gain[4] = { 1, 1, 1, 1 };
+    double offset[4] = { 0, 0, 0, 0 };
+    double gamma[4] = { 1, 1, 1, 1 };
+    double clip[4] = { -1, -1, 1, 1 };    /* x min, y min, x max, y max */
+    bool clip_blank = false;
+
+    /* The size, offset and brightness options every player takes. A
+     * negative size flips that axis; brightness scales r, g and b. */
+    static Calibration scale_offset(double x_size, double y_size,
+                                    double x_offset, double y_offset,
+                                    double brightness);
+};
+
+/* A Calibration compiled down to what the kernels run: the matrix as Q14
+ * integers when it is affine and small enough, otherwise as floats for the
+ * divide; for each colour channel, nothing, a 16-bit multiply when it's
+ * just dimmed, or a 4096-entry table; and the clip rectangle in DAC units.
+ */
+class PointTransform {
+public:
+    PointTransform();
+
+    /* Returns false, leaving the transform as it was, if the matrix
+     * doesn't keep w positive over the whole of the DAC's range. */
+    bool compile(const Calibration & c);
+
+    /* Transform n points in place. */
+    void apply(etherdream_point * pts, size_t n) const;
+
+    /* Goes up by one with every successful compile(), so that anything
+     * holding on to transformed points can tell when they're stale. */
+    unsigned version() const { return m_version; }
+
+    /* The compiled form; only xform.cpp looks inside. */
+    struct Program {
+        bool affine;
+        int32_t q[2][3];        /* affine: Q14, rounding folded into q[n][2] */
+        float f[3][3];          /* projective, in DAC units */
+        int16_t clip[4];
+        bool clip_blank;
+        bool identity;          /* nothing to do at all */
+        enum { KEEP, SCALE, LUT } color[4];
+        uint16_t scale[4];      /* SCALE: out = in * scale >> 16 */
+        /* LUT: indexed by the top 12 bits of each channel. One spare entry at
+         * the end, as the AVX2 gathers read 32 bits for each entry. */
+        uint16_t lut[4][4097];
+    };
+
+private:
+    Program m_prog;
+    unsigned m_version;
+};
+
+/* As with ilda_set_decode_kernel(), the fastest kernel this CPU supports
+ * is used by default, apart from NEON, which is only built with
+ * -DXFORM_NEON and then has to be asked for; this forces one, for
+ * benchmarking and testing. They all give identical results. Returns 0 on
+ * success, -1 if this CPU or build can't run the one asked for. */
+enum XformKernel {
+    XFORM_KERNEL_AUTO,
+    XFORM_KERNEL_SCALAR,
+    XFORM_KERNEL_SSE2,
+    XFORM_KERNEL_AVX2,
+    XFORM_KERNEL_NEON,
+};
+
+int xform_set_kernel(XformKernel kernel);
@@ -0,0 +1,186 @@
+/* Time PointTransform::apply() with each kernel this CPU supports, for a
+ * few calibrations, against the per-point double arithmetic the players
+ * used to do, and check that every kernel's output matches the scalar
+ * one's exactly, for every count of points up to the one asked for as well
+ * as that one. Results are printed as one line of key=value pairs per
+ * kernel and calibration; the exit status is nonzero on a mismatch.
+ */
+
+#include "xform.hpp"
+
+#include <getopt.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+static const struct {
+    XformKernel kernel;
+    const char * name;
+} kernels[] = {
+    { XFORM_KERNEL_SCALAR, "scalar" },
+    { XFORM_KERNEL_SSE2, "sse2" },
+    { XFORM_KERNEL_AVX2, "avx2" },
+    { XFORM_KERNEL_NEON, "neon" },
+};
+
+static long long monotonic_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static void usage(const char * argv0) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "Options:\n"
+        "\t-n points   Points per call (default: 1600)\n"
+        "\t-t msecs    Time to run each case for (default: 500)\n",
+        argv0);
+}
+
+/* What play.cpp and wplay.cpp used to do to every point. */
+static void apply_double(etherdream_point * pts, size_t n) {
+    const double x_size = 0.5, y_size = -0.5, x_offset = 0.25;
+    const double y_offset = 0, brightness = 0.75;
+    for (size_t i = 0; i < n; i++) {
+        pts[i].x = pts[i].x * x_size + (x_offset * 32767);
+        pts[i].y = pts[i].y * y_size + (y_offset * 32767);
+        pts[i].r *= brightness;
+        pts[i].g *= brightness;
+        pts[i].b *= brightness;
+    }
+}
+
+static void report(const char * kernel, const char * cal, int npoints,
+                   long calls, long long elapsed) {
+    printf("kernel=%s calibration=%s points=%d mpoints_per_sec=%.1f "
+           "ns_per_point=%.3f\n",
+           kernel, cal, npoints,
+           (double)calls * npoints * 1000.0 / elapsed,
+           (double)elapsed / calls / npoints);
+}
+
+int main(int argc, char **argv) {
+    int npoints = 1600, msecs = 500;
+    int opt, failed = 0;
+
+    while ((opt = getopt(argc, argv, "n:t:h")) != -1) {
+        switch (opt) {
+        case 'n': npoints = atoi(optarg); break;
+        case 't': msecs = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (npoints < 1 || msecs < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<etherdream_point> in(npoints), ref(npoints), out(npoints);
+    srand(1);
+    for (auto & p : in) {
+        p.x = rand();
+        p.y = rand();
+        p.r = rand();
+        p.g = rand();
+        p.b = rand();
+        p.i = rand();
+        p.u1 = rand();
+        p.u2 = rand();
+    }
+
+    /* The players' options; a rotation with gamma on every channel; a
+     * keystone, which needs the projective path; and a clip window with
+     * blanking. */
+    struct {
+        const char * name;
+        Calibration cal;
+    } cases[4];
+
+    cases[0].name = "scale_offset";
+    cases[0].cal = Calibration::scale_offset(0.5, -0.5, 0.25, 0, 0.75);
+
+    cases[1].name = "rotate_gamma";
+    cases[1].cal.matrix[0][0] = 0.6;
+    cases[1].cal.matrix[0][1] = -0.8;
+    cases[1].cal.matrix[1][0] = 0.8;
+    cases[1].cal.matrix[1][1] = 0.6;
+    for (int ch = 0; ch < 4; ch++) {
+        cases[1].cal.gamma[ch] = 2.2;
+        cases[1].cal.gain[ch] = 0.9;
+        cases[1].cal.offset[ch] = 0.02;
+    }
+
+    cases[2].name = "keystone";
+    cases[2].cal.matrix[0][0] = 0.8;
+    cases[2].cal.matrix[1][1] = 0.7;
+    cases[2].cal.matrix[2][1] = 0.3;
+
+    cases[3].name = "clip_blank";
+    cases[3].cal = Calibration::scale_offset(1.2, 1.2, 0.1, -0.1, 1);
+    cases[3].cal.clip[0] = -0.9;
+    cases[3].cal.clip[3] = 0.8;
+    cases[3].cal.clip_blank = true;
+
+    for (const auto & c : cases) {
+        PointTransform t;
+        if (!t.compile(c.cal)) {
+            fprintf(stderr, "%s: calibration rejected\n", c.name);
+            return 1;
+        }
+
+        for (const auto & k : kernels) {
+            if (xform_set_kernel(k.kernel) < 0)
+                continue;
+
+            for (int n = 0; n <= npoints; n = n < 64 ? n + 1 : npoints) {
+                memcpy(ref.data(), in.data(), n * sizeof ref[0]);
+                xform_set_kernel(XFORM_KERNEL_SCALAR);
+                t.apply(ref.data(), n);
+                memcpy(out.data(), in.data(), n * sizeof out[0]);
+                xform_set_kernel(k.kernel);
+                t.apply(out.data(), n);
+                if (memcmp(out.data(), ref.data(), n * sizeof out[0])) {
+                    fprintf(stderr, "%s: %s, %d points: output differs "
+                            "from scalar\n", k.name, c.name, n);
+                    failed = 1;
+                    break;
+                }
+                if (n == npoints)
+                    break;
+            }
+
+            long long start = monotonic_ns(), elapsed;
+            long long deadline = start + msecs * 1000000LL;
+            long calls = 0;
+            do {
+                for (int i = 0; i < 64; i++)
+                    t.apply(out.data(), npoints);
+                calls += 64;
+                elapsed = monotonic_ns() - start;
+            } while (start + elapsed < deadline);
+
+            report(k.name, c.name, npoints, calls, elapsed);
+        }
+    }
+
+    /* The old way, for comparison with scale_offset. */
+    long long start = monotonic_ns(), elapsed;
+    long long deadline = start + msecs * 1000000LL;
+    long calls = 0;
+    do {
+        for (int i = 0; i < 64; i++)
+            apply_double(out.data(), npoints);
+        calls += 64;
+        elapsed = monotonic_ns() - start;
+    } while (start + elapsed < deadline);
+
+    report("double", "scale_offset", npoints, calls, elapsed);
+
+    return failed;
+}